@@ -0,0 +1,6 @@
+#!/bin/bash
+# Native Linux build, e.g. for batch runs and ./sorter --benchmark
+gcc -O2 sorter.c \
+    -o sorter \
+    `pkg-config --cflags --libs gtk4` \
+    -lm
@@ -5,28 +5,306 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/stat.h>
 
 #ifdef GDK_WINDOWING_WIN32
 #include <windows.h>
 #endif
 
+// SSE2 is part of x86-64; AVX2 is used if the CPU has it
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SORTER_X86_SIMD 1
+#endif
+
 // ===========================
 // Data Model and Helper Types
 // ===========================
 
+// Categorical columns that take part in balancing: these three always,
+// followed by any columns declared in the cost configuration
+enum {
+    ATTR_GRUNDSCHULE,
+    ATTR_GENDER,
+    ATTR_BG_GUTACHTEN,
+    NUM_BUILTIN_ATTRIBUTES
+};
+
+#define MAX_ATTRIBUTES 32
+#define MAX_ATTRIBUTE_NAME 64
+
+// Code for a missing value; never matches anything, including itself
+#define ATTR_CODE_NONE (-1)
+
+// Bump allocator: allocations are carved out of large chunks and only
+// released all at once
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;   // Chunk currently allocated from
+    size_t chunk_size;
+} Arena;
+
+#define ARENA_ALIGNMENT 16
+#define COHORT_ARENA_CHUNK_SIZE (256 * 1024)
+#define SCRATCH_ARENA_CHUNK_SIZE 4096
+
 typedef struct {
     char *first_name;
     char *last_name;
-    char *gender;
-    char *elementary_school;
-    char *bg_gutachten;
+    char *id;                  // Optional stable ID column, NULL if the file has none
 } Student;
 
+// Interned values of one categorical column. Values are matched on their
+// case-folded form; the spelling of the first occurrence is kept for display.
+typedef struct {
+    char **values;
+    char **keys;
+    int count;
+    int capacity;
+    int *slots;     // Open-addressing hash table of codes, -1 marks a free slot
+    int num_slots;
+    Arena *arena;   // Owns the value and key strings
+} AttributeDict;
+
+// Hash table from a key (full name or ID) to student indices. A key that
+// several students share is stored once, with its shared flag set, so
+// lookups can tell a unique match from an ambiguous one.
+typedef struct {
+    int *slots;     // Student index, -1 marks a free slot
+    bool *shared;
+    int num_slots;
+} StudentIndex;
+
+// Stages of loading and distributing a cohort that a Profile times
+typedef enum {
+    PHASE_LOAD_CSV,
+    PHASE_SNAPSHOT_LOAD,
+    PHASE_SNAPSHOT_WRITE,
+    PHASE_NAME_INDEX,
+    PHASE_RULE_RESOLUTION,
+    PHASE_UNION_FIND,
+    PHASE_GROUP_BUILD,
+    PHASE_PLACEMENT,
+    PHASE_IMPROVE,
+    PHASE_STATS,
+    PHASE_WIDGETS,
+    NUM_PHASES
+} ProfilePhase;
+
+typedef enum {
+    COUNTER_STUDENTS_LOADED,
+    COUNTER_SHORT_LINES,
+    COUNTER_DUPLICATE_KEYS,
+    COUNTER_KEY_COMPARISONS,    // Key comparisons while building the lookup tables
+    COUNTER_RULES_RESOLVED,
+    COUNTER_RULES_IGNORED,
+    COUNTER_COST_EVALUATIONS,   // Per-student cost or move delta evaluations
+    COUNTER_MOVES_PROPOSED,
+    COUNTER_MOVES_ACCEPTED,
+    NUM_COUNTERS
+} ProfileCounter;
+
+// Time spent per phase and event counts, collected while profiling is on
+// (--profile or SORTER_PROFILE). Code that has no profile passes NULL and
+// pays nothing. Threads add their totals once per call, so the lock is
+// never contended in a hot loop; phases that run on several threads at
+// once add up their threads' times.
+typedef struct {
+    GMutex lock;
+    gint64 usec[NUM_PHASES];
+    long calls[NUM_PHASES];
+    long counters[NUM_COUNTERS];
+} Profile;
+
+typedef struct Assignment Assignment;
+
+// The balanced columns, their weighting and the kernels that evaluate it.
+// Columns and weights are fixed once a cohort is loaded, so
+// cost_model_select_kernels picks kernels specialised for them once instead
+// of every evaluation testing and multiplying weights.
+typedef struct {
+    int num_attributes;
+    char names[MAX_ATTRIBUTES][MAX_ATTRIBUTE_NAME];     // Column headers in the student file
+    double weights[MAX_ATTRIBUTES];     // Per shared value; 0 leaves the attribute out
+    int active[MAX_ATTRIBUTES];         // Attributes with a non-zero weight
+    int num_active;
+    const char *kernel;                 // Name of the chosen kernels, for diagnostics
+    double (*placement_cost)(const Assignment *assignment, int class_index, int student);
+    double (*move_delta)(const Assignment *assignment, int student, int from, int to);
+    void (*accumulate_row)(double *deltas, const int *row, double weight, int num_classes);
+    const char *instruction_set;        // Used by accumulate_row, for diagnostics
+} CostModel;
+
+// Results of cohort_find_student besides a valid index
+#define STUDENT_NOT_FOUND (-1)
+#define STUDENT_AMBIGUOUS (-2)
+
+// A loaded student file. The students and every string they or the
+// dictionaries refer to live in the cohort's arena, or in the mapped
+// snapshot if the cohort was restored from one.
+typedef struct {
+    Arena arena;
+    GMappedFile *snapshot;
+    const char *source_path;    // The CSV file, which also names the snapshot
+    Student *students;
+    int num_students;
+    int num_attributes;
+    AttributeDict attributes[MAX_ATTRIBUTES];
+    const int *codes;       // Column by column: attribute a of student i is codes[a * num_students + i]
+    bool has_ids;
+    StudentIndex by_name;   // "Vorname Nachname", as rules refer to students
+    StudentIndex by_id;
+    Profile *profile;       // NULL unless profiling; owned by whoever loaded the cohort
+    CostModel cost;         // As passed to load_cohort
+} Cohort;
+
+typedef enum {
+    RULE_SAME_CLASS,    // "A und B sollen in dieselbe Klasse"
+    RULE_SEPARATE       // A and B must not share a class
+} RuleKind;
+
 typedef struct {
     char *student_a;
     char *student_b;
+    RuleKind kind;
 } Rule;
 
+// Growable, always NUL-terminated string
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} StringBuilder;
+
+// Placement of every student plus running per-class attribute histograms.
+// Counts are laid out code-major, so the counts of one attribute value
+// across all classes are contiguous.
+struct Assignment {
+    const CostModel *cost;      // The cohort's
+    const int *codes;           // The cohort's, column by column
+    int num_classes;
+    int num_students;
+    int *class_of;              // Class index per student, -1 while unplaced
+    int *class_sizes;
+    int *counts;                // counts[(offset[a] + code) * num_classes + class]
+    int offset[MAX_ATTRIBUTES];
+    int num_codes;
+};
+
+// Row of a class list and the list model behind a class tab, see Class List Model
+#define SORTER_TYPE_STUDENT_ITEM (sorter_student_item_get_type())
+G_DECLARE_FINAL_TYPE(SorterStudentItem, sorter_student_item, SORTER, STUDENT_ITEM, GObject)
+
+#define SORTER_TYPE_CLASS_LIST (sorter_class_list_get_type())
+G_DECLARE_FINAL_TYPE(SorterClassList, sorter_class_list, SORTER, CLASS_LIST, GObject)
+
+// Widgets of one class tab
+typedef struct {
+    SorterClassList *students;      // Owned by the selection, which the column view owns
+    GtkSingleSelection *selection;
+    GtkWidget *tab_label;
+    GtkWidget *stats_label;     // The class's entry on the statistics tab
+    GtkWidget *target_dropdown; // Where the move button sends the selected student
+} ClassView;
+
+typedef struct DistributionJob DistributionJob;
+
+// State of a sorter window. The window owns the cohort, the rules and the
+// displayed assignment, which manual moves change in place.
+typedef struct {
+    GtkWidget *window;
+    GtkWidget *notebook;
+    GtkWidget *rule_textview;
+    GtkWidget *cost_label;
+    GtkWidget *add_rule_button;
+    GtkWidget *redistribute_button;
+    GtkWidget *progress_box;        // Shown while a distribution job runs
+    GtkWidget *progress_bar;
+    GArray *rules;
+    Cohort *cohort;
+    int num_classes;
+    Assignment assignment;
+    bool has_assignment;
+    double total_cost;
+    double cost_bound;              // compute_cost_lower_bound; reaching it proves a distribution optimal
+    ClassView *class_views;
+    DistributionJob *job;           // Running distribution, or NULL
+    guint progress_timer;
+    bool closed;                    // Destroyed while a job was running
+} SorterWindow;
+
+// Students that must share a class because of same-class rules. All groups
+// of a set share one allocation: the group array is followed by the
+// separation bitsets and a flat member array that each group's members
+// point into (CSR layout).
+//
+// Groups named in separation rules are numbered 0..n-1 by their separation
+// bit. Each has a bitset of the groups it must not share a class with, and
+// a search tracks which of them each class holds in the same layout (see
+// separation_clashes), so a clash check is one AND per 64 groups.
+typedef struct {
+    int root;
+    int *members;
+    int size;
+    int separation;         // Bit of this group in the bitsets, -1 without separation rules
+    const uint64_t *avoid;  // Groups this one must not share a class with, NULL if none
+} StudentGroup;
+
+// Small, fast generator (xorshift64*) so that every search thread can own
+// one and runs are reproducible from a seed
+typedef struct {
+    uint64_t state;
+} Rng;
+
+typedef enum {
+    SOLVER_LOCAL_SEARCH,    // Greedy construction, then hill climbing
+    SOLVER_ANNEALING,       // Greedy construction, then parallel simulated annealing
+    SOLVER_FLOW             // Balanced flow, then hill climbing; local search if there are rules
+} SolverMode;
+
+// Snapshot handed to SolveOptions.progress while a search runs
+typedef struct {
+    double elapsed;         // Seconds since the search started
+    long iterations;        // Moves tried per chain so far
+    double temperature;
+    double current_cost;    // Mean over all annealing chains
+    double best_cost;
+} SolveProgress;
+
+typedef void (*SolveProgressFunc)(const SolveProgress *progress, void *user_data);
+
+// Budget for the improvement phase after the initial distribution. A zero
+// limit means "no limit"; local search also stops once it stops finding
+// improvements. Annealing iteration limits count per chain.
+typedef struct {
+    SolverMode mode;
+    long max_iterations;
+    double time_limit;      // Seconds
+    uint64_t seed;          // 0 picks one from the clock
+    int num_threads;        // Annealing chains; 0 uses one per core
+    SolveProgressFunc progress;
+    void *progress_data;
+    GCancellable *cancellable;  // Ends the search early; the best state so far is kept
+} SolveOptions;
+
+// One finished run of a portfolio; rerunning with options.seed = seed and the
+// same budget reproduces the assignment
+typedef struct {
+    uint64_t seed;
+    double cost;
+    double distance;        // Share of students placed differently from the best entry
+    Assignment assignment;
+} PortfolioEntry;
+
 // Union-Find implementation for grouping students
 typedef struct {
     int *parent;
@@ -34,37 +312,121 @@ typedef struct {
 } UnionFind;
 
 // Function prototypes
-static void load_students(const char *file_path, Student **students, int *num_students);
-static void distribute_students_optimized(Student *students, int num_students, int num_classes, Student ***classes, int **class_sizes);
-static void distribute_students_with_rules(Student *students, int num_students, Rule *rules, int num_rules, 
-                                        int num_classes, Student ***classes, int **class_sizes);
-static char *compute_stats(Student *class_students, int num_students);
-static double compute_cost(Student *class_list, int class_size, Student *s);
-static double compute_group_cost(Student *class_list, int class_size, Student *group, int group_size);
-static void shuffle_students(Student *students, int num_students);
-static void open_add_rule_dialog(GtkWindow *parent, Student *students, int num_students, 
-                               GArray *rules, GtkWidget *rule_textview, GtkNotebook *notebook,
-                               void (*update_tabs_callback)(GtkNotebook*, Student*, int, GArray*, int));
+static void load_students(const char *file_path, const CostModel *cost, Profile *profile, Cohort *cohort);
+static void load_cohort(const char *file_path, bool use_snapshot, Profile *profile, const CostModel *cost,
+                        Cohort *cohort);
+static bool snapshot_write(const Cohort *cohort);
+static void distribute_students(const Cohort *cohort, Rule *rules, int num_rules, int num_classes,
+                                const SolveOptions *options, Assignment *assignment);
+static void distribute_students_optimized(const Cohort *cohort, int num_classes, Rng *rng, Assignment *assignment);
+static bool distribute_students_flow(const Cohort *cohort, int num_classes, Assignment *assignment);
+static double compute_cost_lower_bound(const Cohort *cohort, int num_classes);
+static void distribute_students_with_rules(const Cohort *cohort, StudentGroup *groups, int num_groups, 
+                                        int num_classes, Assignment *assignment);
+static void build_student_groups(const Cohort *cohort, Rule *rules, int num_rules,
+                                 StudentGroup **groups, int *num_groups);
+static void free_student_groups(StudentGroup *groups);
+static void improve_assignment(const Cohort *cohort, const StudentGroup *groups, int num_groups,
+                               const SolveOptions *options, Rng *rng, Assignment *assignment);
+static void anneal_assignment(const Cohort *cohort, const StudentGroup *groups, int num_groups,
+                              const SolveOptions *options, uint64_t seed, Assignment *assignment);
+static double compute_total_cost(const Cohort *cohort, const Assignment *assignment);
+static void run_portfolio(const Cohort *cohort, Rule *rules, int num_rules, int num_classes,
+                          const SolveOptions *options, int num_starts, int top_k, double min_distance,
+                          PortfolioEntry **entries, int *num_entries);
+static void free_portfolio(PortfolioEntry *entries, int num_entries);
+static double assignment_distance(const Assignment *a, const Assignment *b);
+static void solve_options_init(SolveOptions *options);
+static double move_student(const Cohort *cohort, Assignment *assignment, int student, int to);
+static bool assignment_add_rule(const Cohort *cohort, Rule *rules, int num_rules, Assignment *assignment);
+static bool assignment_move_with_rules(const Cohort *cohort, Rule *rules, int num_rules, Assignment *assignment,
+                                       int student, int to, double *delta);
+static int find_contradicting_rule(const Cohort *cohort, const Rule *rules, int num_rules, int num_classes,
+                                   int *num_apart);
+static int count_broken_separations(const Cohort *cohort, const Rule *rules, int num_rules,
+                                    const Assignment *assignment);
+static char *format_class_stats(const Cohort *cohort, const Assignment *assignment, int class_index);
+static char **compute_class_stats(const Cohort *cohort, const Assignment *assignment);
+static void free_class_stats(char **stats, int num_classes);
+static double compute_cost(const Assignment *assignment, int class_index, int student);
+static void compute_move_matrix(const Assignment *assignment, const int *students, int num_students,
+                                double *deltas);
+static void cost_model_init(CostModel *model);
+static bool parse_cost_weights(const char *text, CostModel *model);
+static bool parse_balanced_columns(const char *text, CostModel *model);
+static bool load_cost_config(const char *path, CostModel *model);
+static double compute_group_cost(const Assignment *assignment, int class_index, const int *group,
+                                 int group_size);
+static void shuffle_students(int *order, int num_students, Rng *rng);
+static void rng_seed(Rng *rng, uint64_t seed);
+static uint64_t rng_next(Rng *rng);
+static int rng_index(Rng *rng, int n);
+static double rng_uniform(Rng *rng);
+static void assignment_init(Assignment *assignment, const Cohort *cohort, int num_classes);
+static void assignment_place(Assignment *assignment, const Cohort *cohort, int student, int class_index);
+static void assignment_move(Assignment *assignment, const Cohort *cohort, int student, int class_index);
+static void assignment_copy(Assignment *dest, const Assignment *src);
+static void assignment_rosters(const Assignment *assignment, int **offsets, int **members);
+static void assignment_free(Assignment *assignment);
+static void open_add_rule_dialog(SorterWindow *sorter_window);
 static void update_rule_textview(GtkTextView *textview, GArray *rules);
-static void update_tabs(GtkNotebook *notebook, Student *students, int num_students, GArray *rules, int num_classes);
-static GtkWidget *create_student_treeview(Student *students, int num_students);
+static void update_tabs(SorterWindow *sorter_window);
+static void rebuild_tabs(SorterWindow *sorter_window);
+static void refresh_class_view(SorterWindow *sorter_window, int class_index);
+static void refresh_cost_label(SorterWindow *sorter_window);
+static SorterClassList *sorter_class_list_new(const Cohort *cohort, const int *students, int num_students);
+static void sorter_class_list_set(SorterClassList *list, const int *students, int num_students);
+static int sorter_class_list_student(SorterClassList *list, guint position);
+static void sorter_class_list_remove(SorterClassList *list, guint position);
+static void sorter_class_list_append(SorterClassList *list, int student);
+static GtkWidget *create_class_column_view(const Cohort *cohort, GtkSingleSelection *selection);
 static bool str_equal_ignore_case(const char *s1, const char *s2);
 static char *str_trim(char *str);
 static char *str_dup(const char *str);
+static void arena_init(Arena *arena, size_t chunk_size);
+static void *arena_alloc(Arena *arena, size_t size);
+static char *arena_strndup(Arena *arena, const char *str, size_t length);
+static char *arena_strdup(Arena *arena, const char *str);
+static void arena_reset(Arena *arena);
+static void arena_adopt(Arena *arena, Arena *other);
+static void arena_free(Arena *arena);
 static bool str_is_empty(const char *str);
-static void free_students(Student *students, int num_students);
+static char *str_casefold(const char *str);
+static char *str_casefold_into(const char *str, char *result);
+static void attribute_dict_init(AttributeDict *dict, Arena *arena);
+static int attribute_dict_intern(AttributeDict *dict, const char *value);
+static int attribute_dict_find(const AttributeDict *dict, const char *value);
+static void attribute_dict_free(AttributeDict *dict);
+static const char *cohort_value(const Cohort *cohort, int attribute, int code);
+static int cohort_code(const Cohort *cohort, int attribute, int student);
+static const char *cohort_student_value(const Cohort *cohort, int attribute, int student);
+static void free_cohort(Cohort *cohort);
+static void cohort_build_indexes(Cohort *cohort);
+static int cohort_find_student(const Cohort *cohort, const char *key);
 static void union_find_init(UnionFind *uf, int size);
 static int union_find_find(UnionFind *uf, int i);
 static void union_find_union(UnionFind *uf, int i, int j);
 static void union_find_free(UnionFind *uf);
 static void show_error_dialog(GtkWindow *parent, const char *message);
 static bool str_equal_case(const char *s1, const char *s2);
-
-// Global variables to pass to callback functions
-Student *g_students = NULL;
-int g_num_students = 0;
-int g_num_classes = 5;
-GArray *g_rules = NULL;
+static void string_builder_init(StringBuilder *builder);
+static void string_builder_appendf(StringBuilder *builder, const char *format, ...);
+static char *string_builder_finish(StringBuilder *builder);
+static void load_rules(const char *file_path, Rule **rules, int *num_rules);
+static bool save_rules(const char *file_path, const Rule *rules, int num_rules);
+static void free_rules(Rule *rules, int num_rules);
+static bool write_classes_csv(FILE *fp, const Cohort *cohort, const Assignment *assignment);
+static int run_batch_mode(int argc, char *argv[]);
+static int run_generate_mode(int argc, char *argv[]);
+static int run_benchmark_mode(int argc, char *argv[]);
+static int run_manifest_mode(int argc, char *argv[]);
+static Profile *profile_new(void);
+static void profile_free(Profile *profile);
+static gint64 profile_start(const Profile *profile);
+static void profile_stop(Profile *profile, ProfilePhase phase, gint64 start);
+static void profile_count(Profile *profile, ProfileCounter counter, long n);
+static bool profile_write(Profile *profile, const char *path);
+static char *profile_format(Profile *profile);
 
 // ===========================
 // Memory Management Helpers
@@ -80,15 +442,112 @@ static char *str_dup(const char *str) {
     return result;
 }
 
-static void free_students(Student *students, int num_students) {
-    for (int i = 0; i < num_students; i++) {
-        free(students[i].first_name);
-        free(students[i].last_name);
-        free(students[i].gender);
-        free(students[i].elementary_school);
-        free(students[i].bg_gutachten);
+static void arena_init(Arena *arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->chunk_size = chunk_size;
+}
+
+// Room for size bytes at the next aligned offset of chunk, or NULL
+static void *arena_chunk_take(ArenaChunk *chunk, size_t size) {
+    if (chunk == NULL) return NULL;
+    
+    uintptr_t address = (uintptr_t)(chunk->data + chunk->used);
+    size_t padding = (size_t)(-address & (ARENA_ALIGNMENT - 1));
+    if (chunk->size - chunk->used < padding + size) return NULL;
+    
+    chunk->used += padding + size;
+    return (void*)(address + padding);
+}
+
+static void *arena_alloc(Arena *arena, size_t size) {
+    void *result = arena_chunk_take(arena->head, size);
+    if (result != NULL) return result;
+    
+    // Requests larger than a quarter chunk get a chunk of their own, linked
+    // behind the current one so that its remaining space stays usable
+    bool oversized = size > arena->chunk_size / 4;
+    size_t chunk_size = oversized ? size + ARENA_ALIGNMENT : arena->chunk_size;
+    ArenaChunk *chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + chunk_size);
+    if (chunk == NULL) return NULL;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    
+    if (oversized && arena->head != NULL) {
+        chunk->next = arena->head->next;
+        arena->head->next = chunk;
+    } else {
+        chunk->next = arena->head;
+        arena->head = chunk;
     }
-    free(students);
+    return arena_chunk_take(chunk, size);
+}
+
+static char *arena_strndup(Arena *arena, const char *str, size_t length) {
+    char *result = (char*)arena_alloc(arena, length + 1);
+    if (result != NULL) {
+        memcpy(result, str, length);
+        result[length] = '\0';
+    }
+    return result;
+}
+
+static char *arena_strdup(Arena *arena, const char *str) {
+    if (str == NULL) return NULL;
+    return arena_strndup(arena, str, strlen(str));
+}
+
+// Forgets all allocations but keeps the current chunk for reuse
+static void arena_reset(Arena *arena) {
+    if (arena->head == NULL) return;
+    
+    ArenaChunk *chunk = arena->head->next;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+// Takes over all of other's chunks, leaving other empty
+static void arena_adopt(Arena *arena, Arena *other) {
+    if (other->head == NULL) return;
+    if (arena->head == NULL) {
+        arena->head = other->head;
+        other->head = NULL;
+        return;
+    }
+    
+    // Link them behind the current chunk, which keeps serving allocations
+    ArenaChunk *tail = other->head;
+    while (tail->next != NULL) {
+        tail = tail->next;
+    }
+    tail->next = arena->head->next;
+    arena->head->next = other->head;
+    other->head = NULL;
+}
+
+static void arena_free(Arena *arena) {
+    arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+static void free_cohort(Cohort *cohort) {
+    free(cohort->by_name.slots);
+    free(cohort->by_name.shared);
+    free(cohort->by_id.slots);
+    free(cohort->by_id.shared);
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        attribute_dict_free(&cohort->attributes[a]);
+    }
+    
+    // Students, names, codes and attribute values all go with the arena or the snapshot
+    arena_free(&cohort->arena);
+    if (cohort->snapshot != NULL) g_mapped_file_unref(cohort->snapshot);
+    memset(cohort, 0, sizeof(*cohort));
 }
 
 // ===========================
@@ -146,1028 +605,6035 @@ static bool str_equal_case(const char *s1, const char *s2) {
     return strcmp(s1, s2) == 0;
 }
 
-// ===========================
-// Union-Find Implementation
-// ===========================
+static void string_builder_init(StringBuilder *builder) {
+    builder->capacity = 256;
+    builder->length = 0;
+    builder->data = malloc(builder->capacity);
+    builder->data[0] = '\0';
+}
 
-static void union_find_init(UnionFind *uf, int size) {
-    uf->size = size;
-    uf->parent = (int*)malloc(size * sizeof(int));
-    for (int i = 0; i < size; i++) {
-        uf->parent[i] = i;
+static void string_builder_appendf(StringBuilder *builder, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(builder->data + builder->length, builder->capacity - builder->length, format, args);
+    va_end(args);
+    if (needed < 0) return;
+    
+    // Did not fit: grow and format again
+    if (builder->length + needed + 1 > builder->capacity) {
+        while (builder->length + needed + 1 > builder->capacity) builder->capacity *= 2;
+        builder->data = realloc(builder->data, builder->capacity);
+        
+        va_start(args, format);
+        vsnprintf(builder->data + builder->length, builder->capacity - builder->length, format, args);
+        va_end(args);
     }
+    builder->length += needed;
 }
 
-static int union_find_find(UnionFind *uf, int i) {
-    if (uf->parent[i] != i) {
-        uf->parent[i] = union_find_find(uf, uf->parent[i]);
-    }
-    return uf->parent[i];
+// Hands the string over to the caller, who frees it
+static char *string_builder_finish(StringBuilder *builder) {
+    char *result = builder->data;
+    builder->data = NULL;
+    builder->length = builder->capacity = 0;
+    return result;
 }
 
-static void union_find_union(UnionFind *uf, int i, int j) {
-    int root_i = union_find_find(uf, i);
-    int root_j = union_find_find(uf, j);
-    if (root_i != root_j) {
-        uf->parent[root_j] = root_i;
-    }
+// Lower-cases ASCII and the Latin-1 range of UTF-8 (Ä, Ö, Ü, É, ...), plus
+// U+1E9E capital sharp s. Bytes that are not valid UTF-8 are treated as
+// Latin-1, which is what spreadsheet exports on Windows often produce.
+static char *str_casefold(const char *str) {
+    if (str == NULL) return NULL;
+    
+    // Folding never makes a string longer
+    char *result = malloc(strlen(str) + 1);
+    if (result == NULL) return NULL;
+    
+    return str_casefold_into(str, result);
 }
 
-static void union_find_free(UnionFind *uf) {
-    free(uf->parent);
-    uf->parent = NULL;
-    uf->size = 0;
+// Folds str into result, which must have room for strlen(str) + 1 bytes
+static char *str_casefold_into(const char *str, char *result) {
+    const unsigned char *in = (const unsigned char*)str;
+    unsigned char *out = (unsigned char*)result;
+    while (*in) {
+        if (in[0] < 0x80) {
+            *out++ = (unsigned char)tolower(*in++);
+        } else if (in[0] == 0xC3 && in[1] >= 0x80 && in[1] <= 0xBF) {
+            // U+00C0..U+00DE map to U+00E0..U+00FE, except U+00D7 (multiplication sign)
+            unsigned char c = in[1];
+            if (c <= 0x9E && c != 0x97) c += 0x20;
+            *out++ = 0xC3;
+            *out++ = c;
+            in += 2;
+        } else if (in[0] == 0xE1 && in[1] == 0xBA && in[2] == 0x9E) {
+            *out++ = 0xC3;
+            *out++ = 0x9F;
+            in += 3;
+        } else if (in[0] >= 0xC0 && in[0] <= 0xDE && in[0] != 0xD7 &&
+                   !(in[1] >= 0x80 && in[1] <= 0xBF)) {
+            *out++ = in[0] + 0x20;
+            in++;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = 0;
+    return result;
 }
 
 // ===========================
-// CSV Loading
+// Instrumentation
 // ===========================
 
-static void load_students(const char *file_path, Student **students, int *num_students) {
-    FILE *fp = fopen(file_path, "r");
-    if (!fp) {
-        fprintf(stderr, "Could not open file: %s\n", file_path);
-        *students = NULL;
-        *num_students = 0;
-        return;
-    }
-    
-    // Count lines to allocate memory
-    int line_count = 0;
-    char c;
-    bool in_line = false;
-    while ((c = fgetc(fp)) != EOF) {
-        if (c == '\n') {
-            line_count++;
-            in_line = false;
-        } else if (!in_line) {
-            in_line = true;
-        }
-    }
-    if (in_line) line_count++; // Count the last line if it doesn't end with newline
-    
-    fprintf(stderr, "Total lines in file: %d\n", line_count);
-    
-    if (line_count <= 1) {
-        fclose(fp);
-        *students = NULL;
-        *num_students = 0;
-        return; // Just header or empty file
-    }
-    
-    // Rewind file to start
-    rewind(fp);
-    
-    // Read header
-    char header_line[1024];
-    if (fgets(header_line, sizeof(header_line), fp) == NULL) {
-        fclose(fp);
-        *students = NULL;
-        *num_students = 0;
-        return;
-    }
-    
-    fprintf(stderr, "Header line: %s\n", header_line);
+static const char *const profile_phase_names[NUM_PHASES] = {
+    "load_csv", "snapshot_load", "snapshot_write", "name_index", "rule_resolution",
+    "union_find", "group_build", "placement", "improve", "stats", "widgets"
+};
+
+static const char *const profile_counter_names[NUM_COUNTERS] = {
+    "students_loaded", "short_lines", "duplicate_keys", "key_comparisons", "rules_resolved",
+    "rules_ignored", "cost_evaluations", "moves_proposed", "moves_accepted"
+};
+
+static Profile *profile_new(void) {
+    Profile *profile = g_new0(Profile, 1);
+    g_mutex_init(&profile->lock);
+    return profile;
+}
+
+static void profile_free(Profile *profile) {
+    if (profile == NULL) return;
+    g_mutex_clear(&profile->lock);
+    g_free(profile);
+}
+
+// Start time for profile_stop; reads the clock only when profiling
+static gint64 profile_start(const Profile *profile) {
+    return profile != NULL ? g_get_monotonic_time() : 0;
+}
+
+static void profile_stop(Profile *profile, ProfilePhase phase, gint64 start) {
+    if (profile == NULL) return;
+    gint64 elapsed = g_get_monotonic_time() - start;
     
-    // Find column indices
-    char *headers[256]; // Maximum number of columns
-    int header_count = 0;
+    g_mutex_lock(&profile->lock);
+    profile->usec[phase] += elapsed;
+    profile->calls[phase]++;
+    g_mutex_unlock(&profile->lock);
+}
+
+static void profile_count(Profile *profile, ProfileCounter counter, long n) {
+    if (profile == NULL || n == 0) return;
     
-    // Parse header line manually to handle empty fields
-    char *start = header_line;
-    char *end;
-    while ((end = strchr(start, ',')) != NULL) {
-        *end = '\0';
-        headers[header_count] = str_dup(start);
-        str_trim(headers[header_count]);
-        fprintf(stderr, "Header %d: %s\n", header_count, headers[header_count]);
-        header_count++;
-        start = end + 1;
+    g_mutex_lock(&profile->lock);
+    profile->counters[counter] += n;
+    g_mutex_unlock(&profile->lock);
+}
+
+// Consistent copy, since workers may still be adding to the profile
+static void profile_snapshot(Profile *profile, Profile *copy) {
+    g_mutex_lock(&profile->lock);
+    memcpy(copy->usec, profile->usec, sizeof(copy->usec));
+    memcpy(copy->calls, profile->calls, sizeof(copy->calls));
+    memcpy(copy->counters, profile->counters, sizeof(copy->counters));
+    g_mutex_unlock(&profile->lock);
+}
+
+// Writes the profile as one JSON object to path, or to stderr for "-"
+static bool profile_write(Profile *profile, const char *path) {
+    bool to_stderr = str_equal_case(path, "-");
+    FILE *fp = to_stderr ? stderr : fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open profile file: %s\n", path);
+        return false;
     }
-    // Add the last field
-    headers[header_count] = str_dup(start);
-    str_trim(headers[header_count]);
-    fprintf(stderr, "Header %d: %s\n", header_count, headers[header_count]);
-    header_count++;
     
-    int col_vorname = -1, col_nachname = -1, col_gender = -1;
-    int col_grundschule = -1, col_bg = -1;
+    Profile copy;
+    profile_snapshot(profile, &copy);
     
-    for (int i = 0; i < header_count; i++) {
-        if (str_equal_ignore_case(headers[i], "Vorname")) col_vorname = i;
-        else if (str_equal_ignore_case(headers[i], "Nachname")) col_nachname = i;
-        else if (str_equal_case(headers[i], "m/w")) col_gender = i;
-        else if (str_equal_case(headers[i], "Grundschule")) col_grundschule = i;
-        else if (str_equal_case(headers[i], "BG Gutachten")) col_bg = i;
+    fprintf(fp, "{\"phases\": {");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        fprintf(fp, "%s\"%s\": {\"seconds\": %.6f, \"calls\": %ld}", p > 0 ? ", " : "",
+                profile_phase_names[p], copy.usec[p] / (double)G_USEC_PER_SEC, copy.calls[p]);
     }
-    
-    fprintf(stderr, "Column indices: Vorname=%d, Nachname=%d, m/w=%d, Grundschule=%d, BG Gutachten=%d\n",
-            col_vorname, col_nachname, col_gender, col_grundschule, col_bg);
-    
-    // Free header strings
-    for (int i = 0; i < header_count; i++) {
-        free(headers[i]);
+    fprintf(fp, "}, \"counters\": {");
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        fprintf(fp, "%s\"%s\": %ld", c > 0 ? ", " : "", profile_counter_names[c], copy.counters[c]);
     }
+    fprintf(fp, "}}\n");
     
-    if (col_vorname == -1 || col_nachname == -1 || col_gender == -1 || 
-        col_grundschule == -1 || col_bg == -1) {
-        fprintf(stderr, "Error: Required columns not found in CSV file\n");
-        fclose(fp);
-        *students = NULL;
-        *num_students = 0;
-        return; // Required columns not found
-    }
+    bool ok = !ferror(fp);
+    if (!to_stderr) ok = fclose(fp) == 0 && ok;
+    return ok;
+}
+
+// Phases that ran and non-zero counters, one per line, for the statistics tab
+static char *profile_format(Profile *profile) {
+    Profile copy;
+    profile_snapshot(profile, &copy);
     
-    // Allocate memory for students
-    *num_students = line_count - 1; // Subtract header line
-    *students = (Student*)malloc((*num_students) * sizeof(Student));
-    if (*students == NULL) {
-        fclose(fp);
-        *num_students = 0;
-        return;
+    StringBuilder builder;
+    string_builder_init(&builder);
+    for (int p = 0; p < NUM_PHASES; p++) {
+        if (copy.calls[p] == 0) continue;
+        string_builder_appendf(&builder, "  %s: %.1f ms (%ldx)\n", profile_phase_names[p],
+                               copy.usec[p] / 1000.0, copy.calls[p]);
     }
-    
-    fprintf(stderr, "Allocated memory for %d students\n", *num_students);
-    
-    // Read student records
-    char line[1024];
-    int student_index = 0;
-    
-    while (fgets(line, sizeof(line), fp) != NULL && student_index < *num_students) {
-        // Split line by commas manually to handle empty fields
-        char *fields[256]; // Maximum number of fields
-        int field_count = 0;
-        
-        char *start = line;
-        char *end;
-        while ((end = strchr(start, ',')) != NULL) {
-            *end = '\0';
-            fields[field_count] = str_dup(start);
-            str_trim(fields[field_count]);
-            field_count++;
-            start = end + 1;
-        }
-        // Add the last field
-        fields[field_count] = str_dup(start);
-        str_trim(fields[field_count]);
-        field_count++;
-        
-        fprintf(stderr, "Line %d: %d fields\n", student_index + 1, field_count);
-        
-        if (field_count >= header_count) {
-            // Assign fields to student structure
-            Student *s = &((*students)[student_index]);
-            s->first_name = str_dup(col_vorname < field_count ? fields[col_vorname] : "");
-            s->last_name = str_dup(col_nachname < field_count ? fields[col_nachname] : "");
-            s->gender = str_dup(col_gender < field_count ? fields[col_gender] : "");
-            s->elementary_school = str_dup(col_grundschule < field_count ? fields[col_grundschule] : "");
-            s->bg_gutachten = str_dup(col_bg < field_count ? fields[col_bg] : "");
-            
-            fprintf(stderr, "Loaded student %d: %s %s\n", student_index + 1, s->first_name, s->last_name);
-            student_index++;
-        } else {
-            fprintf(stderr, "Warning: Line %d has fewer fields than expected\n", student_index + 1);
-        }
-        
-        // Free field strings
-        for (int i = 0; i < field_count; i++) {
-            free(fields[i]);
-        }
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        if (copy.counters[c] == 0) continue;
+        string_builder_appendf(&builder, "  %s: %ld\n", profile_counter_names[c], copy.counters[c]);
     }
-    
-    fclose(fp);
-    
-    // Update actual number of students loaded
-    *num_students = student_index;
-    fprintf(stderr, "Successfully loaded %d students\n", *num_students);
+    return string_builder_finish(&builder);
 }
 
 // ===========================
-// Distribution and Statistics
+// Attribute Dictionaries
 // ===========================
 
-static void shuffle_students(Student *students, int num_students) {
-    srand((unsigned int)time(NULL));
-    for (int i = num_students - 1; i > 0; i--) {
-        int j = rand() % (i + 1);
-        // Swap students[i] and students[j]
-        Student temp = students[i];
-        students[i] = students[j];
-        students[j] = temp;
+static unsigned int str_hash(const char *str) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*)str; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
     }
+    return hash;
 }
 
-static void distribute_students_optimized(Student *students, int num_students, int num_classes, 
-                                       Student ***classes, int **class_sizes) {
-    // Allocate memory for classes
-    *classes = (Student**)malloc(num_classes * sizeof(Student*));
-    *class_sizes = (int*)calloc(num_classes, sizeof(int));
-    
-    for (int i = 0; i < num_classes; i++) {
-        (*classes)[i] = (Student*)malloc(num_students * sizeof(Student)); // Max possible size
-    }
-    
-    // Make a copy of students array to shuffle
-    Student *students_copy = (Student*)malloc(num_students * sizeof(Student));
-    memcpy(students_copy, students, num_students * sizeof(Student));
-    
-    // Shuffle students
-    shuffle_students(students_copy, num_students);
+static void attribute_dict_init(AttributeDict *dict, Arena *arena) {
+    memset(dict, 0, sizeof(*dict));
+    dict->arena = arena;
+}
+
+// Returns the slot holding key, or the free slot where it would be inserted
+static int attribute_dict_lookup(const AttributeDict *dict, const char *key, unsigned int hash) {
+    if (dict->num_slots == 0) return -1;
     
-    // Distribute students
-    for (int i = 0; i < num_students; i++) {
-        // Find class with minimum size
-        int min_index = 0;
-        int min_size = (*class_sizes)[0];
-        
-        for (int j = 1; j < num_classes; j++) {
-            if ((*class_sizes)[j] < min_size) {
-                min_size = (*class_sizes)[j];
-                min_index = j;
-            }
+    unsigned int mask = (unsigned int)dict->num_slots - 1;
+    for (unsigned int slot = hash & mask; ; slot = (slot + 1) & mask) {
+        int code = dict->slots[slot];
+        if (code == -1 || strcmp(dict->keys[code], key) == 0) {
+            return (int)slot;
         }
-        
-        // Add student to class
-        (*classes)[min_index][(*class_sizes)[min_index]] = students_copy[i];
-        (*class_sizes)[min_index]++;
     }
-    
-    free(students_copy);
 }
 
-static double compute_cost(Student *class_list, int class_size, Student *s) {
-    int count_grundschule = 0;
-    int count_gender = 0;
-    int count_bg = 0;
+static void attribute_dict_grow(AttributeDict *dict) {
+    int num_slots = dict->num_slots ? dict->num_slots * 2 : 16;
+    int *slots = (int*)malloc(num_slots * sizeof(int));
+    for (int i = 0; i < num_slots; i++) {
+        slots[i] = -1;
+    }
     
-    for (int i = 0; i < class_size; i++) {
-        Student *stu = &class_list[i];
-        
-        // Check elementary school
-        char *gs1 = !str_is_empty(s->elementary_school) ? s->elementary_school : "Unknown";
-        char *gs2 = !str_is_empty(stu->elementary_school) ? stu->elementary_school : "Unknown";
-        
-        if (str_equal_ignore_case(gs1, gs2)) {
-            count_grundschule++;
-        }
-        
-        // Check gender
-        if (!str_is_empty(s->gender) && !str_is_empty(stu->gender) && 
-            str_equal_ignore_case(s->gender, stu->gender)) {
-            count_gender++;
-        }
-        
-        // Check bg_gutachten
-        char *bp1 = !str_is_empty(s->bg_gutachten) ? s->bg_gutachten : "Unknown";
-        char *bp2 = !str_is_empty(stu->bg_gutachten) ? stu->bg_gutachten : "Unknown";
-        
-        if (str_equal_ignore_case(bp1, bp2)) {
-            count_bg++;
+    unsigned int mask = (unsigned int)num_slots - 1;
+    for (int code = 0; code < dict->count; code++) {
+        unsigned int slot = str_hash(dict->keys[code]) & mask;
+        while (slots[slot] != -1) {
+            slot = (slot + 1) & mask;
         }
+        slots[slot] = code;
     }
     
-    return 3.0 * count_grundschule + 2.0 * count_gender + 1.0 * count_bg;
-}
-
-static double compute_group_cost(Student *class_list, int class_size, Student *group, int group_size) {
-    double total_cost = 0.0;
-    for (int i = 0; i < group_size; i++) {
-        total_cost += compute_cost(class_list, class_size, &group[i]);
-    }
-    return total_cost;
+    free(dict->slots);
+    dict->slots = slots;
+    dict->num_slots = num_slots;
 }
 
-static void distribute_students_with_rules(Student *students, int num_students, Rule *rules, int num_rules, 
-                                        int num_classes, Student ***classes, int **class_sizes) {
-    // Create map from name to index
-    char **name_to_index_keys = (char**)malloc(num_students * sizeof(char*));
-    int *name_to_index_values = (int*)malloc(num_students * sizeof(int));
-    int name_to_index_size = 0;
+static int attribute_dict_intern(AttributeDict *dict, const char *value) {
+    // Most values are already interned, so fold short ones on the stack and
+    // only copy the key into the arena when a new value is added
+    char buffer[128];
+    size_t length = strlen(value);
+    char *folded = str_casefold_into(value, length < sizeof(buffer) ? buffer : malloc(length + 1));
+    unsigned int hash = str_hash(folded);
     
-    for (int i = 0; i < num_students; i++) {
-        char full_name[1024];
-        sprintf(full_name, "%s %s", students[i].first_name, students[i].last_name);
-        name_to_index_keys[name_to_index_size] = str_dup(full_name);
-        name_to_index_values[name_to_index_size] = i;
-        name_to_index_size++;
+    int slot = attribute_dict_lookup(dict, folded, hash);
+    if (slot != -1 && dict->slots[slot] != -1) {
+        if (folded != buffer) free(folded);
+        return dict->slots[slot];
     }
+    char *key = arena_strdup(dict->arena, folded);
+    if (folded != buffer) free(folded);
     
-    // Initialize union-find data structure
-    UnionFind uf;
-    union_find_init(&uf, num_students);
+    // Keep the load factor at or below one half
+    if ((dict->count + 1) * 2 > dict->num_slots) {
+        attribute_dict_grow(dict);
+        slot = attribute_dict_lookup(dict, key, hash);
+    }
     
-    // Process rules
-    for (int i = 0; i < num_rules; i++) {
-        int idx_a = -1, idx_b = -1;
-        
-        // Look up student indices
-        for (int j = 0; j < name_to_index_size; j++) {
-            if (strcmp(name_to_index_keys[j], rules[i].student_a) == 0) {
-                idx_a = name_to_index_values[j];
-            }
-            if (strcmp(name_to_index_keys[j], rules[i].student_b) == 0) {
-                idx_b = name_to_index_values[j];
-            }
-        }
-        
-        if (idx_a != -1 && idx_b != -1) {
-            union_find_union(&uf, idx_a, idx_b);
-        }
+    if (dict->count >= dict->capacity) {
+        dict->capacity = dict->capacity ? dict->capacity * 2 : 16;
+        dict->values = (char**)realloc(dict->values, dict->capacity * sizeof(char*));
+        dict->keys = (char**)realloc(dict->keys, dict->capacity * sizeof(char*));
     }
     
-    // Group students by their root in the union-find structure
-    typedef struct {
-        int root;
-        Student *students;
-        int size;
-        int capacity;
-    } StudentGroup;
+    int code = dict->count++;
+    dict->values[code] = arena_strdup(dict->arena, value);
+    dict->keys[code] = key;
+    dict->slots[slot] = code;
+    return code;
+}
+
+static int attribute_dict_find(const AttributeDict *dict, const char *value) {
+    char *key = str_casefold(value);
+    int slot = attribute_dict_lookup(dict, key, str_hash(key));
+    free(key);
+    return slot == -1 ? ATTR_CODE_NONE : dict->slots[slot];
+}
+
+// The strings themselves belong to the arena
+static void attribute_dict_free(AttributeDict *dict) {
+    free(dict->values);
+    free(dict->keys);
+    free(dict->slots);
+    attribute_dict_init(dict, dict->arena);
+}
+
+static const char *cohort_value(const Cohort *cohort, int attribute, int code) {
+    if (code == ATTR_CODE_NONE) return "";
+    return cohort->attributes[attribute].values[code];
+}
+
+static int cohort_code(const Cohort *cohort, int attribute, int student) {
+    return cohort->codes[(size_t)attribute * cohort->num_students + student];
+}
+
+static const char *cohort_student_value(const Cohort *cohort, int attribute, int student) {
+    return cohort_value(cohort, attribute, cohort_code(cohort, attribute, student));
+}
+
+// ===========================
+// Student Lookup
+// ===========================
+
+// Hash of "first last" without building the string
+static unsigned int full_name_hash(const char *first, const char *last) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*)first; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    hash ^= ' ';
+    hash *= 16777619u;
+    for (const unsigned char *p = (const unsigned char*)last; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool full_name_matches(const Student *s, const char *full_name) {
+    size_t first_length = strlen(s->first_name);
+    return strncmp(full_name, s->first_name, first_length) == 0 &&
+           full_name[first_length] == ' ' &&
+           strcmp(full_name + first_length + 1, s->last_name) == 0;
+}
+
+static unsigned int student_key_hash(const Student *s, bool by_id) {
+    return by_id ? str_hash(s->id) : full_name_hash(s->first_name, s->last_name);
+}
+
+static bool student_key_matches(const Student *s, const char *key, bool by_id) {
+    return by_id ? strcmp(s->id, key) == 0 : full_name_matches(s, key);
+}
+
+// Fills the index and warns once if students share keys, naming the first
+// such pair. Returns the number of students whose key was already taken.
+static int student_index_build(StudentIndex *index, const Student *students, int num_students, bool by_id,
+                               long *comparisons) {
+    int num_slots = 16;
+    while (num_slots < num_students * 2) num_slots *= 2;
     
-    StudentGroup *groups = (StudentGroup*)malloc(num_students * sizeof(StudentGroup)); // Max possible number of groups
-    int num_groups = 0;
+    index->num_slots = num_slots;
+    index->slots = (int*)malloc(num_slots * sizeof(int));
+    index->shared = (bool*)calloc(num_slots, sizeof(bool));
+    for (int i = 0; i < num_slots; i++) {
+        index->slots[i] = -1;
+    }
     
+    unsigned int mask = (unsigned int)num_slots - 1;
+    int num_duplicates = 0;
+    int first_duplicate = -1;
+    int first_original = -1;
     for (int i = 0; i < num_students; i++) {
-        int root = union_find_find(&uf, i);
+        const Student *s = &students[i];
+        if (by_id && str_is_empty(s->id)) continue;
         
-        // Find if we already have this root in our groups
-        int group_idx = -1;
-        for (int j = 0; j < num_groups; j++) {
-            if (groups[j].root == root) {
-                group_idx = j;
+        unsigned int slot = student_key_hash(s, by_id) & mask;
+        while (index->slots[slot] != -1) {
+            const Student *other = &students[index->slots[slot]];
+            (*comparisons)++;
+            if (by_id ? strcmp(other->id, s->id) == 0
+                      : strcmp(other->first_name, s->first_name) == 0 && strcmp(other->last_name, s->last_name) == 0) {
                 break;
             }
+            slot = (slot + 1) & mask;
         }
         
-        if (group_idx == -1) {
-            // Create new group
-            groups[num_groups].root = root;
-            groups[num_groups].capacity = 10; // Initial capacity
-            groups[num_groups].students = (Student*)malloc(groups[num_groups].capacity * sizeof(Student));
-            groups[num_groups].size = 0;
-            group_idx = num_groups;
-            num_groups++;
+        if (index->slots[slot] == -1) {
+            index->slots[slot] = i;
+            continue;
         }
         
-        // Ensure we have enough capacity
-        if (groups[group_idx].size >= groups[group_idx].capacity) {
-            groups[group_idx].capacity *= 2;
-            groups[group_idx].students = (Student*)realloc(groups[group_idx].students, 
-                                                        groups[group_idx].capacity * sizeof(Student));
+        // Duplicates stay out of the table, which keeps probe chains short
+        // however often a name repeats
+        index->shared[slot] = true;
+        if (num_duplicates++ == 0) {
+            first_duplicate = i;
+            first_original = index->slots[slot];
         }
-        
-        // Add student to group
-        groups[group_idx].students[groups[group_idx].size] = students[i];
-        groups[group_idx].size++;
     }
     
-    // Sort groups by size (largest first)
-    for (int i = 0; i < num_groups; i++) {
-        for (int j = i + 1; j < num_groups; j++) {
-            if (groups[j].size > groups[i].size) {
-                StudentGroup temp = groups[i];
-                groups[i] = groups[j];
-                groups[j] = temp;
-            }
+    if (num_duplicates > 0) {
+        const Student *s = &students[first_duplicate];
+        if (by_id) {
+            fprintf(stderr, "Warning: %d duplicate IDs, first '%s' (students %d and %d)\n",
+                    num_duplicates, s->id, first_original + 1, first_duplicate + 1);
+        } else {
+            fprintf(stderr, "Warning: %d duplicate names, first '%s %s' (students %d and %d)\n",
+                    num_duplicates, s->first_name, s->last_name, first_original + 1, first_duplicate + 1);
         }
     }
+    return num_duplicates;
+}
+
+static int student_index_find(const StudentIndex *index, const Student *students, const char *key, bool by_id) {
+    if (index->num_slots == 0) return STUDENT_NOT_FOUND;
     
-    // Allocate memory for classes
-    *classes = (Student**)malloc(num_classes * sizeof(Student*));
-    *class_sizes = (int*)calloc(num_classes, sizeof(int));
-    
-    for (int i = 0; i < num_classes; i++) {
-        (*classes)[i] = (Student*)malloc(num_students * sizeof(Student)); // Max possible size
+    // A "first last" key hashes exactly like full_name_hash of its parts
+    unsigned int hash = str_hash(key);
+    unsigned int mask = (unsigned int)index->num_slots - 1;
+    for (unsigned int slot = hash & mask; index->slots[slot] != -1; slot = (slot + 1) & mask) {
+        int candidate = index->slots[slot];
+        if (student_key_matches(&students[candidate], key, by_id)) {
+            return index->shared[slot] ? STUDENT_AMBIGUOUS : candidate;
+        }
+    }
+    return STUDENT_NOT_FOUND;
+}
+
+// Builds the lookup tables once per loaded cohort; every redistribution reuses them
+static void cohort_build_indexes(Cohort *cohort) {
+    gint64 start = profile_start(cohort->profile);
+    long comparisons = 0;
+    int duplicates = student_index_build(&cohort->by_name, cohort->students, cohort->num_students, false,
+                                         &comparisons);
+    if (cohort->has_ids) {
+        duplicates += student_index_build(&cohort->by_id, cohort->students, cohort->num_students, true,
+                                          &comparisons);
+    }
+    profile_stop(cohort->profile, PHASE_NAME_INDEX, start);
+    profile_count(cohort->profile, COUNTER_KEY_COMPARISONS, comparisons);
+    profile_count(cohort->profile, COUNTER_DUPLICATE_KEYS, duplicates);
+}
+
+// Resolves a rule's reference to a student: an ID if the file has an ID
+// column, otherwise (or if no ID matches) "Vorname Nachname". Returns
+// STUDENT_NOT_FOUND or STUDENT_AMBIGUOUS if there is no single match.
+static int cohort_find_student(const Cohort *cohort, const char *key) {
+    if (cohort->has_ids) {
+        int index = student_index_find(&cohort->by_id, cohort->students, key, true);
+        if (index != STUDENT_NOT_FOUND) return index;
+    }
+    return student_index_find(&cohort->by_name, cohort->students, key, false);
+}
+
+// ===========================
+// Union-Find Implementation
+// ===========================
+
+static void union_find_init(UnionFind *uf, int size) {
+    uf->size = size;
+    uf->parent = (int*)malloc(size * sizeof(int));
+    for (int i = 0; i < size; i++) {
+        uf->parent[i] = i;
+    }
+}
+
+static int union_find_find(UnionFind *uf, int i) {
+    if (uf->parent[i] != i) {
+        uf->parent[i] = union_find_find(uf, uf->parent[i]);
+    }
+    return uf->parent[i];
+}
+
+static void union_find_union(UnionFind *uf, int i, int j) {
+    int root_i = union_find_find(uf, i);
+    int root_j = union_find_find(uf, j);
+    if (root_i != root_j) {
+        uf->parent[root_j] = root_i;
+    }
+}
+
+static void union_find_free(UnionFind *uf) {
+    free(uf->parent);
+    uf->parent = NULL;
+    uf->size = 0;
+}
+
+// ===========================
+// Cost Model
+// ===========================
+
+// Column names of the built-in attributes in the student file
+static const char *const builtin_attribute_names[NUM_BUILTIN_ATTRIBUTES] = { "Grundschule", "m/w", "BG Gutachten" };
+
+// Weight of a shared value per attribute: Grundschule 3, gender 2, BG Gutachten 1
+static const double default_cost_weights[NUM_BUILTIN_ATTRIBUTES] = { 3.0, 2.0, 1.0 };
+
+// Students in class_index sharing the student's value of attribute a; 0 for a missing value
+static inline int class_count(const Assignment *assignment, int student, int a, int class_index) {
+    int code = assignment->codes[(size_t)a * assignment->num_students + student];
+    if (code == ATTR_CODE_NONE) return 0;
+    return assignment->counts[(assignment->offset[a] + code) * assignment->num_classes + class_index];
+}
+
+// Change in the student's value-sharing pairs of attribute a if it moved from `from` to `to`
+static inline int class_count_change(const Assignment *assignment, int student, int a, int from, int to) {
+    int code = assignment->codes[(size_t)a * assignment->num_students + student];
+    if (code == ATTR_CODE_NONE) return 0;
+    const int *row = assignment->counts + (assignment->offset[a] + code) * assignment->num_classes;
+    return row[to] - row[from] + 1;
+}
+
+// The built-in attributes at the default weights 3, 2, 1, folded in as integer constants
+static double placement_cost_default(const Assignment *assignment, int class_index, int student) {
+    return 3 * class_count(assignment, student, ATTR_GRUNDSCHULE, class_index) +
+           2 * class_count(assignment, student, ATTR_GENDER, class_index) +
+           class_count(assignment, student, ATTR_BG_GUTACHTEN, class_index);
+}
+
+static double move_delta_default(const Assignment *assignment, int student, int from, int to) {
+    return 3 * class_count_change(assignment, student, ATTR_GRUNDSCHULE, from, to) +
+           2 * class_count_change(assignment, student, ATTR_GENDER, from, to) +
+           class_count_change(assignment, student, ATTR_BG_GUTACHTEN, from, to);
+}
+
+// A single attribute, such as balancing by Grundschule alone
+static double placement_cost_single(const Assignment *assignment, int class_index, int student) {
+    int a = assignment->cost->active[0];
+    return assignment->cost->weights[a] * class_count(assignment, student, a, class_index);
+}
+
+static double move_delta_single(const Assignment *assignment, int student, int from, int to) {
+    int a = assignment->cost->active[0];
+    return assignment->cost->weights[a] * class_count_change(assignment, student, a, from, to);
+}
+
+// Whole-number weights: counts are summed as integers and converted once
+static double placement_cost_integer(const Assignment *assignment, int class_index, int student) {
+    const CostModel *model = assignment->cost;
+    int64_t cost = 0;
+    
+    for (int i = 0; i < model->num_active; i++) {
+        int a = model->active[i];
+        cost += (int64_t)model->weights[a] * class_count(assignment, student, a, class_index);
+    }
+    return (double)cost;
+}
+
+static double move_delta_integer(const Assignment *assignment, int student, int from, int to) {
+    const CostModel *model = assignment->cost;
+    int64_t delta = 0;
+    
+    for (int i = 0; i < model->num_active; i++) {
+        int a = model->active[i];
+        delta += (int64_t)model->weights[a] * class_count_change(assignment, student, a, from, to);
+    }
+    return (double)delta;
+}
+
+static double placement_cost_weighted(const Assignment *assignment, int class_index, int student) {
+    const CostModel *model = assignment->cost;
+    double cost = 0.0;
+    
+    for (int i = 0; i < model->num_active; i++) {
+        int a = model->active[i];
+        cost += model->weights[a] * class_count(assignment, student, a, class_index);
+    }
+    return cost;
+}
+
+static double move_delta_weighted(const Assignment *assignment, int student, int from, int to) {
+    const CostModel *model = assignment->cost;
+    double delta = 0.0;
+    
+    for (int i = 0; i < model->num_active; i++) {
+        int a = model->active[i];
+        delta += model->weights[a] * class_count_change(assignment, student, a, from, to);
+    }
+    return delta;
+}
+
+// deltas[c] += weight * row[c] over all classes: the inner loop of
+// compute_move_matrix. The vector versions round exactly like this one.
+static void accumulate_row_scalar(double *deltas, const int *row, double weight, int num_classes) {
+    for (int c = 0; c < num_classes; c++) {
+        deltas[c] += weight * row[c];
+    }
+}
+
+#ifdef SORTER_X86_SIMD
+static void accumulate_row_sse2(double *deltas, const int *row, double weight, int num_classes) {
+    __m128d scale = _mm_set1_pd(weight);
+    int c = 0;
+    for (; c + 2 <= num_classes; c += 2) {
+        __m128d counts = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(row + c)));
+        _mm_storeu_pd(deltas + c, _mm_add_pd(_mm_loadu_pd(deltas + c), _mm_mul_pd(scale, counts)));
+    }
+    accumulate_row_scalar(deltas + c, row + c, weight, num_classes - c);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_row_avx2(double *deltas, const int *row, double weight, int num_classes) {
+    __m256d scale = _mm256_set1_pd(weight);
+    int c = 0;
+    for (; c + 8 <= num_classes; c += 8) {
+        __m256i counts = _mm256_loadu_si256((const __m256i*)(row + c));
+        __m256d low = _mm256_cvtepi32_pd(_mm256_castsi256_si128(counts));
+        __m256d high = _mm256_cvtepi32_pd(_mm256_extracti128_si256(counts, 1));
+        _mm256_storeu_pd(deltas + c, _mm256_add_pd(_mm256_loadu_pd(deltas + c), _mm256_mul_pd(scale, low)));
+        _mm256_storeu_pd(deltas + c + 4, _mm256_add_pd(_mm256_loadu_pd(deltas + c + 4), _mm256_mul_pd(scale, high)));
+    }
+    for (; c + 4 <= num_classes; c += 4) {
+        __m256d counts = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(row + c)));
+        _mm256_storeu_pd(deltas + c, _mm256_add_pd(_mm256_loadu_pd(deltas + c), _mm256_mul_pd(scale, counts)));
+    }
+    
+    // Not through the SSE2 version: mixing legacy SSE with AVX stalls
+    for (; c < num_classes; c++) {
+        deltas[c] += weight * row[c];
+    }
+}
+#endif
+
+// Fills deltas[i * num_classes + c] with the change in total cost if
+// students[i] alone moved to class c, as compute_move_delta gives it, and 0
+// for its own class. Per student this is one scaled count row per balanced
+// attribute, less the pairs it shares where it is.
+static void compute_move_matrix(const Assignment *assignment, const int *students, int num_students,
+                                double *deltas) {
+    const CostModel *model = assignment->cost;
+    int num_classes = assignment->num_classes;
+    
+    for (int i = 0; i < num_students; i++) {
+        int student = students[i];
+        int from = assignment->class_of[student];
+        double *row_deltas = deltas + (size_t)i * num_classes;
+        double leaving = 0.0;
+        
+        memset(row_deltas, 0, num_classes * sizeof(double));
+        for (int k = 0; k < model->num_active; k++) {
+            int a = model->active[k];
+            int code = assignment->codes[(size_t)a * assignment->num_students + student];
+            if (code == ATTR_CODE_NONE) continue;
+            const int *row = assignment->counts + (assignment->offset[a] + code) * num_classes;
+            model->accumulate_row(row_deltas, row, model->weights[a], num_classes);
+            leaving += model->weights[a] * (row[from] - 1);
+        }
+        
+        for (int c = 0; c < num_classes; c++) {
+            row_deltas[c] -= leaving;
+        }
+        row_deltas[from] = 0.0;
+    }
+}
+
+// The built-in attributes at their default weights
+static void cost_model_init(CostModel *model) {
+    memset(model, 0, sizeof(*model));
+    for (int a = 0; a < NUM_BUILTIN_ATTRIBUTES; a++) {
+        snprintf(model->names[a], MAX_ATTRIBUTE_NAME, "%s", builtin_attribute_names[a]);
+        model->weights[a] = default_cost_weights[a];
+    }
+    model->num_attributes = NUM_BUILTIN_ATTRIBUTES;
+}
+
+// Sets the weight of the column called name, declaring it as a further
+// attribute if it is not balanced yet. Prints the problem and returns
+// false if there is no room for it.
+static bool cost_model_set_weight(CostModel *model, const char *name, double weight) {
+    for (int a = 0; a < model->num_attributes; a++) {
+        if (str_equal_ignore_case(model->names[a], name)) {
+            model->weights[a] = weight;
+            return true;
+        }
+    }
+    
+    if (str_is_empty(name)) {
+        fprintf(stderr, "Missing column name for weight %g\n", weight);
+        return false;
+    }
+    if (model->num_attributes == MAX_ATTRIBUTES || strlen(name) >= MAX_ATTRIBUTE_NAME) {
+        fprintf(stderr, "Cannot balance column \"%s\": at most %d columns with names of up to %d bytes\n",
+                name, MAX_ATTRIBUTES, MAX_ATTRIBUTE_NAME - 1);
+        return false;
+    }
+    snprintf(model->names[model->num_attributes], MAX_ATTRIBUTE_NAME, "%s", name);
+    model->weights[model->num_attributes++] = weight;
+    return true;
+}
+
+// Picks the kernels for the model's weights. Weights must be finite and non-negative.
+static void cost_model_select_kernels(CostModel *model) {
+    model->num_active = 0;
+    bool integral = true;
+    for (int a = 0; a < model->num_attributes; a++) {
+        if (model->weights[a] == 0.0) continue;
+        model->active[model->num_active++] = a;
+        integral = integral && model->weights[a] == floor(model->weights[a]) && model->weights[a] <= 1e6;
+    }
+    
+    if (model->num_attributes == NUM_BUILTIN_ATTRIBUTES &&
+        memcmp(model->weights, default_cost_weights, sizeof(default_cost_weights)) == 0) {
+        model->kernel = "default";
+        model->placement_cost = placement_cost_default;
+        model->move_delta = move_delta_default;
+    } else if (model->num_active == 1) {
+        model->kernel = "single";
+        model->placement_cost = placement_cost_single;
+        model->move_delta = move_delta_single;
+    } else if (integral) {
+        model->kernel = "integer";
+        model->placement_cost = placement_cost_integer;
+        model->move_delta = move_delta_integer;
+    } else {
+        model->kernel = "weighted";
+        model->placement_cost = placement_cost_weighted;
+        model->move_delta = move_delta_weighted;
+    }
+    
+    // SORTER_NO_SIMD forces the portable loop, e.g. to compare results
+    model->instruction_set = "scalar";
+    model->accumulate_row = accumulate_row_scalar;
+#ifdef SORTER_X86_SIMD
+    if (str_is_empty(g_getenv("SORTER_NO_SIMD"))) {
+        bool avx2 = __builtin_cpu_supports("avx2");
+        model->instruction_set = avx2 ? "avx2" : "sse2";
+        model->accumulate_row = avx2 ? accumulate_row_avx2 : accumulate_row_sse2;
+    }
+#endif
+}
+
+static bool parse_cost_weight(const char *text, double *weight) {
+    char *end = NULL;
+    *weight = strtod(text, &end);
+    return end != text && str_is_empty(end) && isfinite(*weight) && *weight >= 0.0;
+}
+
+// Reads "W1,W2,W3", the weights of Grundschule, gender and BG Gutachten.
+// Prints the problem and returns false, leaving the model alone, if it is
+// not three non-negative numbers.
+static bool parse_cost_weights(const char *text, CostModel *model) {
+    char *copy = str_dup(text);
+    double parsed[NUM_BUILTIN_ATTRIBUTES];
+    int count = 0;
+    bool valid = true;
+    
+    for (char *field = strtok(copy, ","); field != NULL && valid; field = strtok(NULL, ",")) {
+        valid = count < NUM_BUILTIN_ATTRIBUTES && parse_cost_weight(str_trim(field), &parsed[count]);
+        count++;
+    }
+    free(copy);
+    
+    if (!valid || count != NUM_BUILTIN_ATTRIBUTES) {
+        fprintf(stderr, "Invalid weights: %s (expected three non-negative numbers for %s, %s, %s)\n", text,
+                builtin_attribute_names[ATTR_GRUNDSCHULE], builtin_attribute_names[ATTR_GENDER],
+                builtin_attribute_names[ATTR_BG_GUTACHTEN]);
+        return false;
+    }
+    memcpy(model->weights, parsed, sizeof(parsed));
+    return true;
+}
+
+// Reads "Column=W,Column=W,..." and balances each column with its weight,
+// 1 where "=W" is left out. Prints the problem and returns false if an
+// entry is malformed.
+static bool parse_balanced_columns(const char *text, CostModel *model) {
+    char *copy = str_dup(text);
+    bool valid = true;
+    
+    for (char *field = strtok(copy, ","); field != NULL && valid; field = strtok(NULL, ",")) {
+        double weight = 1.0;
+        char *equals = strchr(field, '=');
+        if (equals != NULL) {
+            *equals = '\0';
+            valid = parse_cost_weight(str_trim(equals + 1), &weight);
+            if (!valid) fprintf(stderr, "Invalid weight for column %s: %s\n", str_trim(field), equals + 1);
+        }
+        valid = valid && cost_model_set_weight(model, str_trim(field), weight);
+    }
+    free(copy);
+    return valid;
+}
+
+// Reads weights from a file of "Column = weight" lines. Naming one of the
+// built-in columns sets its weight; any other column of the student file is
+// balanced as well. Empty lines and lines starting with '#' are skipped.
+// Prints the problem and returns false if the file cannot be used.
+static bool load_cost_config(const char *path, CostModel *model) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open cost configuration: %s\n", path);
+        return false;
+    }
+    
+    CostModel parsed = *model;
+    char line[512];
+    int line_number = 0;
+    bool valid = true;
+    
+    while (valid && fgets(line, sizeof(line), fp)) {
+        line_number++;
+        char *text = str_trim(line);
+        if (str_is_empty(text) || text[0] == '#') continue;
+        
+        char *equals = strchr(text, '=');
+        double weight = 0.0;
+        if (equals != NULL) *equals = '\0';
+        valid = equals != NULL && parse_cost_weight(str_trim(equals + 1), &weight);
+        if (!valid) {
+            fprintf(stderr, "%s:%d: expected \"Column = non-negative number\"\n", path, line_number);
+        }
+        valid = valid && cost_model_set_weight(&parsed, str_trim(text), weight);
+    }
+    fclose(fp);
+    
+    if (valid) *model = parsed;
+    return valid;
+}
+
+// ===========================
+// CSV Loading
+// ===========================
+
+// A field of the mapped file, trimmed but not NUL-terminated
+typedef struct {
+    const char *start;
+    int length;
+} FieldSpan;
+
+// Splits [line, end) at commas into fields, growing the field array as needed
+static int split_csv_record(const char *line, const char *end, FieldSpan **fields, int *capacity) {
+    int count = 0;
+    const char *start = line;
+    
+    for (;;) {
+        const char *comma = memchr(start, ',', end - start);
+        const char *field_end = comma ? comma : end;
+        
+        while (start < field_end && isspace((unsigned char)*start)) start++;
+        while (field_end > start && isspace((unsigned char)field_end[-1])) field_end--;
+        
+        if (count >= *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 16;
+            *fields = (FieldSpan*)realloc(*fields, *capacity * sizeof(FieldSpan));
+        }
+        (*fields)[count].start = start;
+        (*fields)[count].length = (int)(field_end - start);
+        count++;
+        
+        if (comma == NULL) return count;
+        start = comma + 1;
+    }
+}
+
+static char *field_dup(Arena *arena, const FieldSpan *field) {
+    return arena_strndup(arena, field->start, field->length);
+}
+
+// Cuts the next line off [*cursor, end), without its line terminator
+static bool next_csv_line(const char **cursor, const char *end, const char **line, const char **line_end) {
+    if (*cursor >= end) return false;
+    
+    const char *newline = memchr(*cursor, '\n', end - *cursor);
+    *line = *cursor;
+    *line_end = newline ? newline : end;
+    *cursor = newline ? newline + 1 : end;
+    if (*line_end > *line && (*line_end)[-1] == '\r') (*line_end)--;
+    return true;
+}
+
+// Positions of the columns load_students uses, -1 if absent
+typedef struct {
+    int header_count;
+    int vorname, nachname, id;
+    int num_attributes;
+    int attributes[MAX_ATTRIBUTES];     // In the cost model's order
+} StudentColumns;
+
+// A newline-aligned slice of the file, parsed on its own into records whose
+// attribute codes refer to the chunk's private dictionaries
+typedef struct {
+    const char *start;
+    const char *end;
+    const StudentColumns *columns;
+    Arena arena;
+    AttributeDict attributes[MAX_ATTRIBUTES];
+    Student *students;
+    int *codes;             // Student by student: num_attributes codes each
+    int num_students;
+    int students_capacity;
+    int num_lines;
+    int num_short_lines;    // Lines with too few fields
+    int first_short_line;   // Chunk-relative number of the first of them
+} LoadChunk;
+
+// Files smaller than this are not worth splitting across threads
+#define PARALLEL_LOAD_MIN_BYTES (4 * 1024 * 1024)
+#define MAX_LOAD_THREADS 64
+
+static gpointer load_chunk_parse(gpointer data) {
+    LoadChunk *chunk = (LoadChunk*)data;
+    const StudentColumns *columns = chunk->columns;
+    
+    arena_init(&chunk->arena, COHORT_ARENA_CHUNK_SIZE);
+    for (int a = 0; a < columns->num_attributes; a++) {
+        attribute_dict_init(&chunk->attributes[a], &chunk->arena);
+    }
+    
+    Arena scratch;
+    arena_init(&scratch, SCRATCH_ARENA_CHUNK_SIZE);
+    FieldSpan *fields = NULL;
+    int fields_capacity = 0;
+    const char *cursor = chunk->start;
+    const char *line, *line_end;
+    
+    while (next_csv_line(&cursor, chunk->end, &line, &line_end)) {
+        chunk->num_lines++;
+        arena_reset(&scratch);
+        int field_count = split_csv_record(line, line_end, &fields, &fields_capacity);
+        if (field_count == 1 && fields[0].length == 0) continue; // Blank line
+        
+        if (field_count < columns->header_count) {
+            if (chunk->num_short_lines++ == 0) chunk->first_short_line = chunk->num_lines;
+            continue;
+        }
+        
+        if (chunk->num_students >= chunk->students_capacity) {
+            chunk->students_capacity = chunk->students_capacity ? chunk->students_capacity * 2 : 64;
+            chunk->students = (Student*)realloc(chunk->students, chunk->students_capacity * sizeof(Student));
+            chunk->codes = (int*)realloc(chunk->codes,
+                                         (size_t)chunk->students_capacity * columns->num_attributes * sizeof(int));
+        }
+        
+        // Assign fields to student structure
+        int *codes = chunk->codes + (size_t)chunk->num_students * columns->num_attributes;
+        Student *s = &chunk->students[chunk->num_students++];
+        s->first_name = field_dup(&chunk->arena, &fields[columns->vorname]);
+        s->last_name = field_dup(&chunk->arena, &fields[columns->nachname]);
+        s->id = columns->id != -1 ? field_dup(&chunk->arena, &fields[columns->id]) : NULL;
+        
+        // A missing school or BG Gutachten is balanced as a value of its own
+        // (the empty one, so it is written back as it was read); any other
+        // missing value, or a declared column the file lacks, matches nothing
+        for (int a = 0; a < columns->num_attributes; a++) {
+            int column = columns->attributes[a];
+            const char *value = column != -1 ? field_dup(&scratch, &fields[column]) : "";
+            bool counted = !str_is_empty(value) || a == ATTR_GRUNDSCHULE || a == ATTR_BG_GUTACHTEN;
+            codes[a] = counted ? attribute_dict_intern(&chunk->attributes[a], value) : ATTR_CODE_NONE;
+        }
+    }
+    
+    free(fields);
+    arena_free(&scratch);
+    return NULL;
+}
+
+// Splits [start, end) into at most max_chunks pieces that each end after a newline
+static int split_load_chunks(const char *start, const char *end, LoadChunk *chunks, int max_chunks) {
+    int num_chunks = 0;
+    const char *cursor = start;
+    
+    for (int i = 0; i < max_chunks && cursor < end; i++) {
+        const char *chunk_end = end;
+        if (i + 1 < max_chunks) {
+            const char *target = start + (end - start) / max_chunks * (i + 1);
+            if (target < cursor) target = cursor;
+            const char *newline = memchr(target, '\n', end - target);
+            chunk_end = newline ? newline + 1 : end;
+        }
+        
+        chunks[num_chunks].start = cursor;
+        chunks[num_chunks].end = chunk_end;
+        num_chunks++;
+        cursor = chunk_end;
+    }
+    return num_chunks;
+}
+
+// Appends a parsed chunk to the cohort in file order, translating its
+// attribute codes into the cohort's dictionaries and its columns of codes,
+// which have room for total_students
+static void load_chunk_merge(LoadChunk *chunk, Cohort *cohort, int *codes, int total_students) {
+    int num_attributes = cohort->num_attributes;
+    int *code_map[MAX_ATTRIBUTES];
+    for (int a = 0; a < num_attributes; a++) {
+        const AttributeDict *local = &chunk->attributes[a];
+        code_map[a] = (int*)malloc((local->count + 1) * sizeof(int));
+        for (int code = 0; code < local->count; code++) {
+            code_map[a][code] = attribute_dict_intern(&cohort->attributes[a], local->values[code]);
+        }
+    }
+    
+    for (int i = 0; i < chunk->num_students; i++) {
+        const int *local = chunk->codes + (size_t)i * num_attributes;
+        for (int a = 0; a < num_attributes; a++) {
+            codes[(size_t)a * total_students + cohort->num_students] =
+                local[a] == ATTR_CODE_NONE ? ATTR_CODE_NONE : code_map[a][local[a]];
+        }
+        cohort->students[cohort->num_students++] = chunk->students[i];
+    }
+    
+    // The names stay where they are; their chunks now belong to the cohort
+    arena_adopt(&cohort->arena, &chunk->arena);
+    
+    for (int a = 0; a < num_attributes; a++) {
+        free(code_map[a]);
+        attribute_dict_free(&chunk->attributes[a]);
+    }
+    free(chunk->students);
+    free(chunk->codes);
+}
+
+// Maps the file and reads it in a single pass. Fields are located in place
+// and only the columns that are kept get copied or interned. Large files
+// are split into newline-aligned chunks that are parsed on worker threads
+// and merged in file order, so codes come out as if the file had been read
+// sequentially. Malformed lines are counted and reported once. The cost
+// model names the columns that are interned as attributes.
+static void load_students(const char *file_path, const CostModel *cost, Profile *profile, Cohort *cohort) {
+    gint64 start = profile_start(profile);
+    memset(cohort, 0, sizeof(*cohort));
+    cohort->profile = profile;
+    cohort->num_attributes = cost->num_attributes;
+    arena_init(&cohort->arena, COHORT_ARENA_CHUNK_SIZE);
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        attribute_dict_init(&cohort->attributes[a], &cohort->arena);
+    }
+    cohort->source_path = arena_strdup(&cohort->arena, file_path);
+    
+    GError *error = NULL;
+    GMappedFile *file = g_mapped_file_new(file_path, FALSE, &error);
+    if (!file) {
+        fprintf(stderr, "Could not open file: %s (%s)\n", file_path, error->message);
+        g_error_free(error);
+        return;
+    }
+    
+    // Empty files map to NULL contents
+    const char *cursor = g_mapped_file_get_contents(file);
+    const char *end = cursor ? cursor + g_mapped_file_get_length(file) : NULL;
+    if (end - cursor >= 3 && memcmp(cursor, "\xEF\xBB\xBF", 3) == 0) {
+        cursor += 3; // UTF-8 byte order mark
+    }
+    
+    // Read header
+    const char *line, *line_end;
+    if (!next_csv_line(&cursor, end, &line, &line_end)) {
+        g_mapped_file_unref(file);
+        return; // Empty file
+    }
+    
+    Arena scratch;
+    arena_init(&scratch, SCRATCH_ARENA_CHUNK_SIZE);
+    FieldSpan *fields = NULL;
+    int fields_capacity = 0;
+    StudentColumns columns = {0, -1, -1, -1, cost->num_attributes, {0}};
+    for (int a = 0; a < columns.num_attributes; a++) {
+        columns.attributes[a] = -1;
+    }
+    columns.header_count = split_csv_record(line, line_end, &fields, &fields_capacity);
+    
+    // The built-in columns must be spelt exactly; declared ones in any case
+    for (int i = 0; i < columns.header_count; i++) {
+        char *header = field_dup(&scratch, &fields[i]);
+        if (str_equal_ignore_case(header, "ID") || str_equal_ignore_case(header, "Schüler-ID")) columns.id = i;
+        else if (str_equal_ignore_case(header, "Vorname")) columns.vorname = i;
+        else if (str_equal_ignore_case(header, "Nachname")) columns.nachname = i;
+        for (int a = 0; a < columns.num_attributes; a++) {
+            bool match = a < NUM_BUILTIN_ATTRIBUTES ? str_equal_case(header, cost->names[a])
+                                                    : str_equal_ignore_case(header, cost->names[a]);
+            if (match && columns.attributes[a] == -1) columns.attributes[a] = i;
+        }
+    }
+    free(fields);
+    arena_free(&scratch);
+    
+    fprintf(stderr, "Column indices: Vorname=%d, Nachname=%d, m/w=%d, Grundschule=%d, BG Gutachten=%d\n",
+            columns.vorname, columns.nachname, columns.attributes[ATTR_GENDER],
+            columns.attributes[ATTR_GRUNDSCHULE], columns.attributes[ATTR_BG_GUTACHTEN]);
+    
+    if (columns.vorname == -1 || columns.nachname == -1 || columns.attributes[ATTR_GENDER] == -1 ||
+        columns.attributes[ATTR_GRUNDSCHULE] == -1 || columns.attributes[ATTR_BG_GUTACHTEN] == -1) {
+        fprintf(stderr, "Error: Required columns not found in CSV file\n");
+        g_mapped_file_unref(file);
+        return; // Required columns not found
+    }
+    for (int a = NUM_BUILTIN_ATTRIBUTES; a < columns.num_attributes; a++) {
+        if (columns.attributes[a] == -1) {
+            fprintf(stderr, "Warning: Column %s not found in CSV file; it is not balanced\n", cost->names[a]);
+        }
+    }
+    
+    // Read student records
+    int max_chunks = 1;
+    if (end - cursor >= PARALLEL_LOAD_MIN_BYTES) {
+        max_chunks = (int)g_get_num_processors();
+        if (max_chunks > MAX_LOAD_THREADS) max_chunks = MAX_LOAD_THREADS;
+        if (max_chunks < 1) max_chunks = 1;
+    }
+    
+    LoadChunk *chunks = (LoadChunk*)calloc(max_chunks, sizeof(LoadChunk));
+    int num_chunks = split_load_chunks(cursor, end, chunks, max_chunks);
+    GThread **threads = (GThread**)calloc(max_chunks, sizeof(GThread*));
+    
+    for (int i = 0; i < num_chunks; i++) {
+        chunks[i].columns = &columns;
+    }
+    for (int i = 1; i < num_chunks; i++) {
+        threads[i] = g_thread_new("load", load_chunk_parse, &chunks[i]);
+    }
+    if (num_chunks > 0) load_chunk_parse(&chunks[0]);
+    for (int i = 1; i < num_chunks; i++) {
+        g_thread_join(threads[i]);
+    }
+    free(threads);
+    
+    int total_students = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        total_students += chunks[i].num_students;
+    }
+    cohort->students = (Student*)arena_alloc(&cohort->arena, total_students * sizeof(Student));
+    int *codes = (int*)arena_alloc(&cohort->arena, (size_t)total_students * cohort->num_attributes * sizeof(int));
+    cohort->codes = codes;
+    
+    int first_line = 1; // The header
+    int num_short_lines = 0;
+    int first_short_line = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        if (chunks[i].num_short_lines > 0 && num_short_lines == 0) {
+            first_short_line = first_line + chunks[i].first_short_line;
+        }
+        num_short_lines += chunks[i].num_short_lines;
+        load_chunk_merge(&chunks[i], cohort, codes, total_students);
+        first_line += chunks[i].num_lines;
+    }
+    free(chunks);
+    g_mapped_file_unref(file);
+    
+    if (num_short_lines > 0) {
+        fprintf(stderr, "Warning: %d lines have fewer fields than expected, first line %d\n",
+                num_short_lines, first_short_line);
+    }
+    profile_stop(profile, PHASE_LOAD_CSV, start);
+    profile_count(profile, COUNTER_STUDENTS_LOADED, cohort->num_students);
+    profile_count(profile, COUNTER_SHORT_LINES, num_short_lines);
+    
+    cohort->has_ids = columns.id != -1;
+    cohort_build_indexes(cohort);
+    fprintf(stderr, "Successfully loaded %d students\n", cohort->num_students);
+}
+
+// ===========================
+// Cohort Snapshots
+// ===========================
+
+// A snapshot stores a parsed cohort next to its CSV ("<file>.snap") so that
+// later sessions can map it instead of parsing. Layout, all in native byte
+// order: SnapshotHeader, string table of NUL-terminated strings, one
+// SnapshotStudent per student, the attribute codes column by column as in
+// Cohort.codes (padded to 8 bytes), a (value, key) string pair per
+// dictionary entry (attribute by attribute). Strings are referenced by
+// offset into the table. A snapshot only serves a cost model balancing the
+// same columns.
+
+#define SNAPSHOT_MAGIC "SORTSNAP"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_NO_STRING UINT32_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t source_size;       // The CSV the snapshot was made from
+    int64_t source_mtime;
+    uint64_t source_hash;
+    uint32_t num_attributes;
+    uint32_t num_students;
+    uint32_t num_values[MAX_ATTRIBUTES];
+    uint32_t attribute_names[MAX_ATTRIBUTES];
+    uint32_t has_ids;
+    uint32_t padding;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t students_offset;
+    uint64_t codes_offset;
+    uint64_t values_offset;
+    uint64_t file_size;
+    uint64_t payload_hash;      // Everything after the header
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t first_name;
+    uint32_t last_name;
+    uint32_t id;
+    uint32_t padding;
+} SnapshotStudent;
+
+// Growable string table for writing
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} SnapshotStrings;
+
+static char *snapshot_path(const char *source_path) {
+    size_t length = strlen(source_path) + sizeof(".snap");
+    char *path = malloc(length);
+    snprintf(path, length, "%s.snap", source_path);
+    return path;
+}
+
+// 64-bit FNV-1a variant over 8-byte words, to detect edits that keep the
+// file's size and modification time
+static uint64_t snapshot_hash_continue(uint64_t hash, const char *data, size_t length) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 32;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t snapshot_hash(const char *data, size_t length) {
+    return snapshot_hash_continue(14695981039346656037ull, data, length);
+}
+
+// Bytes taken by the code columns of num_students, padded to 8
+static uint64_t snapshot_codes_size(uint32_t num_attributes, uint32_t num_students) {
+    return ((uint64_t)num_attributes * num_students * sizeof(int32_t) + 7) & ~(uint64_t)7;
+}
+
+// Fills the source fields of header from the CSV file; false if it is unreadable
+static bool snapshot_describe_source(const char *source_path, SnapshotHeader *header) {
+    struct stat st;
+    if (stat(source_path, &st) != 0) return false;
+    
+    GMappedFile *file = g_mapped_file_new(source_path, FALSE, NULL);
+    if (file == NULL) return false;
+    const char *contents = g_mapped_file_get_contents(file);
+    size_t length = g_mapped_file_get_length(file);
+    
+    header->source_size = (uint64_t)st.st_size;
+    header->source_mtime = (int64_t)st.st_mtime;
+    header->source_hash = contents ? snapshot_hash(contents, length) : 0;
+    g_mapped_file_unref(file);
+    return true;
+}
+
+static uint32_t snapshot_add_string(SnapshotStrings *strings, const char *str) {
+    if (str == NULL) return SNAPSHOT_NO_STRING;
+    
+    size_t length = strlen(str) + 1;
+    if (strings->size + length > strings->capacity) {
+        strings->capacity = strings->capacity ? strings->capacity * 2 : 4096;
+        while (strings->size + length > strings->capacity) strings->capacity *= 2;
+        strings->data = realloc(strings->data, strings->capacity);
+    }
+    
+    uint32_t offset = (uint32_t)strings->size;
+    memcpy(strings->data + strings->size, str, length);
+    strings->size += length;
+    return offset;
+}
+
+// Writes the snapshot for cohort->source_path through a temporary file, so
+// that a reader never sees a half-written snapshot
+static bool snapshot_write(const Cohort *cohort) {
+    if (cohort->source_path == NULL) return false;
+    gint64 start = profile_start(cohort->profile);
+    
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    if (!snapshot_describe_source(cohort->source_path, &header)) return false;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.num_attributes = (uint32_t)cohort->num_attributes;
+    header.num_students = (uint32_t)cohort->num_students;
+    header.has_ids = cohort->has_ids;
+    
+    SnapshotStrings strings = {NULL, 0, 0};
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        header.attribute_names[a] = snapshot_add_string(&strings, cohort->cost.names[a]);
+    }
+    SnapshotStudent *records = (SnapshotStudent*)malloc((cohort->num_students + 1) * sizeof(SnapshotStudent));
+    for (int i = 0; i < cohort->num_students; i++) {
+        const Student *s = &cohort->students[i];
+        records[i].first_name = snapshot_add_string(&strings, s->first_name);
+        records[i].last_name = snapshot_add_string(&strings, s->last_name);
+        records[i].id = snapshot_add_string(&strings, s->id);
+        records[i].padding = 0;
+    }
+    
+    // The code columns are written as they are, plus zero padding
+    uint64_t codes_size = snapshot_codes_size(header.num_attributes, header.num_students);
+    char *codes = (char*)calloc(1, codes_size + 1);
+    memcpy(codes, cohort->codes, (size_t)cohort->num_attributes * cohort->num_students * sizeof(int32_t));
+    
+    int total_values = 0;
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        header.num_values[a] = (uint32_t)cohort->attributes[a].count;
+        total_values += cohort->attributes[a].count;
+    }
+    uint32_t *values = (uint32_t*)malloc((2 * total_values + 1) * sizeof(uint32_t));
+    int v = 0;
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        const AttributeDict *dict = &cohort->attributes[a];
+        for (int code = 0; code < dict->count; code++) {
+            values[v++] = snapshot_add_string(&strings, dict->values[code]);
+            values[v++] = snapshot_add_string(&strings, dict->keys[code]);
+        }
+    }
+    
+    // Keep the fixed-width sections 8-byte aligned
+    while (strings.size % 8 != 0) snapshot_add_string(&strings, "");
+    header.strings_offset = sizeof(SnapshotHeader);
+    header.strings_size = strings.size;
+    header.students_offset = header.strings_offset + strings.size;
+    header.codes_offset = header.students_offset + (uint64_t)cohort->num_students * sizeof(SnapshotStudent);
+    header.values_offset = header.codes_offset + codes_size;
+    header.file_size = header.values_offset + (uint64_t)total_values * 2 * sizeof(uint32_t);
+    
+    // Every section is a multiple of 8 bytes long, so hashing them one after
+    // another gives the same result as hashing the file's payload in one go
+    uint64_t hash = snapshot_hash(strings.data, strings.size);
+    hash = snapshot_hash_continue(hash, (const char*)records, cohort->num_students * sizeof(SnapshotStudent));
+    hash = snapshot_hash_continue(hash, codes, codes_size);
+    header.payload_hash = snapshot_hash_continue(hash, (const char*)values, total_values * 2 * sizeof(uint32_t));
+    
+    char *path = snapshot_path(cohort->source_path);
+    char *temp_path = g_strdup_printf("%s.tmp", path);
+    FILE *fp = fopen(temp_path, "wb");
+    bool ok = fp != NULL;
+    if (ok) {
+        fwrite(&header, sizeof(header), 1, fp);
+        fwrite(strings.data, 1, strings.size, fp);
+        fwrite(records, sizeof(SnapshotStudent), cohort->num_students, fp);
+        fwrite(codes, 1, codes_size, fp);
+        fwrite(values, sizeof(uint32_t), 2 * total_values, fp);
+        ok = !ferror(fp);
+        ok = fclose(fp) == 0 && ok;
+        
+        // rename() does not replace existing files on Windows
+        remove(path);
+        ok = ok && rename(temp_path, path) == 0;
+        if (!ok) remove(temp_path);
+    }
+    if (!ok) fprintf(stderr, "Warning: Could not write snapshot %s\n", path);
+    
+    g_free(temp_path);
+    free(path);
+    free(strings.data);
+    free(records);
+    free(codes);
+    free(values);
+    profile_stop(cohort->profile, PHASE_SNAPSHOT_WRITE, start);
+    return ok;
+}
+
+static bool snapshot_string_valid(const SnapshotHeader *header, uint32_t offset) {
+    return offset < header->strings_size;
+}
+
+// Sets up a dictionary over strings that live elsewhere (in the snapshot)
+static void attribute_dict_adopt(AttributeDict *dict, char **values, char **keys, int count) {
+    dict->values = values;
+    dict->keys = keys;
+    dict->capacity = count;
+    
+    // Size the table while it is still empty (growing rehashes the first
+    // count values), then hash all values with one last doubling
+    dict->count = 0;
+    while (count + 1 > dict->num_slots) {
+        attribute_dict_grow(dict);
+    }
+    dict->count = count;
+    attribute_dict_grow(dict);
+}
+
+// Restores a cohort from a snapshot that matches the CSV file and balances
+// the cost model's columns. Returns false, leaving the cohort empty, if
+// there is no usable snapshot.
+static bool snapshot_load(const char *source_path, const CostModel *cost, Profile *profile, Cohort *cohort) {
+    gint64 start = profile_start(profile);
+    memset(cohort, 0, sizeof(*cohort));
+    cohort->profile = profile;
+    
+    char *path = snapshot_path(source_path);
+    GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+    free(path);
+    if (file == NULL) return false;
+    
+    const char *data = g_mapped_file_get_contents(file);
+    size_t length = g_mapped_file_get_length(file);
+    const SnapshotHeader *header = (const SnapshotHeader*)data;
+    
+    // Written by this build for this CSV, and internally consistent?
+    SnapshotHeader source;
+    bool valid = data != NULL && length >= sizeof(SnapshotHeader) &&
+                 memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == SNAPSHOT_VERSION && header->byte_order == SNAPSHOT_BYTE_ORDER &&
+                 header->num_attributes == (uint32_t)cost->num_attributes && header->file_size == length &&
+                 header->strings_offset == sizeof(SnapshotHeader) && header->strings_size > 0 &&
+                 header->students_offset == header->strings_offset + header->strings_size &&
+                 header->codes_offset == header->students_offset + (uint64_t)header->num_students * sizeof(SnapshotStudent) &&
+                 header->values_offset == header->codes_offset +
+                                          snapshot_codes_size(header->num_attributes, header->num_students) &&
+                 header->file_size >= header->values_offset &&
+                 data[header->strings_offset + header->strings_size - 1] == '\0';
+    if (valid) {
+        uint64_t total_values = 0;
+        for (int a = 0; a < cost->num_attributes && valid; a++) {
+            total_values += header->num_values[a];
+            valid = snapshot_string_valid(header, header->attribute_names[a]) &&
+                    strcmp(data + header->strings_offset + header->attribute_names[a], cost->names[a]) == 0;
+        }
+        valid = valid && header->file_size == header->values_offset + total_values * 2 * sizeof(uint32_t) &&
+                snapshot_hash(data + header->strings_offset, length - header->strings_offset) == header->payload_hash;
+    }
+    valid = valid && snapshot_describe_source(source_path, &source) &&
+            source.source_size == header->source_size && source.source_mtime == header->source_mtime &&
+            source.source_hash == header->source_hash;
+    if (!valid) {
+        g_mapped_file_unref(file);
+        return false;
+    }
+    
+    const char *strings = data + header->strings_offset;
+    const SnapshotStudent *records = (const SnapshotStudent*)(data + header->students_offset);
+    const int32_t *codes = (const int32_t*)(data + header->codes_offset);
+    const uint32_t *values = (const uint32_t*)(data + header->values_offset);
+    
+    arena_init(&cohort->arena, COHORT_ARENA_CHUNK_SIZE);
+    cohort->source_path = arena_strdup(&cohort->arena, source_path);
+    cohort->has_ids = header->has_ids != 0;
+    cohort->num_attributes = cost->num_attributes;
+    
+    // Dictionaries; the strings stay in the mapping
+    for (int a = 0; a < cohort->num_attributes && valid; a++) {
+        int count = (int)header->num_values[a];
+        char **dict_values = (char**)malloc((count + 1) * sizeof(char*));
+        char **dict_keys = (char**)malloc((count + 1) * sizeof(char*));
+        for (int code = 0; code < count; code++, values += 2) {
+            valid = valid && snapshot_string_valid(header, values[0]) && snapshot_string_valid(header, values[1]);
+            dict_values[code] = valid ? (char*)strings + values[0] : NULL;
+            dict_keys[code] = valid ? (char*)strings + values[1] : NULL;
+        }
+        
+        // A dictionary with a bad string is not hashed; the CSV is parsed instead
+        if (!valid) {
+            free(dict_values);
+            free(dict_keys);
+            break;
+        }
+        attribute_dict_init(&cohort->attributes[a], &cohort->arena);
+        attribute_dict_adopt(&cohort->attributes[a], dict_values, dict_keys, count);
+    }
+    
+    // Students
+    cohort->num_students = (int)header->num_students;
+    cohort->students = (Student*)arena_alloc(&cohort->arena, cohort->num_students * sizeof(Student));
+    for (int i = 0; i < cohort->num_students && valid; i++) {
+        const SnapshotStudent *record = &records[i];
+        Student *s = &cohort->students[i];
+        valid = snapshot_string_valid(header, record->first_name) && snapshot_string_valid(header, record->last_name) &&
+                (record->id == SNAPSHOT_NO_STRING ? !cohort->has_ids : snapshot_string_valid(header, record->id));
+        s->first_name = (char*)strings + record->first_name;
+        s->last_name = (char*)strings + record->last_name;
+        s->id = record->id == SNAPSHOT_NO_STRING ? NULL : (char*)strings + record->id;
+    }
+    
+    // The code columns are used in place
+    for (int a = 0; a < cohort->num_attributes && valid; a++) {
+        const int32_t *column = codes + (size_t)a * cohort->num_students;
+        for (int i = 0; i < cohort->num_students; i++) {
+            valid = valid && column[i] >= ATTR_CODE_NONE && column[i] < (int32_t)header->num_values[a];
+        }
+    }
+    cohort->codes = codes;
+    
+    if (!valid) {
+        fprintf(stderr, "Warning: Ignoring corrupt snapshot for %s\n", source_path);
+        free_cohort(cohort);
+        g_mapped_file_unref(file);
+        return false;
+    }
+    cohort->snapshot = file;
+    profile_stop(profile, PHASE_SNAPSHOT_LOAD, start);
+    profile_count(profile, COUNTER_STUDENTS_LOADED, cohort->num_students);
+    cohort_build_indexes(cohort);
+    
+    fprintf(stderr, "Loaded %d students from snapshot\n", cohort->num_students);
+    return true;
+}
+
+// Loads the students of a CSV file, from its snapshot if that is current.
+// After parsing the CSV, a fresh snapshot is written for the next session.
+static void load_cohort(const char *file_path, bool use_snapshot, Profile *profile, const CostModel *cost,
+                        Cohort *cohort) {
+    if (!use_snapshot || !snapshot_load(file_path, cost, profile, cohort)) {
+        load_students(file_path, cost, profile, cohort);
+        cohort->cost = *cost; // The snapshot records the column names
+        if (use_snapshot && cohort->num_students > 0) {
+            snapshot_write(cohort);
+        }
+    }
+    cohort->cost = *cost;
+    cost_model_select_kernels(&cohort->cost);
+}
+
+// ===========================
+// Distribution and Statistics
+// ===========================
+
+static void rng_seed(Rng *rng, uint64_t seed) {
+    // Scramble with splitmix64 so that nearby seeds give unrelated streams
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    rng->state = z != 0 ? z : 0x9E3779B97F4A7C15ull;
+}
+
+static uint64_t rng_next(Rng *rng) {
+    uint64_t x = rng->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng->state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static int rng_index(Rng *rng, int n) {
+    return (int)((rng_next(rng) >> 32) * (uint64_t)n >> 32);
+}
+
+static double rng_uniform(Rng *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void shuffle_students(int *order, int num_students, Rng *rng) {
+    for (int i = num_students - 1; i > 0; i--) {
+        int j = rng_index(rng, i + 1);
+        // Swap order[i] and order[j]
+        int temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+}
+
+static void assignment_init(Assignment *assignment, const Cohort *cohort, int num_classes) {
+    assignment->cost = &cohort->cost;
+    assignment->codes = cohort->codes;
+    assignment->num_classes = num_classes;
+    assignment->num_students = cohort->num_students;
+    assignment->class_of = (int*)malloc(cohort->num_students * sizeof(int));
+    assignment->class_sizes = (int*)calloc(num_classes, sizeof(int));
+    
+    for (int i = 0; i < cohort->num_students; i++) {
+        assignment->class_of[i] = -1;
+    }
+    
+    int num_codes = 0;
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        assignment->offset[a] = num_codes;
+        num_codes += cohort->attributes[a].count;
+    }
+    assignment->num_codes = num_codes;
+    assignment->counts = (int*)calloc((size_t)num_codes * num_classes, sizeof(int));
+}
+
+static void assignment_place(Assignment *assignment, const Cohort *cohort, int student, int class_index) {
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        int code = cohort_code(cohort, a, student);
+        if (code == ATTR_CODE_NONE) continue;
+        assignment->counts[(assignment->offset[a] + code) * assignment->num_classes + class_index]++;
+    }
+    assignment->class_of[student] = class_index;
+    assignment->class_sizes[class_index]++;
+}
+
+static void assignment_move(Assignment *assignment, const Cohort *cohort, int student, int class_index) {
+    int from = assignment->class_of[student];
+    
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        int code = cohort_code(cohort, a, student);
+        if (code == ATTR_CODE_NONE) continue;
+        int *row = assignment->counts + (assignment->offset[a] + code) * assignment->num_classes;
+        row[from]--;
+        row[class_index]++;
+    }
+    assignment->class_of[student] = class_index;
+    assignment->class_sizes[from]--;
+    assignment->class_sizes[class_index]++;
+}
+
+// Overwrites dest, which must have been initialised for the same cohort and class count
+static void assignment_copy(Assignment *dest, const Assignment *src) {
+    memcpy(dest->class_of, src->class_of, src->num_students * sizeof(int));
+    memcpy(dest->class_sizes, src->class_sizes, src->num_classes * sizeof(int));
+    memcpy(dest->counts, src->counts, (size_t)src->num_codes * src->num_classes * sizeof(int));
+}
+
+// Lists each class's students in file order: class c holds
+// members[offsets[c]] .. members[offsets[c + 1] - 1]
+static void assignment_rosters(const Assignment *assignment, int **offsets, int **members) {
+    int num_classes = assignment->num_classes;
+    *offsets = (int*)malloc((num_classes + 1) * sizeof(int));
+    *members = (int*)malloc((assignment->num_students > 0 ? assignment->num_students : 1) * sizeof(int));
+    
+    (*offsets)[0] = 0;
+    for (int c = 0; c < num_classes; c++) {
+        (*offsets)[c + 1] = (*offsets)[c] + assignment->class_sizes[c];
+    }
+    
+    int *fill = (int*)malloc(num_classes * sizeof(int));
+    memcpy(fill, *offsets, num_classes * sizeof(int));
+    for (int i = 0; i < assignment->num_students; i++) {
+        int c = assignment->class_of[i];
+        if (c != -1) {
+            (*members)[fill[c]++] = i;
+        }
+    }
+    free(fill);
+}
+
+static void assignment_free(Assignment *assignment) {
+    free(assignment->class_of);
+    free(assignment->class_sizes);
+    free(assignment->counts);
+    assignment->class_of = NULL;
+    assignment->class_sizes = NULL;
+    assignment->counts = NULL;
+}
+
+static void distribute_students_optimized(const Cohort *cohort, int num_classes, Rng *rng, Assignment *assignment) {
+    int num_students = cohort->num_students;
+    assignment_init(assignment, cohort, num_classes);
+    
+    // Shuffle a visiting order instead of the students themselves
+    int *order = (int*)malloc(num_students * sizeof(int));
+    for (int i = 0; i < num_students; i++) {
+        order[i] = i;
+    }
+    shuffle_students(order, num_students, rng);
+    
+    // Distribute students
+    for (int i = 0; i < num_students; i++) {
+        // Find class with minimum size
+        int min_index = 0;
+        int min_size = assignment->class_sizes[0];
+        
+        for (int j = 1; j < num_classes; j++) {
+            if (assignment->class_sizes[j] < min_size) {
+                min_size = assignment->class_sizes[j];
+                min_index = j;
+            }
+        }
+        
+        // Add student to class
+        assignment_place(assignment, cohort, order[i], min_index);
+    }
+    
+    free(order);
+}
+
+// Cost of adding a student to a class: how many students already there
+// share each balanced value of it, weighted per attribute and read from the
+// class histograms. Codes are interned case-insensitively at load time, so
+// a histogram bucket is one value.
+static double compute_cost(const Assignment *assignment, int class_index, int student) {
+    return assignment->cost->placement_cost(assignment, class_index, student);
+}
+
+static double compute_group_cost(const Assignment *assignment, int class_index, const int *group,
+                                 int group_size) {
+    double total_cost = 0.0;
+    for (int i = 0; i < group_size; i++) {
+        total_cost += compute_cost(assignment, class_index, group[i]);
+    }
+    return total_cost;
+}
+
+// One block for the group array, the separation bitsets and the member array
+static StudentGroup *alloc_student_groups(int num_groups, int num_bitset_words, int num_students) {
+    return (StudentGroup*)malloc(num_groups * sizeof(StudentGroup) + num_bitset_words * sizeof(uint64_t) +
+                                 num_students * sizeof(int));
+}
+
+static void build_student_groups(const Cohort *cohort, Rule *rules, int num_rules,
+                                 StudentGroup **groups_out, int *num_groups_out) {
+    int num_students = cohort->num_students;
+    Profile *profile = cohort->profile;
+    
+    // Resolve the rules to pairs of students first, so that lookups and
+    // merging show up separately in a profile. Separations keep their rule
+    // index for warnings.
+    gint64 start = profile_start(profile);
+    int *pairs = (int*)malloc((2 * num_rules + 1) * sizeof(int));
+    int *splits = (int*)malloc((3 * num_rules + 1) * sizeof(int));
+    int num_pairs = 0;
+    int num_splits = 0;
+    for (int i = 0; i < num_rules; i++) {
+        int idx_a = cohort_find_student(cohort, rules[i].student_a);
+        int idx_b = cohort_find_student(cohort, rules[i].student_b);
+        
+        if (idx_a >= 0 && idx_b >= 0 && rules[i].kind == RULE_SEPARATE) {
+            splits[3 * num_splits] = idx_a;
+            splits[3 * num_splits + 1] = idx_b;
+            splits[3 * num_splits + 2] = i;
+            num_splits++;
+            continue;
+        }
+        if (idx_a >= 0 && idx_b >= 0) {
+            pairs[2 * num_pairs] = idx_a;
+            pairs[2 * num_pairs + 1] = idx_b;
+            num_pairs++;
+            continue;
+        }
+        
+        const char *unresolved = idx_a < 0 ? rules[i].student_a : rules[i].student_b;
+        int reason = idx_a < 0 ? idx_a : idx_b;
+        fprintf(stderr, "Warning: Ignoring rule %s / %s: '%s' %s\n", rules[i].student_a, rules[i].student_b,
+                unresolved, reason == STUDENT_AMBIGUOUS ? "matches several students" : "not found");
+    }
+    profile_stop(profile, PHASE_RULE_RESOLUTION, start);
+    profile_count(profile, COUNTER_RULES_RESOLVED, num_pairs + num_splits);
+    profile_count(profile, COUNTER_RULES_IGNORED, num_rules - num_pairs - num_splits);
+    
+    start = profile_start(profile);
+    UnionFind uf;
+    union_find_init(&uf, num_students);
+    for (int i = 0; i < num_pairs; i++) {
+        union_find_union(&uf, pairs[2 * i], pairs[2 * i + 1]);
+    }
+    free(pairs);
+    
+    // Group students by their root in the union-find structure: number the
+    // roots in order of first appearance and count each group's size
+    int *group_of = (int*)malloc(num_students * sizeof(int));
+    int *group_size = (int*)calloc(num_students, sizeof(int));
+    int *group_root = (int*)malloc(num_students * sizeof(int));
+    int *student_group = (int*)malloc(num_students * sizeof(int));
+    int num_groups = 0;
+    
+    for (int i = 0; i < num_students; i++) {
+        group_of[i] = -1;
+    }
+    for (int i = 0; i < num_students; i++) {
+        int root = union_find_find(&uf, i);
+        if (group_of[root] == -1) {
+            group_root[num_groups] = root;
+            group_of[root] = num_groups++;
+        }
+        student_group[i] = group_of[root];
+        group_size[student_group[i]]++;
+    }
+    profile_stop(profile, PHASE_UNION_FIND, start);
+    
+    // Counting sort of the groups by size, largest first. Groups of equal
+    // size keep their order of first appearance.
+    start = profile_start(profile);
+    int *size_start = (int*)calloc(num_students + 2, sizeof(int));
+    for (int g = 0; g < num_groups; g++) {
+        size_start[num_students - group_size[g] + 1]++;
+    }
+    for (int s = 1; s <= num_students + 1; s++) {
+        size_start[s] += size_start[s - 1];
+    }
+    int *rank = group_of; // Roots are no longer needed, reuse as group -> sorted position
+    for (int g = 0; g < num_groups; g++) {
+        rank[g] = size_start[num_students - group_size[g]]++;
+    }
+    
+    // Number the groups that take part in separations, in sorted order. A
+    // separation inside one group contradicts the same-class rules.
+    int *separation_of = (int*)malloc((num_groups + 1) * sizeof(int));
+    for (int g = 0; g < num_groups; g++) {
+        separation_of[g] = -1;
+    }
+    for (int i = 0; i < num_splits; i++) {
+        int *split = &splits[3 * i];
+        split[0] = rank[student_group[split[0]]];
+        split[1] = rank[student_group[split[1]]];
+        if (split[0] == split[1]) {
+            const Rule *rule = &rules[split[2]];
+            fprintf(stderr, "Warning: Ignoring separation of %s / %s: same-class rules put them together\n",
+                    rule->student_a, rule->student_b);
+            split[0] = -1;
+            continue;
+        }
+        separation_of[split[0]] = separation_of[split[1]] = 0;
+    }
+    int num_separated = 0;
+    for (int g = 0; g < num_groups; g++) {
+        if (separation_of[g] != -1) separation_of[g] = num_separated++;
+    }
+    int words = (num_separated + 63) / 64;
+    
+    // Lay out the member array in sorted group order
+    StudentGroup *groups = alloc_student_groups(num_groups, num_separated * words, num_students);
+    uint64_t *bitsets = (uint64_t*)(groups + num_groups);
+    int *members = (int*)(bitsets + num_separated * words);
+    int *next = size_start; // Reuse as each sorted group's fill position
+    int offset = 0;
+    for (int g = 0; g < num_groups; g++) {
+        groups[rank[g]].root = group_root[g];
+        groups[rank[g]].size = group_size[g];
+    }
+    
+    memset(bitsets, 0, num_separated * words * sizeof(uint64_t));
+    for (int g = 0; g < num_groups; g++) {
+        groups[g].separation = separation_of[g];
+        groups[g].avoid = separation_of[g] != -1 ? bitsets + separation_of[g] * words : NULL;
+    }
+    for (int i = 0; i < num_splits; i++) {
+        if (splits[3 * i] == -1) continue;
+        int bit_a = separation_of[splits[3 * i]];
+        int bit_b = separation_of[splits[3 * i + 1]];
+        bitsets[bit_a * words + bit_b / 64] |= 1ull << (bit_b % 64);
+        bitsets[bit_b * words + bit_a / 64] |= 1ull << (bit_a % 64);
+    }
+    for (int g = 0; g < num_groups; g++) {
+        groups[g].members = members + offset;
+        next[g] = offset;
+        offset += groups[g].size;
+    }
+    
+    // Scatter the students, keeping them in file order within each group
+    for (int i = 0; i < num_students; i++) {
+        members[next[rank[student_group[i]]]++] = i;
+    }
+    
+    // Free memory
+    union_find_free(&uf);
+    free(group_of);
+    free(group_size);
+    free(group_root);
+    free(student_group);
+    free(size_start);
+    free(separation_of);
+    free(splits);
+    profile_stop(profile, PHASE_GROUP_BUILD, start);
+    
+    *groups_out = groups;
+    *num_groups_out = num_groups;
+}
+
+// Every student on their own, for cohorts without rules
+static void build_singleton_groups(const Cohort *cohort, StudentGroup **groups_out, int *num_groups_out) {
+    gint64 start = profile_start(cohort->profile);
+    int num_students = cohort->num_students;
+    StudentGroup *groups = alloc_student_groups(num_students, 0, num_students);
+    int *members = (int*)(groups + num_students);
+    
+    for (int i = 0; i < num_students; i++) {
+        members[i] = i;
+        groups[i].root = i;
+        groups[i].members = &members[i];
+        groups[i].size = 1;
+        groups[i].separation = -1;
+        groups[i].avoid = NULL;
+    }
+    profile_stop(cohort->profile, PHASE_GROUP_BUILD, start);
+    
+    *groups_out = groups;
+    *num_groups_out = num_students;
+}
+
+static void free_student_groups(StudentGroup *groups) {
+    free(groups);
+}
+
+// Words per bitset over the groups that have separation rules, 0 if none do
+static int separation_words(const StudentGroup *groups, int num_groups) {
+    int num_separated = 0;
+    for (int g = 0; g < num_groups; g++) {
+        if (groups[g].separation >= num_separated) num_separated = groups[g].separation + 1;
+    }
+    return (num_separated + 63) / 64;
+}
+
+// Records which separated groups each class of the assignment holds: class
+// c's bitset is occupancy[c * words] .. occupancy[(c + 1) * words - 1]
+static void separation_occupancy_fill(uint64_t *occupancy, int words, const StudentGroup *groups, int num_groups,
+                                      const Assignment *assignment) {
+    if (occupancy == NULL) return;
+    memset(occupancy, 0, (size_t)assignment->num_classes * words * sizeof(uint64_t));
+    for (int g = 0; g < num_groups; g++) {
+        int c = assignment->class_of[groups[g].members[0]];
+        if (groups[g].separation == -1 || c == -1) continue;
+        occupancy[(size_t)c * words + groups[g].separation / 64] |= 1ull << (groups[g].separation % 64);
+    }
+}
+
+// NULL if no group has separation rules, which every caller below accepts
+static uint64_t *separation_occupancy_new(int words, const StudentGroup *groups, int num_groups,
+                                          const Assignment *assignment) {
+    if (words == 0) return NULL;
+    uint64_t *occupancy = (uint64_t*)malloc((size_t)assignment->num_classes * words * sizeof(uint64_t));
+    separation_occupancy_fill(occupancy, words, groups, num_groups, assignment);
+    return occupancy;
+}
+
+// Moves a group's bit from class `from` to class `to`; -1 for either means
+// the group is being placed or removed
+static void separation_update(uint64_t *occupancy, int words, const StudentGroup *group, int from, int to) {
+    if (occupancy == NULL || group->separation == -1) return;
+    int word = group->separation / 64;
+    uint64_t bit = 1ull << (group->separation % 64);
+    if (from != -1) occupancy[(size_t)from * words + word] &= ~bit;
+    if (to != -1) occupancy[(size_t)to * words + word] |= bit;
+}
+
+// True if class_index holds a group that `group` must be kept apart from,
+// not counting `leaving` (NULL for none), which is about to move out
+static bool separation_clashes(const uint64_t *occupancy, int words, const StudentGroup *group, int class_index,
+                               const StudentGroup *leaving) {
+    if (group->avoid == NULL) return false;
+    const uint64_t *held = occupancy + (size_t)class_index * words;
+    int leaving_word = leaving != NULL && leaving->separation != -1 ? leaving->separation / 64 : -1;
+    
+    for (int w = 0; w < words; w++) {
+        uint64_t clash = group->avoid[w] & held[w];
+        if (w == leaving_word) clash &= ~(1ull << (leaving->separation % 64));
+        if (clash != 0) return true;
+    }
+    return false;
+}
+
+typedef struct {
+    int degree;
+    int group;
+} PlacementRank;
+
+static int compare_placement_ranks(const void *a, const void *b) {
+    const PlacementRank *x = a, *y = b;
+    if (x->degree != y->degree) return y->degree - x->degree;
+    return x->group - y->group;
+}
+
+// Order in which to place the groups: those with separation rules first,
+// most separations first, so that the most constrained ones choose while
+// few classes hold groups they must avoid; then the rest in their given
+// order. Class sizes are left to distribute_students_with_rules.
+static int *placement_order(const StudentGroup *groups, int num_groups, int words) {
+    PlacementRank *ranks = (PlacementRank*)malloc((num_groups + 1) * sizeof(PlacementRank));
+    for (int g = 0; g < num_groups; g++) {
+        int degree = 0;
+        for (int w = 0; groups[g].avoid != NULL && w < words; w++) {
+            degree += __builtin_popcountll(groups[g].avoid[w]);
+        }
+        ranks[g].degree = groups[g].avoid != NULL ? degree : -1;
+        ranks[g].group = g;
+    }
+    if (words > 0) qsort(ranks, num_groups, sizeof(PlacementRank), compare_placement_ranks);
+    
+    int *order = (int*)malloc((num_groups + 1) * sizeof(int));
+    for (int i = 0; i < num_groups; i++) {
+        order[i] = ranks[i].group;
+    }
+    free(ranks);
+    return order;
+}
+
+// Expects groups sorted by size, largest first, as build_student_groups
+// returns them, and places them in placement_order. Each group goes to one
+// of the smallest classes that holds
+// nobody it must be kept apart from; if all of those do, to the smallest
+// class that does not, and only if every class does, it is placed anyway
+// and counted in the warning at the end.
+static void distribute_students_with_rules(const Cohort *cohort, StudentGroup *groups, int num_groups, 
+                                        int num_classes, Assignment *assignment) {
+    assignment_init(assignment, cohort, num_classes);
+    int *candidate_indices = (int*)malloc(num_classes * sizeof(int));
+    long evaluations = 0;
+    int words = separation_words(groups, num_groups);
+    uint64_t *occupancy = separation_occupancy_new(words, groups, num_groups, assignment);
+    int *order = placement_order(groups, num_groups, words);
+    int num_clashing = 0;
+    
+    // Distribute groups to classes
+    for (int g = 0; g < num_groups; g++) {
+        StudentGroup *group = &groups[order[g]];
+        
+        // Find classes with minimum size, among those without a clash if there are any
+        bool any_fits = false;
+        for (int i = 0; i < num_classes && !any_fits; i++) {
+            any_fits = !separation_clashes(occupancy, words, group, i, NULL);
+        }
+        if (!any_fits) num_clashing++;
+        
+        int min_size = INT_MAX;
+        int num_candidates = 0;
+        
+        for (int i = 0; i < num_classes; i++) {
+            if (any_fits && separation_clashes(occupancy, words, group, i, NULL)) continue;
+            if (assignment->class_sizes[i] < min_size) {
+                min_size = assignment->class_sizes[i];
+                num_candidates = 0;
+                candidate_indices[num_candidates++] = i;
+            } else if (assignment->class_sizes[i] == min_size) {
+                candidate_indices[num_candidates++] = i;
+            }
+        }
+        
+        // Find best class based on cost
+        int best_index = candidate_indices[0];
+        double best_cost = compute_group_cost(assignment, best_index, group->members, group->size);
+        
+        for (int i = 1; i < num_candidates; i++) {
+            int idx = candidate_indices[i];
+            double cost = compute_group_cost(assignment, idx, group->members, group->size);
+            
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_index = idx;
+            }
+        }
+        
+        // Add group to best class
+        for (int i = 0; i < group->size; i++) {
+            assignment_place(assignment, cohort, group->members[i], best_index);
+        }
+        separation_update(occupancy, words, group, -1, best_index);
+        evaluations += (long)num_candidates * group->size;
+    }
+    
+    if (num_clashing > 0) {
+        fprintf(stderr, "Warning: %d groups share a class with students they must be separated from\n",
+                num_clashing);
+    }
+    free(candidate_indices);
+    free(occupancy);
+    free(order);
+    profile_count(cohort->profile, COUNTER_COST_EVALUATIONS, evaluations);
+}
+
+static void solve_options_init(SolveOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->mode = SOLVER_LOCAL_SEARCH;
+    options->max_iterations = 0;
+    options->time_limit = 2.0;
+}
+
+static uint64_t solve_options_seed(const SolveOptions *options) {
+    return options->seed != 0 ? options->seed : (uint64_t)g_get_real_time();
+}
+
+static void distribute_groups(const Cohort *cohort, StudentGroup *groups, int num_groups, bool has_rules,
+                              int num_classes, const SolveOptions *options, uint64_t seed,
+                              Assignment *assignment) {
+    Rng rng;
+    rng_seed(&rng, seed);
+    
+    gint64 start = profile_start(cohort->profile);
+    if (has_rules) {
+        distribute_students_with_rules(cohort, groups, num_groups, num_classes, assignment);
+    } else if (options->mode != SOLVER_FLOW || !distribute_students_flow(cohort, num_classes, assignment)) {
+        if (options->mode == SOLVER_FLOW) {
+            fprintf(stderr, "Warning: The flow solver found no distribution; using greedy placement\n");
+        }
+        distribute_students_optimized(cohort, num_classes, &rng, assignment);
+    }
+    profile_stop(cohort->profile, PHASE_PLACEMENT, start);
+    
+    start = profile_start(cohort->profile);
+    if (options->mode == SOLVER_ANNEALING) {
+        anneal_assignment(cohort, groups, num_groups, options, rng_next(&rng), assignment);
+    } else {
+        improve_assignment(cohort, groups, num_groups, options, &rng, assignment);
+    }
+    profile_stop(cohort->profile, PHASE_IMPROVE, start);
+}
+
+static void build_groups(const Cohort *cohort, Rule *rules, int num_rules,
+                         StudentGroup **groups, int *num_groups) {
+    if (num_rules > 0) {
+        build_student_groups(cohort, rules, num_rules, groups, num_groups);
+    } else {
+        build_singleton_groups(cohort, groups, num_groups);
+    }
+}
+
+// Index of a separation rule within a set of more than num_classes groups
+// that must all be in different classes, -1 if none turns up; *size
+// receives the set's size. Finding the largest such set is exponential in
+// general, so each set is grown from one group, always adding the
+// candidate that keeps the most candidates. That finds every "!" list that
+// is too long and most sets like it.
+static int find_separation_clique(const Cohort *cohort, UnionFind *uf, const Rule *rules, int num_rules,
+                                  int num_classes, int *size) {
+    // Number the groups that have separation rules
+    int *vertex_of = (int*)malloc((cohort->num_students + 1) * sizeof(int));
+    int *ends = (int*)malloc((2 * num_rules + 1) * sizeof(int));
+    for (int i = 0; i < cohort->num_students; i++) vertex_of[i] = -1;
+    int n = 0;
+    for (int i = 0; i < num_rules; i++) {
+        int a = rules[i].kind == RULE_SEPARATE ? cohort_find_student(cohort, rules[i].student_a) : -1;
+        int b = rules[i].kind == RULE_SEPARATE ? cohort_find_student(cohort, rules[i].student_b) : -1;
+        ends[2 * i] = ends[2 * i + 1] = -1;
+        if (a < 0 || b < 0) continue;
+        a = union_find_find(uf, a);
+        b = union_find_find(uf, b);
+        if (vertex_of[a] == -1) vertex_of[a] = n++;
+        if (vertex_of[b] == -1) vertex_of[b] = n++;
+        ends[2 * i] = vertex_of[a];
+        ends[2 * i + 1] = vertex_of[b];
+    }
+    free(vertex_of);
+    if (n <= num_classes) {
+        free(ends);
+        return -1;
+    }
+    
+    int words = (n + 63) / 64;
+    uint64_t *adjacent = (uint64_t*)calloc((size_t)n * words, sizeof(uint64_t));
+    uint64_t *candidates = (uint64_t*)malloc(words * sizeof(uint64_t));
+    uint64_t *clique = (uint64_t*)malloc(words * sizeof(uint64_t));
+    for (int i = 0; i < num_rules; i++) {
+        int a = ends[2 * i];
+        int b = ends[2 * i + 1];
+        if (a == -1) continue;
+        adjacent[(size_t)a * words + b / 64] |= 1ull << (b % 64);
+        adjacent[(size_t)b * words + a / 64] |= 1ull << (a % 64);
+    }
+    
+    int found = -1;
+    for (int v = 0; v < n && found == -1; v++) {
+        const uint64_t *row = adjacent + (size_t)v * words;
+        int degree = 0;
+        for (int w = 0; w < words; w++) degree += __builtin_popcountll(row[w]);
+        if (degree < num_classes) continue;
+        
+        memcpy(candidates, row, words * sizeof(uint64_t));
+        memset(clique, 0, words * sizeof(uint64_t));
+        clique[v / 64] |= 1ull << (v % 64);
+        int count = 1;
+        for (;;) {
+            int best = -1;
+            int best_kept = -1;
+            for (int u = 0; u < n; u++) {
+                if ((candidates[u / 64] >> (u % 64) & 1) == 0) continue;
+                int kept = 0;
+                for (int w = 0; w < words; w++) {
+                    kept += __builtin_popcountll(adjacent[(size_t)u * words + w] & candidates[w]);
+                }
+                if (kept > best_kept) {
+                    best_kept = kept;
+                    best = u;
+                }
+            }
+            if (best == -1) break;
+            clique[best / 64] |= 1ull << (best % 64);
+            count++;
+            for (int w = 0; w < words; w++) candidates[w] &= adjacent[(size_t)best * words + w];
+        }
+        if (count <= num_classes) continue;
+        
+        // Report the first rule between two of its groups
+        for (int i = 0; i < num_rules && found == -1; i++) {
+            int a = ends[2 * i];
+            int b = ends[2 * i + 1];
+            if (a != -1 && (clique[a / 64] >> (a % 64) & 1) && (clique[b / 64] >> (b % 64) & 1)) found = i;
+        }
+        *size = count;
+    }
+    
+    free(ends);
+    free(adjacent);
+    free(candidates);
+    free(clique);
+    return found;
+}
+
+// Index of the first separation rule that cannot hold, because same-class
+// rules join its students, there is only one class, or it is part of a set
+// of groups that must all be apart and outnumber the classes (see
+// find_separation_clique); -1 if all can. *num_apart (unless NULL)
+// receives the size of such a set, 0 for the other reasons. Rules naming
+// unknown students are skipped, as the distribution skips them.
+static int find_contradicting_rule(const Cohort *cohort, const Rule *rules, int num_rules, int num_classes,
+                                   int *num_apart) {
+    UnionFind uf;
+    union_find_init(&uf, cohort->num_students);
+    for (int i = 0; i < num_rules; i++) {
+        if (rules[i].kind != RULE_SAME_CLASS) continue;
+        int a = cohort_find_student(cohort, rules[i].student_a);
+        int b = cohort_find_student(cohort, rules[i].student_b);
+        if (a >= 0 && b >= 0) union_find_union(&uf, a, b);
+    }
+    
+    int contradicting = -1;
+    for (int i = 0; i < num_rules && contradicting == -1; i++) {
+        if (rules[i].kind != RULE_SEPARATE) continue;
+        int a = cohort_find_student(cohort, rules[i].student_a);
+        int b = cohort_find_student(cohort, rules[i].student_b);
+        if (a < 0 || b < 0) continue;
+        if (num_classes < 2 || union_find_find(&uf, a) == union_find_find(&uf, b)) contradicting = i;
+    }
+    
+    int size = 0;
+    if (contradicting == -1) {
+        contradicting = find_separation_clique(cohort, &uf, rules, num_rules, num_classes, &size);
+    }
+    if (num_apart != NULL) *num_apart = size;
+    union_find_free(&uf);
+    return contradicting;
+}
+
+// Number of separation rules whose students share a class in assignment,
+// which the up-front check cannot rule out in every case
+static int count_broken_separations(const Cohort *cohort, const Rule *rules, int num_rules,
+                                    const Assignment *assignment) {
+    int broken = 0;
+    for (int i = 0; i < num_rules; i++) {
+        if (rules[i].kind != RULE_SEPARATE) continue;
+        int a = cohort_find_student(cohort, rules[i].student_a);
+        int b = cohort_find_student(cohort, rules[i].student_b);
+        if (a >= 0 && b >= 0 && assignment->class_of[a] == assignment->class_of[b]) broken++;
+    }
+    return broken;
+}
+
+// Builds the initial distribution and then improves it within the budget
+static void distribute_students(const Cohort *cohort, Rule *rules, int num_rules, int num_classes,
+                                const SolveOptions *options, Assignment *assignment) {
+    StudentGroup *groups = NULL;
+    int num_groups = 0;
+    
+    build_groups(cohort, rules, num_rules, &groups, &num_groups);
+    distribute_groups(cohort, groups, num_groups, num_rules > 0, num_classes, options,
+                      solve_options_seed(options), assignment);
+    free_student_groups(groups);
+}
+
+// ===========================
+// Local Search
+// ===========================
+
+// Total cost of an assignment: every pair of classmates sharing a value
+// adds that attribute's weight. Placing students one by one with
+// compute_cost adds up to the same number.
+static double compute_total_cost(const Cohort *cohort, const Assignment *assignment) {
+    double total = 0.0;
+    
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        const int *row = assignment->counts + assignment->offset[a] * assignment->num_classes;
+        int num_counts = cohort->attributes[a].count * assignment->num_classes;
+        
+        for (int i = 0; i < num_counts; i++) {
+            total += cohort->cost.weights[a] * (double)row[i] * (row[i] - 1) / 2.0;
+        }
+    }
+    return total;
+}
+
+// Change in total cost if a student left class `from` for class `to`, from
+// the histograms alone: it stops pairing with the others in `from` and
+// starts pairing with everyone in `to`.
+static double compute_move_delta(const Assignment *assignment, int student, int from, int to) {
+    return assignment->cost->move_delta(assignment, student, from, to);
+}
+
+// Weighted number of value-sharing pairs between two sets of students
+static double compute_shared_weight(const Cohort *cohort, const int *group_a, int size_a,
+                                    const int *group_b, int size_b) {
+    double shared = 0.0;
+    
+    for (int i = 0; i < size_a; i++) {
+        for (int j = 0; j < size_b; j++) {
+            if (group_a == group_b && j <= i) continue;
+            
+            for (int k = 0; k < cohort->cost.num_active; k++) {
+                int a = cohort->cost.active[k];
+                int code = cohort_code(cohort, a, group_a[i]);
+                if (code != ATTR_CODE_NONE && code == cohort_code(cohort, a, group_b[j])) {
+                    shared += cohort->cost.weights[a];
+                }
+            }
+        }
+    }
+    return shared;
+}
+
+// Summing per-student move deltas treats the other group members as
+// staying behind; each pair inside the group that shares a value is
+// therefore off by twice its weight.
+static double compute_group_move_delta(const Assignment *assignment, const StudentGroup *group,
+                                       double internal_weight, int to) {
+    int from = assignment->class_of[group->members[0]];
+    double delta = 2.0 * internal_weight;
+    
+    for (int i = 0; i < group->size; i++) {
+        delta += compute_move_delta(assignment, group->members[i], from, to);
+    }
+    return delta;
+}
+
+// compute_group_move_delta for every class at once, 0 for the group's own,
+// from the group's rows of a compute_move_matrix
+static void sum_group_move_deltas(const Assignment *assignment, const StudentGroup *group, double internal_weight,
+                                  const double *member_deltas, double *deltas) {
+    int num_classes = assignment->num_classes;
+    int from = assignment->class_of[group->members[0]];
+    
+    for (int c = 0; c < num_classes; c++) {
+        deltas[c] = 2.0 * internal_weight;
+    }
+    for (int i = 0; i < group->size; i++) {
+        for (int c = 0; c < num_classes; c++) {
+            deltas[c] += member_deltas[i * num_classes + c];
+        }
+    }
+    deltas[from] = 0.0;
+}
+
+// Fills deltas with compute_group_move_delta for every class through
+// compute_move_matrix; scratch holds group->size rows
+static void compute_group_move_deltas(const Assignment *assignment, const StudentGroup *group, double internal_weight,
+                                      double *scratch, double *deltas) {
+    compute_move_matrix(assignment, group->members, group->size, scratch);
+    sum_group_move_deltas(assignment, group, internal_weight, scratch, deltas);
+}
+
+// Moves one student by hand, ignoring rules and class size bounds, and
+// returns the change in total cost. Only the two classes' counts change.
+static double move_student(const Cohort *cohort, Assignment *assignment, int student, int to) {
+    int from = assignment->class_of[student];
+    if (from == to) return 0.0;
+    
+    double delta = compute_move_delta(assignment, student, from, to);
+    assignment_move(assignment, cohort, student, to);
+    return delta;
+}
+
+static void move_group(const Cohort *cohort, Assignment *assignment, const StudentGroup *group, int to) {
+    for (int i = 0; i < group->size; i++) {
+        assignment_move(assignment, cohort, group->members[i], to);
+    }
+}
+
+// What local search and annealing move around: whole rule groups, with
+// class sizes kept between the smallest and largest class of the starting
+// point (or the even split, if that is wider), so balance never gets worse,
+// and no group moving in with a group it must be separated from. Each
+// search state carries its own class occupancy bitsets for the latter.
+typedef struct {
+    const Cohort *cohort;
+    const StudentGroup *groups;
+    int num_groups;
+    double *internal_weight;    // compute_shared_weight of each group with itself
+    int largest_group;
+    int min_size;
+    int max_size;
+    int separation_words;       // See separation_occupancy_fill
+} SearchSpace;
+
+// Moves group_a to class `to`, and group_b (if not -1) the other way
+typedef struct {
+    int group_a;
+    int group_b;
+    int from;
+    int to;
+    double delta;
+    int evaluations;    // Students whose move delta was computed for this proposal
+} Move;
+
+static void search_space_init(SearchSpace *space, const Cohort *cohort, const StudentGroup *groups,
+                              int num_groups, const Assignment *assignment) {
+    int num_classes = assignment->num_classes;
+    int num_students = assignment->num_students;
+    
+    space->cohort = cohort;
+    space->groups = groups;
+    space->num_groups = num_groups;
+    space->separation_words = separation_words(groups, num_groups);
+    space->min_size = num_students / num_classes;
+    space->max_size = (num_students + num_classes - 1) / num_classes;
+    for (int c = 0; c < num_classes; c++) {
+        if (assignment->class_sizes[c] < space->min_size) space->min_size = assignment->class_sizes[c];
+        if (assignment->class_sizes[c] > space->max_size) space->max_size = assignment->class_sizes[c];
+    }
+    
+    space->largest_group = 1;
+    space->internal_weight = (double*)malloc(num_groups * sizeof(double));
+    for (int g = 0; g < num_groups; g++) {
+        if (groups[g].size > space->largest_group) space->largest_group = groups[g].size;
+        space->internal_weight[g] = groups[g].size > 1
+            ? compute_shared_weight(cohort, groups[g].members, groups[g].size, groups[g].members, groups[g].size)
+            : 0.0;
+    }
+}
+
+static void search_space_free(SearchSpace *space) {
+    free(space->internal_weight);
+    space->internal_weight = NULL;
+}
+
+// Whether groups[g] may move from its class to `to`
+static bool move_allowed(const SearchSpace *space, const Assignment *assignment, const uint64_t *occupancy,
+                         int g, int to) {
+    const StudentGroup *group = &space->groups[g];
+    int from = assignment->class_of[group->members[0]];
+    return assignment->class_sizes[from] - group->size >= space->min_size &&
+           assignment->class_sizes[to] + group->size <= space->max_size &&
+           !separation_clashes(occupancy, space->separation_words, group, to, NULL);
+}
+
+// Whether groups[g1] in class `from` and groups[g2] in class `to` may trade places
+static bool swap_allowed(const SearchSpace *space, const Assignment *assignment, const uint64_t *occupancy,
+                         int g1, int g2, int from, int to) {
+    const StudentGroup *groups = space->groups;
+    const int *sizes = assignment->class_sizes;
+    int words = space->separation_words;
+    int size_change = groups[g2].size - groups[g1].size;
+    
+    return assignment->class_of[groups[g2].members[0]] == to &&
+           sizes[from] + size_change >= space->min_size && sizes[from] + size_change <= space->max_size &&
+           sizes[to] - size_change >= space->min_size && sizes[to] - size_change <= space->max_size &&
+           !separation_clashes(occupancy, words, &groups[g1], to, &groups[g2]) &&
+           !separation_clashes(occupancy, words, &groups[g2], from, &groups[g1]);
+}
+
+// Fills in the delta of a plain move or swap
+static void score_move(const SearchSpace *space, const Assignment *assignment, Move *move) {
+    const StudentGroup *groups = space->groups;
+    int g1 = move->group_a;
+    int g2 = move->group_b;
+    
+    double delta = compute_group_move_delta(assignment, &groups[g1], space->internal_weight[g1], move->to);
+    move->evaluations = groups[g1].size;
+    move->delta = delta;
+    if (g2 != -1) {
+        // The two moves evaluated independently each count pairs with the
+        // other group as if it stayed put
+        move->evaluations += groups[g2].size;
+        move->delta = delta + compute_group_move_delta(assignment, &groups[g2], space->internal_weight[g2],
+                                                       move->from)
+                    - 2.0 * compute_shared_weight(space->cohort, groups[g1].members, groups[g1].size,
+                                                  groups[g2].members, groups[g2].size);
+    }
+}
+
+// Picks a random group and target class and proposes either moving the
+// group there or swapping it with a random group of that class, whichever
+// keeps sizes in range and separations intact. Returns false if neither does.
+static bool propose_move(const SearchSpace *space, const Assignment *assignment, const uint64_t *occupancy,
+                         Rng *rng, Move *move) {
+    const StudentGroup *groups = space->groups;
+    
+    int g1 = rng_index(rng, space->num_groups);
+    int from = assignment->class_of[groups[g1].members[0]];
+    int to = rng_index(rng, assignment->num_classes - 1);
+    if (to >= from) to++;
+    
+    move->group_a = g1;
+    move->group_b = -1;
+    move->from = from;
+    move->to = to;
+    
+    bool can_move = move_allowed(space, assignment, occupancy, g1, to);
+    
+    // Half of the feasible plain moves are tried as swaps instead, so that
+    // full classes still exchange students
+    if (!can_move || (rng_next(rng) & 1)) {
+        int g2 = rng_index(rng, space->num_groups);
+        if (swap_allowed(space, assignment, occupancy, g1, g2, from, to)) {
+            move->group_b = g2;
+            score_move(space, assignment, move);
+            return true;
+        }
+        if (!can_move) return false;
+    }
+    
+    score_move(space, assignment, move);
+    return true;
+}
+
+static void apply_move(const SearchSpace *space, Assignment *assignment, uint64_t *occupancy, const Move *move) {
+    int words = space->separation_words;
+    move_group(space->cohort, assignment, &space->groups[move->group_a], move->to);
+    separation_update(occupancy, words, &space->groups[move->group_a], move->from, move->to);
+    if (move->group_b != -1) {
+        move_group(space->cohort, assignment, &space->groups[move->group_b], move->from);
+        separation_update(occupancy, words, &space->groups[move->group_b], move->to, move->from);
+    }
+}
+
+// Students scored by one compute_move_matrix call during a sweep
+#define MOVE_SWEEP_BLOCK 64
+
+// Sweeps before improve_assignment turns to random proposals
+#define MAX_MOVE_SWEEPS 8
+
+// Counts of one sweep_best_moves pass
+typedef struct {
+    long proposed;
+    long accepted;
+    long evaluations;
+} SweepStats;
+
+// One pass over all groups that scores each against every class in blocks
+// of MOVE_SWEEP_BLOCK students and acts on its best target: a plain move if
+// sizes and separations allow, otherwise a swap with the last group seen
+// in the target class whose best target was this group's class. Candidates
+// are scored again before they are applied, as earlier moves in the pass
+// change the counts.
+static void sweep_best_moves(const SearchSpace *space, Assignment *assignment, uint64_t *occupancy,
+                             SweepStats *stats) {
+    const StudentGroup *groups = space->groups;
+    int num_classes = assignment->num_classes;
+    int block_capacity = MOVE_SWEEP_BLOCK + space->largest_group;
+    int *students = (int*)malloc(block_capacity * sizeof(int));
+    double *member_deltas = (double*)malloc((size_t)block_capacity * num_classes * sizeof(double));
+    double *deltas = (double*)malloc(num_classes * sizeof(double));
+    
+    // wanting[from * num_classes + to]: group in `from` whose best target is `to`, or -1
+    int *wanting = (int*)malloc((size_t)num_classes * num_classes * sizeof(int));
+    for (int i = 0; i < num_classes * num_classes; i++) {
+        wanting[i] = -1;
+    }
+    
+    int first = 0;
+    while (first < space->num_groups) {
+        int last = first;
+        int num_students = 0;
+        while (last < space->num_groups &&
+               (num_students == 0 || num_students + groups[last].size <= MOVE_SWEEP_BLOCK)) {
+            memcpy(students + num_students, groups[last].members, groups[last].size * sizeof(int));
+            num_students += groups[last].size;
+            last++;
+        }
+        compute_move_matrix(assignment, students, num_students, member_deltas);
+        stats->evaluations += num_students;
+        
+        const double *rows = member_deltas;
+        for (int g = first; g < last; rows += (size_t)groups[g].size * num_classes, g++) {
+            int from = assignment->class_of[groups[g].members[0]];
+            sum_group_move_deltas(assignment, &groups[g], space->internal_weight[g], rows, deltas);
+            
+            int to = -1;
+            for (int c = 0; c < num_classes; c++) {
+                if (deltas[c] < 0 && (to == -1 || deltas[c] < deltas[to])) to = c;
+            }
+            if (to == -1) continue;
+            
+            Move move = {g, -1, from, to, 0.0, 0};
+            if (!move_allowed(space, assignment, occupancy, g, to)) {
+                int partner = wanting[to * num_classes + from];
+                if (partner == -1 || !swap_allowed(space, assignment, occupancy, g, partner, from, to)) {
+                    wanting[from * num_classes + to] = g;
+                    continue;
+                }
+                move.group_b = partner;
+            }
+            
+            score_move(space, assignment, &move);
+            stats->proposed++;
+            stats->evaluations += move.evaluations;
+            if (move.delta < 0) {
+                apply_move(space, assignment, occupancy, &move);
+                stats->accepted++;
+                if (move.group_b != -1) wanting[to * num_classes + from] = -1;
+            } else if (move.group_b != -1) {
+                wanting[from * num_classes + to] = g;
+            }
+        }
+        first = last;
+    }
+    
+    free(students);
+    free(member_deltas);
+    free(deltas);
+    free(wanting);
+}
+
+// Moves between two progress reports of the local search
+#define LOCAL_SEARCH_REPORT_MOVES 20000
+
+// Hill climbing over whole rule groups: accepts only moves and swaps that
+// lower the total cost. Sweeps of best moves (see sweep_best_moves) take the
+// easy gains first, then random proposals continue from where they stop.
+static void improve_assignment(const Cohort *cohort, const StudentGroup *groups, int num_groups,
+                               const SolveOptions *options, Rng *rng, Assignment *assignment) {
+    if (assignment->num_classes < 2 || num_groups < 2) return;
+    
+    SearchSpace space;
+    search_space_init(&space, cohort, groups, num_groups, assignment);
+    uint64_t *occupancy = separation_occupancy_new(space.separation_words, groups, num_groups, assignment);
+    
+    gint64 start_time = g_get_monotonic_time();
+    gint64 deadline = options->time_limit > 0
+        ? start_time + (gint64)(options->time_limit * G_USEC_PER_SEC)
+        : 0;
+    
+    SweepStats sweeps = {0, 0, 0};
+    for (int pass = 0; pass < MAX_MOVE_SWEEPS; pass++) {
+        if (deadline != 0 && g_get_monotonic_time() >= deadline) break;
+        if (g_cancellable_is_cancelled(options->cancellable)) break;
+        long accepted_before = sweeps.accepted;
+        sweep_best_moves(&space, assignment, occupancy, &sweeps);
+        if (sweeps.accepted == accepted_before) break;
+    }
+    double cost = options->progress != NULL ? compute_total_cost(cohort, assignment) : 0.0;
+    
+    // Give up after this many attempts in a row without an improvement
+    long stagnation_limit = 50L * num_groups + 1000;
+    long since_improvement = 0;
+    long proposed = sweeps.proposed, accepted = sweeps.accepted, evaluations = sweeps.evaluations;
+    
+    for (long iteration = 0; options->max_iterations <= 0 || iteration < options->max_iterations; iteration++) {
+        if (since_improvement >= stagnation_limit) break;
+        if ((iteration & 1023) == 0) {
+            if (deadline != 0 && g_get_monotonic_time() >= deadline) break;
+            if (g_cancellable_is_cancelled(options->cancellable)) break;
+        }
+        since_improvement++;
+        
+        Move move;
+        if (propose_move(&space, assignment, occupancy, rng, &move)) {
+            proposed++;
+            evaluations += move.evaluations;
+            if (move.delta < 0) {
+                apply_move(&space, assignment, occupancy, &move);
+                cost += move.delta;
+                since_improvement = 0;
+                accepted++;
+            }
+        }
+        
+        if (options->progress != NULL && (iteration + 1) % LOCAL_SEARCH_REPORT_MOVES == 0) {
+            SolveProgress report = {
+                .elapsed = (g_get_monotonic_time() - start_time) / (double)G_USEC_PER_SEC,
+                .iterations = iteration + 1,
+                .temperature = 0.0,
+                .current_cost = cost,
+                .best_cost = cost,
+            };
+            options->progress(&report, options->progress_data);
+        }
+    }
+    
+    profile_count(cohort->profile, COUNTER_MOVES_PROPOSED, proposed);
+    profile_count(cohort->profile, COUNTER_MOVES_ACCEPTED, accepted);
+    profile_count(cohort->profile, COUNTER_COST_EVALUATIONS, evaluations);
+    free(occupancy);
+    search_space_free(&space);
+}
+
+static int find_student_group(const StudentGroup *groups, int num_groups, int student) {
+    for (int g = 0; g < num_groups; g++) {
+        for (int i = 0; i < groups[g].size; i++) {
+            if (groups[g].members[i] == student) return g;
+        }
+    }
+    return -1;
+}
+
+static double group_internal_weight(const Cohort *cohort, const StudentGroup *group) {
+    return group->size > 1 ? compute_shared_weight(cohort, group->members, group->size, group->members, group->size)
+                           : 0.0;
+}
+
+// Gathers groups[merged], whose members are spread over several classes,
+// in whichever of them costs least and holds nobody it must be kept apart
+// from, then evicts the cheapest groups from there to the smallest classes
+// they may join until no class is larger than max_size. Returns false, with
+// every student back where they were, if that is not possible.
+static bool gather_merged_group(const Cohort *cohort, Assignment *assignment, const StudentGroup *groups,
+                                int num_groups, int merged, int max_size) {
+    int num_classes = assignment->num_classes;
+    int *sizes = assignment->class_sizes;
+    const StudentGroup *group = &groups[merged];
+    int words = separation_words(groups, num_groups);
+    uint64_t *occupancy = separation_occupancy_new(words, groups, num_groups, assignment);
+    double *deltas = (double*)malloc(num_classes * sizeof(double));
+    double *scratch = NULL;
+    int scratch_rows = 0;
+    int *evicted = (int*)malloc(num_groups * sizeof(int));
+    int num_evicted = 0;
+    
+    // Try gathering the group in each class it already has members in
+    int *home = (int*)calloc(group->size, sizeof(int));
+    bool *tried = (bool*)calloc(num_classes, sizeof(bool));
+    for (int i = 0; i < group->size; i++) {
+        home[i] = assignment->class_of[group->members[i]];
+    }
+    
+    int target = -1;
+    double best_delta = INFINITY;
+    for (int i = 0; i < group->size; i++) {
+        if (tried[home[i]]) continue;
+        tried[home[i]] = true;
+        if (separation_clashes(occupancy, words, group, home[i], NULL)) continue;
+        
+        double delta = 0.0;
+        for (int j = 0; j < group->size; j++) {
+            delta += move_student(cohort, assignment, group->members[j], home[i]);
+        }
+        for (int j = 0; j < group->size; j++) {
+            move_student(cohort, assignment, group->members[j], home[j]);
+        }
+        
+        if (delta < best_delta) {
+            best_delta = delta;
+            target = home[i];
+        }
+    }
+    
+    if (target != -1) {
+        for (int i = 0; i < group->size; i++) {
+            move_student(cohort, assignment, group->members[i], target);
+        }
+        separation_occupancy_fill(occupancy, words, groups, num_groups, assignment);
+    }
+    
+    // Evict the cheapest group that fits into one of the smallest classes
+    while (target != -1 && sizes[target] > max_size) {
+        int min_size = INT_MAX;
+        for (int c = 0; c < num_classes; c++) {
+            if (c != target && sizes[c] < min_size) min_size = sizes[c];
+        }
+        
+        int best_group = -1;
+        int best_class = -1;
+        double best_move = INFINITY;
+        for (int g = 0; g < num_groups; g++) {
+            if (g == merged || assignment->class_of[groups[g].members[0]] != target) continue;
+            if (min_size + groups[g].size > max_size) continue;
+            
+            if (groups[g].size > scratch_rows) {
+                scratch_rows = groups[g].size;
+                scratch = (double*)realloc(scratch, (size_t)scratch_rows * num_classes * sizeof(double));
+            }
+            compute_group_move_deltas(assignment, &groups[g], group_internal_weight(cohort, &groups[g]),
+                                      scratch, deltas);
+            for (int c = 0; c < num_classes; c++) {
+                if (c == target || sizes[c] != min_size) continue;
+                if (separation_clashes(occupancy, words, &groups[g], c, NULL)) continue;
+                if (deltas[c] < best_move) {
+                    best_move = deltas[c];
+                    best_group = g;
+                    best_class = c;
+                }
+            }
+        }
+        
+        // Stuck with an oversized class: undo the evictions and the gathering
+        if (best_group == -1) {
+            for (int i = num_evicted - 1; i >= 0; i--) {
+                move_group(cohort, assignment, &groups[evicted[i]], target);
+            }
+            for (int i = 0; i < group->size; i++) {
+                move_student(cohort, assignment, group->members[i], home[i]);
+            }
+            target = -1;
+            break;
+        }
+        move_group(cohort, assignment, &groups[best_group], best_class);
+        separation_update(occupancy, words, &groups[best_group], target, best_class);
+        evicted[num_evicted++] = best_group;
+    }
+    
+    free(home);
+    free(tried);
+    free(evicted);
+    free(occupancy);
+    free(deltas);
+    free(scratch);
+    return target != -1;
+}
+
+// Moves whichever of groups[group_a] and groups[group_b], which share a
+// class, costs less to move out: to a class with room, or in exchange for
+// a group of the same size, so that nobody meets a student they must be
+// kept apart from
+static bool separate_groups(const Cohort *cohort, Assignment *assignment, const StudentGroup *groups,
+                            int num_groups, int group_a, int group_b, int max_size) {
+    if (group_a == group_b) return false; // Contradicts the same-class rules
+    
+    int words = separation_words(groups, num_groups);
+    uint64_t *occupancy = separation_occupancy_new(words, groups, num_groups, assignment);
+    int from = assignment->class_of[groups[group_a].members[0]];
+    
+    int best_group = -1;
+    int best_partner = -1;  // Group swapped into `from`, -1 for a plain move
+    int best_class = -1;
+    double best_move = INFINITY;
+    int candidates[2] = {group_a, group_b};
+    double *deltas = (double*)malloc(assignment->num_classes * sizeof(double));
+    for (int k = 0; k < 2; k++) {
+        const StudentGroup *group = &groups[candidates[k]];
+        double *scratch = (double*)malloc((size_t)group->size * assignment->num_classes * sizeof(double));
+        compute_group_move_deltas(assignment, group, group_internal_weight(cohort, group), scratch, deltas);
+        free(scratch);
+        
+        for (int c = 0; c < assignment->num_classes; c++) {
+            if (c == from || assignment->class_sizes[c] + group->size > max_size) continue;
+            if (separation_clashes(occupancy, words, group, c, NULL)) continue;
+            if (deltas[c] < best_move) {
+                best_move = deltas[c];
+                best_group = candidates[k];
+                best_partner = -1;
+                best_class = c;
+            }
+        }
+        
+        for (int g = 0; g < num_groups; g++) {
+            const StudentGroup *partner = &groups[g];
+            int c = assignment->class_of[partner->members[0]];
+            if (c == from || partner->size != group->size) continue;
+            if (separation_clashes(occupancy, words, group, c, partner) ||
+                separation_clashes(occupancy, words, partner, from, group)) continue;
+            double delta = deltas[c]
+                         + compute_group_move_delta(assignment, partner, group_internal_weight(cohort, partner), from)
+                         - 2.0 * compute_shared_weight(cohort, group->members, group->size,
+                                                       partner->members, partner->size);
+            if (delta < best_move) {
+                best_move = delta;
+                best_group = candidates[k];
+                best_partner = g;
+                best_class = c;
+            }
+        }
+    }
+    
+    if (best_group != -1) move_group(cohort, assignment, &groups[best_group], best_class);
+    if (best_partner != -1) move_group(cohort, assignment, &groups[best_partner], from);
+    free(deltas);
+    free(occupancy);
+    return best_group != -1;
+}
+
+// Keeps an assignment consistent after rules[num_rules - 1] was added,
+// without redistributing. A same-class rule joining students in different
+// classes gathers their merged group in one of its classes and evicts
+// others from there (see gather_merged_group); a separation rule between
+// classmates moves one of their groups out (see separate_groups). Nobody
+// else moves, and no class ends up larger than the largest one before.
+// Returns false if the rule could not be fitted in like this, in which
+// case the assignment is unchanged and needs a full redistribution.
+static bool assignment_add_rule(const Cohort *cohort, Rule *rules, int num_rules, Assignment *assignment) {
+    const Rule *rule = &rules[num_rules - 1];
+    int student_a = cohort_find_student(cohort, rule->student_a);
+    int student_b = cohort_find_student(cohort, rule->student_b);
+    if (student_a < 0 || student_b < 0) return true;
+    
+    bool together = assignment->class_of[student_a] == assignment->class_of[student_b];
+    if (rule->kind == RULE_SAME_CLASS ? together : !together) return true;
+    
+    int num_students = assignment->num_students;
+    int num_classes = assignment->num_classes;
+    
+    StudentGroup *groups = NULL;
+    int num_groups = 0;
+    build_student_groups(cohort, rules, num_rules, &groups, &num_groups);
+    
+    // No class may end up larger than the largest one now (or the even split)
+    int max_size = (num_students + num_classes - 1) / num_classes;
+    for (int c = 0; c < num_classes; c++) {
+        if (assignment->class_sizes[c] > max_size) max_size = assignment->class_sizes[c];
+    }
+    
+    int group_a = find_student_group(groups, num_groups, student_a);
+    bool fitted = rule->kind == RULE_SAME_CLASS
+        ? gather_merged_group(cohort, assignment, groups, num_groups, group_a, max_size)
+        : separate_groups(cohort, assignment, groups, num_groups, group_a,
+                          find_student_group(groups, num_groups, student_b), max_size);
+    
+    free_student_groups(groups);
+    return fitted;
+}
+
+// Moves a student by hand together with everyone a same-class rule ties
+// them to, and adds the change in total cost to *delta. Returns false,
+// changing nothing, if class `to` holds someone the group must be kept
+// apart from. Class sizes are not checked, as for move_student.
+static bool assignment_move_with_rules(const Cohort *cohort, Rule *rules, int num_rules, Assignment *assignment,
+                                       int student, int to, double *delta) {
+    StudentGroup *groups = NULL;
+    int num_groups = 0;
+    build_student_groups(cohort, rules, num_rules, &groups, &num_groups);
+    
+    const StudentGroup *group = &groups[find_student_group(groups, num_groups, student)];
+    int words = separation_words(groups, num_groups);
+    uint64_t *occupancy = separation_occupancy_new(words, groups, num_groups, assignment);
+    bool allowed = occupancy == NULL || !separation_clashes(occupancy, words, group, to, NULL);
+    if (allowed) {
+        for (int i = 0; i < group->size; i++) {
+            *delta += move_student(cohort, assignment, group->members[i], to);
+        }
+    }
+    
+    free(occupancy);
+    free_student_groups(groups);
+    return allowed;
+}
+
+// ===========================
+// Simulated Annealing
+// ===========================
+
+// Moves each chain tries between two synchronisation points
+#define ANNEAL_EPOCH_MOVES 20000
+
+// Iterations per chain when neither a time nor an iteration limit is set
+#define ANNEAL_DEFAULT_MOVES_PER_GROUP 2000
+
+typedef struct {
+    const SearchSpace *space;
+    Assignment state;
+    uint64_t *occupancy;        // Separations in state, NULL without separation rules
+    Rng rng;
+    double cost;
+    long iterations;
+    long proposed;
+    long accepted;
+    long evaluations;
+    
+    // Set by the coordinator before each epoch
+    long epoch_moves;
+    double temperature;
+    gint64 deadline;
+    GCancellable *cancellable;
+} AnnealChain;
+
+static gpointer anneal_chain_run_epoch(gpointer data) {
+    AnnealChain *chain = data;
+    double temperature = chain->temperature;
+    
+    for (long i = 0; i < chain->epoch_moves; i++) {
+        if ((i & 1023) == 0) {
+            if (chain->deadline != 0 && g_get_monotonic_time() >= chain->deadline) break;
+            if (g_cancellable_is_cancelled(chain->cancellable)) break;
+        }
+        chain->iterations++;
+        
+        Move move;
+        if (!propose_move(chain->space, &chain->state, chain->occupancy, &chain->rng, &move)) continue;
+        chain->proposed++;
+        chain->evaluations += move.evaluations;
+        
+        if (move.delta <= 0 || (temperature > 0 && rng_uniform(&chain->rng) < exp(-move.delta / temperature))) {
+            apply_move(chain->space, &chain->state, chain->occupancy, &move);
+            chain->cost += move.delta;
+            chain->accepted++;
+        }
+    }
+    return NULL;
+}
+
+// Starting temperature at which an average uphill move is accepted half
+// of the time, estimated from random proposals
+static double anneal_initial_temperature(const SearchSpace *space, const Assignment *assignment,
+                                         const uint64_t *occupancy, Rng *rng) {
+    double uphill_sum = 0.0;
+    int uphill_count = 0;
+    
+    for (int i = 0; i < 1000; i++) {
+        Move move;
+        if (propose_move(space, assignment, occupancy, rng, &move) && move.delta > 0) {
+            uphill_sum += move.delta;
+            uphill_count++;
+        }
+    }
+    
+    if (uphill_count == 0) return 1.0;
+    return (uphill_sum / uphill_count) / log(2.0);
+}
+
+// Simulated annealing with one chain per thread, each starting from the
+// given assignment with its own generator. The temperature falls
+// geometrically over the budget; after every epoch the chains are joined,
+// the best state so far is remembered and chains that fell behind restart
+// from it. The best state found is left in assignment.
+static void anneal_assignment(const Cohort *cohort, const StudentGroup *groups, int num_groups,
+                              const SolveOptions *options, uint64_t seed, Assignment *assignment) {
+    if (assignment->num_classes < 2 || num_groups < 2) return;
+    
+    SearchSpace space;
+    search_space_init(&space, cohort, groups, num_groups, assignment);
+    
+    int num_chains = options->num_threads > 0 ? options->num_threads : (int)g_get_num_processors();
+    if (num_chains < 1) num_chains = 1;
+    
+    long max_iterations = options->max_iterations;
+    if (max_iterations <= 0 && options->time_limit <= 0) {
+        max_iterations = (long)ANNEAL_DEFAULT_MOVES_PER_GROUP * num_groups;
+    }
+    
+    AnnealChain *chains = (AnnealChain*)calloc(num_chains, sizeof(AnnealChain));
+    GThread **threads = (GThread**)calloc(num_chains, sizeof(GThread*));
+    double start_cost = compute_total_cost(cohort, assignment);
+    int words = space.separation_words;
+    
+    for (int i = 0; i < num_chains; i++) {
+        chains[i].space = &space;
+        assignment_init(&chains[i].state, cohort, assignment->num_classes);
+        assignment_copy(&chains[i].state, assignment);
+        chains[i].occupancy = separation_occupancy_new(words, groups, num_groups, assignment);
+        chains[i].cost = start_cost;
+    }
+    
+    Rng rng;
+    rng_seed(&rng, seed);
+    double start_temperature = anneal_initial_temperature(&space, assignment, chains[0].occupancy, &rng);
+    double end_temperature = start_temperature * 1e-3;
+    for (int i = 0; i < num_chains; i++) {
+        rng_seed(&chains[i].rng, rng_next(&rng));
+    }
+    
+    double best_cost = start_cost;
+    gint64 start_time = g_get_monotonic_time();
+    gint64 deadline = options->time_limit > 0 ? start_time + (gint64)(options->time_limit * G_USEC_PER_SEC) : 0;
+    long iterations = 0;
+    
+    for (;;) {
+        // Fraction of the budget used, by whichever limit is closer
+        gint64 now = g_get_monotonic_time();
+        double progress = 0.0;
+        if (deadline != 0) progress = (double)(now - start_time) / (deadline - start_time);
+        if (max_iterations > 0 && (double)iterations / max_iterations > progress) {
+            progress = (double)iterations / max_iterations;
+        }
+        if (progress >= 1.0) break;
+        if (g_cancellable_is_cancelled(options->cancellable)) break;
+        
+        double temperature = start_temperature * pow(end_temperature / start_temperature, progress);
+        long epoch_moves = ANNEAL_EPOCH_MOVES;
+        if (max_iterations > 0 && max_iterations - iterations < epoch_moves) {
+            epoch_moves = max_iterations - iterations;
+        }
+        
+        for (int i = 0; i < num_chains; i++) {
+            chains[i].epoch_moves = epoch_moves;
+            chains[i].temperature = temperature;
+            chains[i].deadline = deadline;
+            chains[i].cancellable = options->cancellable;
+        }
+        
+        // The calling thread runs the first chain itself
+        for (int i = 1; i < num_chains; i++) {
+            threads[i] = g_thread_new("anneal", anneal_chain_run_epoch, &chains[i]);
+        }
+        anneal_chain_run_epoch(&chains[0]);
+        for (int i = 1; i < num_chains; i++) {
+            g_thread_join(threads[i]);
+        }
+        iterations = chains[0].iterations;
+        
+        int best_chain = 0;
+        double cost_sum = 0.0;
+        for (int i = 0; i < num_chains; i++) {
+            cost_sum += chains[i].cost;
+            if (chains[i].cost < chains[best_chain].cost) best_chain = i;
+        }
+        
+        if (chains[best_chain].cost < best_cost) {
+            best_cost = chains[best_chain].cost;
+            assignment_copy(assignment, &chains[best_chain].state);
+        }
+        
+        if (options->progress != NULL) {
+            SolveProgress report = {
+                .elapsed = (g_get_monotonic_time() - start_time) / (double)G_USEC_PER_SEC,
+                .iterations = iterations,
+                .temperature = temperature,
+                .current_cost = cost_sum / num_chains,
+                .best_cost = best_cost,
+            };
+            options->progress(&report, options->progress_data);
+        }
+        
+        // Chains that drifted above the best state continue from it
+        for (int i = 0; i < num_chains; i++) {
+            if (chains[i].cost > best_cost) {
+                assignment_copy(&chains[i].state, assignment);
+                separation_occupancy_fill(chains[i].occupancy, words, groups, num_groups, assignment);
+                chains[i].cost = best_cost;
+            }
+        }
+    }
+    
+    for (int i = 0; i < num_chains; i++) {
+        profile_count(cohort->profile, COUNTER_MOVES_PROPOSED, chains[i].proposed);
+        profile_count(cohort->profile, COUNTER_MOVES_ACCEPTED, chains[i].accepted);
+        profile_count(cohort->profile, COUNTER_COST_EVALUATIONS, chains[i].evaluations);
+        assignment_free(&chains[i].state);
+        free(chains[i].occupancy);
+    }
+    free(chains);
+    free(threads);
+    search_space_free(&space);
+}
+
+// ===========================
+// Portfolio of Restarts
+// ===========================
+
+typedef struct {
+    const Cohort *cohort;
+    StudentGroup *groups;
+    int num_groups;
+    bool has_rules;
+    int num_classes;
+    SolveOptions options;
+    PortfolioEntry *entries;
+    int num_starts;
+    volatile gint next_start;
+} PortfolioRun;
+
+static gpointer portfolio_worker(gpointer data) {
+    PortfolioRun *run = data;
+    
+    for (;;) {
+        int i = g_atomic_int_add(&run->next_start, 1);
+        if (i >= run->num_starts) break;
+        
+        PortfolioEntry *entry = &run->entries[i];
+        distribute_groups(run->cohort, run->groups, run->num_groups, run->has_rules, run->num_classes,
+                          &run->options, entry->seed, &entry->assignment);
+        entry->cost = compute_total_cost(run->cohort, &entry->assignment);
+    }
+    return NULL;
+}
+
+// Share of students that would have to change class to turn a into b,
+// after matching up the classes of both greedily by overlap (class
+// numbers themselves carry no meaning)
+static double assignment_distance(const Assignment *a, const Assignment *b) {
+    int num_classes = a->num_classes;
+    if (a->num_students == 0) return 0.0;
+    
+    int *overlap = (int*)calloc((size_t)num_classes * num_classes, sizeof(int));
+    for (int i = 0; i < a->num_students; i++) {
+        overlap[a->class_of[i] * num_classes + b->class_of[i]]++;
+    }
+    
+    bool *row_used = (bool*)calloc(num_classes, sizeof(bool));
+    bool *col_used = (bool*)calloc(num_classes, sizeof(bool));
+    int matched = 0;
+    
+    for (int step = 0; step < num_classes; step++) {
+        int best = -1;
+        for (int cell = 0; cell < num_classes * num_classes; cell++) {
+            if (row_used[cell / num_classes] || col_used[cell % num_classes]) continue;
+            if (best == -1 || overlap[cell] > overlap[best]) best = cell;
+        }
+        row_used[best / num_classes] = true;
+        col_used[best % num_classes] = true;
+        matched += overlap[best];
+    }
+    
+    free(overlap);
+    free(row_used);
+    free(col_used);
+    return 1.0 - (double)matched / a->num_students;
+}
+
+static int compare_portfolio_entries(const void *a, const void *b) {
+    double cost_a = ((const PortfolioEntry*)a)->cost;
+    double cost_b = ((const PortfolioEntry*)b)->cost;
+    return (cost_a > cost_b) - (cost_a < cost_b);
+}
+
+// Runs num_starts independently seeded distributions in parallel (one per
+// core) and keeps up to top_k of them, cheapest first, skipping any that
+// differ from an already kept one in less than min_distance of the
+// students. Annealing chains are not nested inside the restarts: each
+// restart runs a single chain. Restarts are bounded by the iteration
+// budget alone, so that each can be repeated from its seed.
+static void run_portfolio(const Cohort *cohort, Rule *rules, int num_rules, int num_classes,
+                          const SolveOptions *options, int num_starts, int top_k, double min_distance,
+                          PortfolioEntry **entries_out, int *num_entries_out) {
+    PortfolioRun run;
+    memset(&run, 0, sizeof(run));
+    run.cohort = cohort;
+    run.has_rules = num_rules > 0;
+    run.num_classes = num_classes;
+    run.options = *options;
+    run.options.num_threads = 1;
+    run.options.time_limit = 0.0;
+    run.options.progress = NULL;
+    run.num_starts = num_starts;
+    run.entries = (PortfolioEntry*)calloc(num_starts, sizeof(PortfolioEntry));
+    build_groups(cohort, rules, num_rules, &run.groups, &run.num_groups);
+    
+    Rng rng;
+    rng_seed(&rng, solve_options_seed(options));
+    for (int i = 0; i < num_starts; i++) {
+        run.entries[i].seed = rng_next(&rng) >> 1 | 1; // Non-zero, and fits a signed 64-bit parser
+    }
+    
+    int num_workers = (int)g_get_num_processors();
+    if (num_workers > num_starts) num_workers = num_starts;
+    if (num_workers < 1) num_workers = 1;
+    
+    GThread **threads = (GThread**)calloc(num_workers, sizeof(GThread*));
+    for (int i = 1; i < num_workers; i++) {
+        threads[i] = g_thread_new("portfolio", portfolio_worker, &run);
+    }
+    portfolio_worker(&run);
+    for (int i = 1; i < num_workers; i++) {
+        g_thread_join(threads[i]);
+    }
+    free(threads);
+    free_student_groups(run.groups);
+    
+    // Keep the cheapest entries that are far enough from each other
+    qsort(run.entries, num_starts, sizeof(PortfolioEntry), compare_portfolio_entries);
+    int num_kept = 0;
+    for (int i = 0; i < num_starts; i++) {
+        bool distinct = num_kept < top_k;
+        for (int j = 0; distinct && j < num_kept; j++) {
+            distinct = assignment_distance(&run.entries[j].assignment, &run.entries[i].assignment) >= min_distance;
+        }
+        
+        if (distinct) {
+            PortfolioEntry kept = run.entries[i];
+            run.entries[i] = run.entries[num_kept];
+            run.entries[num_kept++] = kept;
+        }
+    }
+    
+    for (int i = num_kept; i < num_starts; i++) {
+        assignment_free(&run.entries[i].assignment);
+    }
+    for (int i = 0; i < num_kept; i++) {
+        run.entries[i].distance = assignment_distance(&run.entries[0].assignment, &run.entries[i].assignment);
+    }
+    
+    *entries_out = run.entries;
+    *num_entries_out = num_kept;
+}
+
+static void free_portfolio(PortfolioEntry *entries, int num_entries) {
+    for (int i = 0; i < num_entries; i++) {
+        assignment_free(&entries[i].assignment);
+    }
+    free(entries);
+}
+
+// ===========================
+// Flow Distribution
+// ===========================
+
+// Flow network with lower and upper bounds per arc, solved for a feasible
+// flow by Dinic's algorithm. Arcs are stored in pairs: arc i ^ 1 is the
+// residual reverse of arc i.
+typedef struct {
+    int num_nodes;
+    int num_arcs;
+    int arc_capacity;
+    int *first;         // First arc out of each node, -1 if none
+    int *next;          // Next arc out of the same node
+    int *to;
+    int *capacity;      // Residual capacity
+    int *lower;         // Lower bound of forward arcs
+    int *excess;        // Flow the lower bounds push into each node, negative for out
+    int *level;
+    int *current;       // Next arc to try from each node in a blocking flow
+} FlowNetwork;
+
+static void flow_network_init(FlowNetwork *net, int num_nodes, int arc_hint) {
+    net->num_nodes = num_nodes;
+    net->num_arcs = 0;
+    net->arc_capacity = arc_hint > 0 ? 2 * arc_hint : 16;
+    net->first = (int*)malloc(num_nodes * sizeof(int));
+    net->next = (int*)malloc(net->arc_capacity * sizeof(int));
+    net->to = (int*)malloc(net->arc_capacity * sizeof(int));
+    net->capacity = (int*)malloc(net->arc_capacity * sizeof(int));
+    net->lower = (int*)malloc(net->arc_capacity * sizeof(int));
+    net->excess = (int*)calloc(num_nodes, sizeof(int));
+    net->level = (int*)malloc(num_nodes * sizeof(int));
+    net->current = (int*)malloc(num_nodes * sizeof(int));
+    for (int i = 0; i < num_nodes; i++) {
+        net->first[i] = -1;
+    }
+}
+
+static void flow_network_free(FlowNetwork *net) {
+    free(net->first);
+    free(net->next);
+    free(net->to);
+    free(net->capacity);
+    free(net->lower);
+    free(net->excess);
+    free(net->level);
+    free(net->current);
+}
+
+static void flow_network_link(FlowNetwork *net, int from, int to, int capacity, int lower) {
+    if (net->num_arcs == net->arc_capacity) {
+        net->arc_capacity *= 2;
+        net->next = (int*)realloc(net->next, net->arc_capacity * sizeof(int));
+        net->to = (int*)realloc(net->to, net->arc_capacity * sizeof(int));
+        net->capacity = (int*)realloc(net->capacity, net->arc_capacity * sizeof(int));
+        net->lower = (int*)realloc(net->lower, net->arc_capacity * sizeof(int));
+    }
+    int arc = net->num_arcs++;
+    net->to[arc] = to;
+    net->capacity[arc] = capacity;
+    net->lower[arc] = lower;
+    net->next[arc] = net->first[from];
+    net->first[from] = arc;
+}
+
+// Adds an arc that must carry between lower and upper units; returns its index
+static int flow_network_add(FlowNetwork *net, int from, int to, int lower, int upper) {
+    int arc = net->num_arcs;
+    flow_network_link(net, from, to, upper - lower, lower);
+    flow_network_link(net, to, from, 0, 0);
+    net->excess[to] += lower;
+    net->excess[from] -= lower;
+    return arc;
+}
+
+static int flow_network_flow(const FlowNetwork *net, int arc) {
+    return net->lower[arc] + net->capacity[arc ^ 1];
+}
+
+// Levels by BFS distance from source over arcs with residual capacity;
+// false if sink cannot be reached
+static bool flow_network_levels(FlowNetwork *net, int source, int sink, int *queue) {
+    for (int i = 0; i < net->num_nodes; i++) {
+        net->level[i] = -1;
+    }
+    int head = 0, tail = 0;
+    net->level[source] = 0;
+    queue[tail++] = source;
+    while (head < tail) {
+        int node = queue[head++];
+        for (int arc = net->first[node]; arc != -1; arc = net->next[arc]) {
+            int to = net->to[arc];
+            if (net->capacity[arc] > 0 && net->level[to] == -1) {
+                net->level[to] = net->level[node] + 1;
+                queue[tail++] = to;
+            }
+        }
+    }
+    return net->level[sink] != -1;
+}
+
+// Pushes up to limit units along one path of increasing levels
+static int flow_network_push(FlowNetwork *net, int node, int sink, int limit) {
+    if (node == sink) return limit;
+    
+    for (; net->current[node] != -1; net->current[node] = net->next[net->current[node]]) {
+        int arc = net->current[node];
+        int to = net->to[arc];
+        if (net->capacity[arc] <= 0 || net->level[to] != net->level[node] + 1) continue;
+        
+        int pushed = flow_network_push(net, to, sink, limit < net->capacity[arc] ? limit : net->capacity[arc]);
+        if (pushed > 0) {
+            net->capacity[arc] -= pushed;
+            net->capacity[arc ^ 1] += pushed;
+            return pushed;
+        }
+    }
+    return 0;
+}
+
+static long flow_network_max_flow(FlowNetwork *net, int source, int sink) {
+    int *queue = (int*)malloc(net->num_nodes * sizeof(int));
+    long total = 0;
+    
+    while (flow_network_levels(net, source, sink, queue)) {
+        memcpy(net->current, net->first, net->num_nodes * sizeof(int));
+        int pushed;
+        while ((pushed = flow_network_push(net, source, sink, INT32_MAX)) > 0) {
+            total += pushed;
+        }
+    }
+    free(queue);
+    return total;
+}
+
+// Finds a flow from source to sink that meets every arc's bounds. The two
+// nodes after the network's own ones must be free for the auxiliary source
+// and sink that carry the lower bounds; max_flow caps the return arc.
+static bool flow_network_feasible(FlowNetwork *net, int source, int sink, int max_flow) {
+    int super_source = net->num_nodes - 2;
+    int super_sink = net->num_nodes - 1;
+    flow_network_add(net, sink, source, 0, max_flow);
+    
+    long demand = 0;
+    for (int i = 0; i < super_source; i++) {
+        if (net->excess[i] > 0) {
+            flow_network_link(net, super_source, i, net->excess[i], 0);
+            flow_network_link(net, i, super_source, 0, 0);
+            demand += net->excess[i];
+        } else if (net->excess[i] < 0) {
+            flow_network_link(net, i, super_sink, -net->excess[i], 0);
+            flow_network_link(net, super_sink, i, 0, 0);
+        }
+    }
+    return flow_network_max_flow(net, super_source, super_sink) == demand;
+}
+
+// Stable counting sort of order[0..n) by the students' codes of attribute a
+static void sort_students_by_code(const Cohort *cohort, int a, int *order, int n, int *scratch) {
+    int num_buckets = cohort->attributes[a].count + 1;  // A missing value sorts first
+    int *bucket_start = (int*)calloc(num_buckets + 1, sizeof(int));
+    
+    for (int i = 0; i < n; i++) {
+        bucket_start[cohort_code(cohort, a, order[i]) + 2]++;
+    }
+    for (int b = 1; b <= num_buckets; b++) {
+        bucket_start[b] += bucket_start[b - 1];
+    }
+    for (int i = 0; i < n; i++) {
+        scratch[bucket_start[cohort_code(cohort, a, order[i]) + 1]++] = order[i];
+    }
+    memcpy(order, scratch, n * sizeof(int));
+    free(bucket_start);
+}
+
+// Students sharing every balanced value are interchangeable, so the solver
+// works on these combinations. Sorts the students by gender, BG Gutachten,
+// the declared columns and then Grundschule, sorting by the least
+// significant column first, and returns the runs of equal codes.
+static int sort_student_combinations(const Cohort *cohort, int *order, int *combo_start) {
+    int num_students = cohort->num_students;
+    int *scratch = (int*)malloc((num_students + 1) * sizeof(int));
+    for (int i = 0; i < num_students; i++) {
+        order[i] = i;
+    }
+    
+    sort_students_by_code(cohort, ATTR_GRUNDSCHULE, order, num_students, scratch);
+    for (int a = cohort->num_attributes - 1; a >= NUM_BUILTIN_ATTRIBUTES; a--) {
+        sort_students_by_code(cohort, a, order, num_students, scratch);
+    }
+    sort_students_by_code(cohort, ATTR_BG_GUTACHTEN, order, num_students, scratch);
+    sort_students_by_code(cohort, ATTR_GENDER, order, num_students, scratch);
+    free(scratch);
+    
+    int num_combos = 0;
+    for (int i = 0; i < num_students; i++) {
+        bool same = i > 0;
+        for (int a = 0; a < cohort->num_attributes && same; a++) {
+            same = cohort_code(cohort, a, order[i]) == cohort_code(cohort, a, order[i - 1]);
+        }
+        if (!same) combo_start[num_combos++] = i;
+    }
+    combo_start[num_combos] = num_students;
+    return num_combos;
+}
+
+// Distributes a cohort without rules through the transportation network
+//
+//   source -> combination k -> (Grundschule v, class c) -> class c -> sink
+//
+// as a feasible flow that keeps every arc within floor and ceiling of its
+// even share. The network is totally unimodular and even fractional shares
+// satisfy it, so such an integral flow should always exist; if none is
+// found all the same, the assignment is freed and false returned, for the
+// caller to place the students another way. It spreads every
+// combination and every Grundschule as evenly as possible over balanced
+// classes. That is a good starting point, not an optimum: gender, BG
+// Gutachten and the declared columns across schools are not modelled and
+// are left to the local search that follows.
+static bool distribute_students_flow(const Cohort *cohort, int num_classes, Assignment *assignment) {
+    int num_students = cohort->num_students;
+    assignment_init(assignment, cohort, num_classes);
+    
+    // Combination k is order[combo_start[k]] .. order[combo_start[k + 1] - 1]
+    int *order = (int*)malloc((num_students + 1) * sizeof(int));
+    int *combo_start = (int*)malloc((num_students + 1) * sizeof(int));
+    int num_combos = sort_student_combinations(cohort, order, combo_start);
+    
+    // School index code + 1, so that a missing school gets a slot of its own
+    int num_schools = cohort->attributes[ATTR_GRUNDSCHULE].count + 1;
+    int *school_sizes = (int*)calloc(num_schools, sizeof(int));
+    for (int i = 0; i < num_students; i++) {
+        school_sizes[cohort_code(cohort, ATTR_GRUNDSCHULE, i) + 1]++;
+    }
+    
+    int source = 0;
+    int sink = 1;
+    int combo_base = 2;
+    int school_base = combo_base + num_combos;
+    int class_base = school_base + num_schools * num_classes;
+    int num_nodes = class_base + num_classes + 2;
+    
+    FlowNetwork net;
+    flow_network_init(&net, num_nodes, (num_combos + num_schools + 1) * num_classes + num_combos + 1);
+    int *combo_arcs = (int*)malloc(((size_t)num_combos * num_classes + 1) * sizeof(int));
+    int first_class = 0;
+    for (int k = 0; k < num_combos; k++) {
+        int size = combo_start[k + 1] - combo_start[k];
+        int school = cohort_code(cohort, ATTR_GRUNDSCHULE, order[combo_start[k]]) + 1;
+        flow_network_add(&net, source, combo_base + k, size, size);
+        
+        // Any bounded flow is optimal, but the one found follows the arc
+        // order, and arcs are tried last added first. Offering each
+        // combination the classes from first_class on rotates the students
+        // left over after even shares through the classes, which keeps
+        // gender and BG Gutachten balanced across schools as well.
+        for (int j = num_classes - 1; j >= 0; j--) {
+            int c = (first_class + j) % num_classes;
+            combo_arcs[k * num_classes + c] =
+                flow_network_add(&net, combo_base + k, school_base + school * num_classes + c,
+                                 size / num_classes, (size + num_classes - 1) / num_classes);
+        }
+        first_class = (first_class + size % num_classes) % num_classes;
+    }
+    for (int v = 0; v < num_schools; v++) {
+        for (int c = 0; c < num_classes; c++) {
+            flow_network_add(&net, school_base + v * num_classes + c, class_base + c,
+                             school_sizes[v] / num_classes, (school_sizes[v] + num_classes - 1) / num_classes);
+        }
+    }
+    for (int c = 0; c < num_classes; c++) {
+        flow_network_add(&net, class_base + c, sink,
+                         num_students / num_classes, (num_students + num_classes - 1) / num_classes);
+    }
+    
+    bool feasible = flow_network_feasible(&net, source, sink, num_students);
+    for (int k = 0; k < num_combos && feasible; k++) {
+        int next = combo_start[k];
+        for (int c = 0; c < num_classes; c++) {
+            int count = flow_network_flow(&net, combo_arcs[k * num_classes + c]);
+            for (int j = 0; j < count; j++) {
+                assignment_place(assignment, cohort, order[next++], c);
+            }
+        }
+    }
+    
+    if (!feasible) assignment_free(assignment);
+    
+    flow_network_free(&net);
+    free(combo_arcs);
+    free(school_sizes);
+    free(combo_start);
+    free(order);
+    return feasible;
+}
+
+// Cost that no distribution into num_classes classes can beat: on its own,
+// each attribute is best off with every value spread evenly over the classes.
+// A distribution that reaches it is optimal.
+static double compute_cost_lower_bound(const Cohort *cohort, int num_classes) {
+    double bound = 0.0;
+    
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        int num_values = cohort->attributes[a].count;
+        int *value_counts = (int*)calloc(num_values + 1, sizeof(int));
+        for (int i = 0; i < cohort->num_students; i++) {
+            int code = cohort_code(cohort, a, i);
+            if (code != ATTR_CODE_NONE) value_counts[code]++;
+        }
+        
+        for (int v = 0; v < num_values; v++) {
+            double share = value_counts[v] / num_classes;   // Floor of the even share
+            int larger = value_counts[v] % num_classes;     // Classes that get one more
+            bound += cohort->cost.weights[a] * ((num_classes - larger) * share * (share - 1) / 2.0 +
+                                        larger * (share + 1) * share / 2.0);
+        }
+        free(value_counts);
+    }
+    return bound;
+}
+
+// ===========================
+// Statistics
+// ===========================
+
+// Statistics text for one class, read straight from the assignment's
+// per-class counts in O(distinct values) without touching the students
+static char *format_class_stats(const Cohort *cohort, const Assignment *assignment, int class_index) {
+    int num_classes = assignment->num_classes;
+    int code_m = attribute_dict_find(&cohort->attributes[ATTR_GENDER], "m");
+    int code_w = attribute_dict_find(&cohort->attributes[ATTR_GENDER], "w");
+    
+    const int *gender_counts = assignment->counts + assignment->offset[ATTR_GENDER] * num_classes;
+    
+    int count_m = code_m != ATTR_CODE_NONE ? gender_counts[code_m * num_classes + class_index] : 0;
+    int count_w = code_w != ATTR_CODE_NONE ? gender_counts[code_w * num_classes + class_index] : 0;
+    
+    StringBuilder builder;
+    string_builder_init(&builder);
+    string_builder_appendf(&builder, "Gender distribution: m = %d, w = %d\n", count_m, count_w);
+    
+    // Every other attribute lists the values present in the class
+    for (int a = 0; a < cohort->num_attributes; a++) {
+        if (a == ATTR_GENDER) continue;
+        const AttributeDict *dict = &cohort->attributes[a];
+        const int *counts = assignment->counts + assignment->offset[a] * num_classes;
+        
+        string_builder_appendf(&builder, "\n%s distribution:\n", cohort->cost.names[a]);
+        for (int i = 0; i < dict->count; i++) {
+            int count = counts[i * num_classes + class_index];
+            if (count == 0) continue;
+            const char *value = str_is_empty(dict->values[i]) ? "Unknown" : dict->values[i];
+            string_builder_appendf(&builder, "  %s: %d\n", value, count);
+        }
+    }
+    
+    return string_builder_finish(&builder);
+}
+
+// Statistics text for every class, NULL for empty classes. Costs
+// O(classes x distinct values) and never touches the students.
+static char **compute_class_stats(const Cohort *cohort, const Assignment *assignment) {
+    gint64 start = profile_start(cohort->profile);
+    char **stats = (char**)calloc(assignment->num_classes, sizeof(char*));
+    for (int c = 0; c < assignment->num_classes; c++) {
+        if (assignment->class_sizes[c] == 0) continue;
+        stats[c] = format_class_stats(cohort, assignment, c);
+    }
+    profile_stop(cohort->profile, PHASE_STATS, start);
+    return stats;
+}
+
+static void free_class_stats(char **stats, int num_classes) {
+    for (int c = 0; c < num_classes; c++) {
+        free(stats[c]);
+    }
+    free(stats);
+}
+
+// ===========================
+// Class List Model
+// ===========================
+
+// The class tabs show a GListModel over the class's student indices. Rows
+// are created only when the column view asks for them, and their labels
+// read the strings straight from the cohort.
+
+struct _SorterStudentItem {
+    GObject parent_instance;
+    const Cohort *cohort;
+    int student;
+};
+
+G_DEFINE_TYPE(SorterStudentItem, sorter_student_item, G_TYPE_OBJECT)
+
+static void sorter_student_item_class_init(SorterStudentItemClass *klass) {
+}
+
+static void sorter_student_item_init(SorterStudentItem *item) {
+}
+
+struct _SorterClassList {
+    GObject parent_instance;
+    const Cohort *cohort;
+    GArray *students;               // Student indices in display order
+};
+
+static void sorter_class_list_model_init(GListModelInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(SorterClassList, sorter_class_list, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, sorter_class_list_model_init))
+
+static GType sorter_class_list_get_item_type(GListModel *model) {
+    return SORTER_TYPE_STUDENT_ITEM;
+}
+
+static guint sorter_class_list_get_n_items(GListModel *model) {
+    return SORTER_CLASS_LIST(model)->students->len;
+}
+
+static gpointer sorter_class_list_get_item(GListModel *model, guint position) {
+    SorterClassList *list = SORTER_CLASS_LIST(model);
+    if (position >= list->students->len) return NULL;
+    
+    SorterStudentItem *item = g_object_new(SORTER_TYPE_STUDENT_ITEM, NULL);
+    item->cohort = list->cohort;
+    item->student = g_array_index(list->students, int, position);
+    return item;
+}
+
+static void sorter_class_list_model_init(GListModelInterface *iface) {
+    iface->get_item_type = sorter_class_list_get_item_type;
+    iface->get_n_items = sorter_class_list_get_n_items;
+    iface->get_item = sorter_class_list_get_item;
+}
+
+static void sorter_class_list_finalize(GObject *object) {
+    g_array_free(SORTER_CLASS_LIST(object)->students, TRUE);
+    G_OBJECT_CLASS(sorter_class_list_parent_class)->finalize(object);
+}
+
+static void sorter_class_list_class_init(SorterClassListClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = sorter_class_list_finalize;
+}
+
+static void sorter_class_list_init(SorterClassList *list) {
+    list->students = g_array_new(FALSE, FALSE, sizeof(int));
+}
+
+static SorterClassList *sorter_class_list_new(const Cohort *cohort, const int *students, int num_students) {
+    SorterClassList *list = g_object_new(SORTER_TYPE_CLASS_LIST, NULL);
+    list->cohort = cohort;
+    g_array_append_vals(list->students, students, num_students);
+    return list;
+}
+
+// Replaces all rows
+static void sorter_class_list_set(SorterClassList *list, const int *students, int num_students) {
+    guint removed = list->students->len;
+    g_array_set_size(list->students, 0);
+    g_array_append_vals(list->students, students, num_students);
+    g_list_model_items_changed(G_LIST_MODEL(list), 0, removed, num_students);
+}
+
+static int sorter_class_list_student(SorterClassList *list, guint position) {
+    return g_array_index(list->students, int, position);
+}
+
+static void sorter_class_list_remove(SorterClassList *list, guint position) {
+    g_array_remove_index(list->students, position);
+    g_list_model_items_changed(G_LIST_MODEL(list), position, 1, 0);
+}
+
+static void sorter_class_list_append(SorterClassList *list, int student) {
+    g_array_append_val(list->students, student);
+    g_list_model_items_changed(G_LIST_MODEL(list), list->students->len - 1, 0, 1);
+}
+
+// ===========================
+// GUI Components
+// ===========================
+
+static void show_error_dialog(GtkWindow *parent, const char *message) {
+    GtkAlertDialog *dialog = gtk_alert_dialog_new("%s", message);
+    gtk_alert_dialog_set_modal(dialog, TRUE);
+    gtk_alert_dialog_show(dialog, parent);
+    g_object_unref(dialog);
+}
+
+// Text of one column of the class lists: the names, gender, Grundschule,
+// BG Gutachten and then the declared columns
+static const char *student_column_text(const Cohort *cohort, int student, int column) {
+    const Student *s = &cohort->students[student];
+    switch (column) {
+        case 0: return s->first_name ? s->first_name : "";
+        case 1: return s->last_name ? s->last_name : "";
+        case 2: return cohort_student_value(cohort, ATTR_GENDER, student);
+        case 3: return cohort_student_value(cohort, ATTR_GRUNDSCHULE, student);
+        case 4: return cohort_student_value(cohort, ATTR_BG_GUTACHTEN, student);
+        default: return cohort_student_value(cohort, column - 2, student);
+    }
+}
+
+static void student_cell_setup(GtkSignalListItemFactory *factory, GtkListItem *list_item, gpointer user_data) {
+    GtkWidget *label = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+    gtk_list_item_set_child(list_item, label);
+}
+
+static void student_cell_bind(GtkSignalListItemFactory *factory, GtkListItem *list_item, gpointer user_data) {
+    SorterStudentItem *item = gtk_list_item_get_item(list_item);
+    const char *text = student_column_text(item->cohort, item->student, GPOINTER_TO_INT(user_data));
+    gtk_label_set_text(GTK_LABEL(gtk_list_item_get_child(list_item)), text);
+}
+
+// Takes ownership of the selection. Only the rows in view get widgets,
+// which are recycled while scrolling.
+static GtkWidget *create_class_column_view(const Cohort *cohort, GtkSingleSelection *selection) {
+    GtkWidget *column_view = gtk_column_view_new(GTK_SELECTION_MODEL(selection));
+    
+    const char *columns[] = {"Vorname", "Nachname", "Geschlecht", "Grundschule", "BG-Gutachten"};
+    int num_columns = 5 + cohort->num_attributes - NUM_BUILTIN_ATTRIBUTES;
+    for (int i = 0; i < num_columns; i++) {
+        GtkListItemFactory *factory = gtk_signal_list_item_factory_new();
+        g_signal_connect(factory, "setup", G_CALLBACK(student_cell_setup), NULL);
+        g_signal_connect(factory, "bind", G_CALLBACK(student_cell_bind), GINT_TO_POINTER(i));
+        
+        const char *title = i < 5 ? columns[i] : cohort->cost.names[i - 2];
+        GtkColumnViewColumn *column = gtk_column_view_column_new(title, factory);
+        gtk_column_view_column_set_expand(column, TRUE);
+        gtk_column_view_append_column(GTK_COLUMN_VIEW(column_view), column);
+        g_object_unref(column);
+    }
+    
+    return column_view;
+}
+
+static void update_rule_textview(GtkTextView *textview, GArray *rules) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(textview);
+    gtk_text_buffer_set_text(buffer, "", -1);
+    
+    GtkTextIter iter;
+    gtk_text_buffer_get_start_iter(buffer, &iter);
+    
+    for (guint i = 0; i < rules->len; i++) {
+        Rule *rule = &g_array_index(rules, Rule, i);
+        char *text = g_strdup_printf("%s und %s sollen in %s\n", rule->student_a, rule->student_b,
+                                     rule->kind == RULE_SEPARATE ? "verschiedene Klassen" : "dieselbe Klasse");
+        gtk_text_buffer_insert(buffer, &iter, text, -1);
+        g_free(text);
+    }
+}
+
+// Reloads the lists, tab labels and statistics of the classes whose
+// students differ from `previous`, each student's class before a change
+static void refresh_changed_classes(SorterWindow *sorter_window, const int *previous) {
+    Assignment *assignment = &sorter_window->assignment;
+    int num_classes = sorter_window->num_classes;
+    
+    bool *changed = (bool*)calloc(num_classes, sizeof(bool));
+    for (int i = 0; i < assignment->num_students; i++) {
+        if (previous[i] != assignment->class_of[i]) {
+            changed[previous[i]] = true;
+            changed[assignment->class_of[i]] = true;
+        }
+    }
+    
+    int *offsets = NULL;
+    int *members = NULL;
+    assignment_rosters(assignment, &offsets, &members);
+    
+    for (int c = 0; c < num_classes; c++) {
+        if (!changed[c]) continue;
+        sorter_class_list_set(sorter_window->class_views[c].students, members + offsets[c], offsets[c + 1] - offsets[c]);
+        refresh_class_view(sorter_window, c);
+    }
+    
+    free(offsets);
+    free(members);
+    free(changed);
+}
+
+// Fits the newest rule into the displayed assignment and reloads only the
+// classes whose students changed. Returns false, changing nothing, if the
+// rule does not fit without redistributing.
+static bool apply_rule_to_tabs(SorterWindow *sorter_window) {
+    const Cohort *cohort = sorter_window->cohort;
+    Assignment *assignment = &sorter_window->assignment;
+    GArray *rules = sorter_window->rules;
+    
+    int *previous = (int*)malloc(assignment->num_students * sizeof(int));
+    memcpy(previous, assignment->class_of, assignment->num_students * sizeof(int));
+    if (!assignment_add_rule(cohort, (Rule*)rules->data, rules->len, assignment)) {
+        free(previous);
+        return false;
+    }
+    
+    refresh_changed_classes(sorter_window, previous);
+    sorter_window->total_cost = compute_total_cost(cohort, assignment);
+    refresh_cost_label(sorter_window);
+    free(previous);
+    return true;
+}
+
+// Rules name students by ID where the file has IDs, since names may repeat
+static char *student_rule_key(const Cohort *cohort, const Student *student) {
+    if (cohort->has_ids && !str_is_empty(student->id)) return str_dup(student->id);
+    size_t length = strlen(student->first_name) + strlen(student->last_name) + 2;
+    char *key = malloc(length);
+    snprintf(key, length, "%s %s", student->first_name, student->last_name);
+    return key;
+}
+
+// The rules a GUI session adds are kept next to the CSV ("<file>.rules"),
+// in the format of --rules, so that batch runs never touch them
+static char *saved_rules_path(const char *source_path) {
+    return g_strdup_printf("%s.rules", source_path);
+}
+
+static void add_rule_confirm_clicked(GtkButton *button, gpointer user_data) {
+    GtkWidget *dialog = user_data;
+    GtkWidget *combo_a = g_object_get_data(G_OBJECT(dialog), "combo_a");
+    GtkWidget *combo_b = g_object_get_data(G_OBJECT(dialog), "combo_b");
+    GtkWidget *kind_dropdown = g_object_get_data(G_OBJECT(dialog), "kind_dropdown");
+    SorterWindow *sorter_window = g_object_get_data(G_OBJECT(dialog), "sorter_window");
+    const Cohort *cohort = sorter_window->cohort;
+    GArray *rules = sorter_window->rules;
+    
+    // The lists hold the students in file order, so a position is a student index
+    guint a = gtk_drop_down_get_selected(GTK_DROP_DOWN(combo_a));
+    guint b = gtk_drop_down_get_selected(GTK_DROP_DOWN(combo_b));
+    if (a == GTK_INVALID_LIST_POSITION || b == GTK_INVALID_LIST_POSITION || a == b) {
+        show_error_dialog(GTK_WINDOW(dialog), "Bitte wählen Sie zwei verschiedene Schüler aus.");
+        return;
+    }
+    
+    Rule rule = {
+        student_rule_key(cohort, &cohort->students[a]),
+        student_rule_key(cohort, &cohort->students[b]),
+        gtk_drop_down_get_selected(GTK_DROP_DOWN(kind_dropdown)) == 1 ? RULE_SEPARATE : RULE_SAME_CLASS,
+    };
+    
+    // Refuse a rule that makes some separation impossible
+    int before = find_contradicting_rule(cohort, (Rule*)rules->data, rules->len, sorter_window->num_classes, NULL);
+    g_array_append_val(rules, rule);
+    int after = find_contradicting_rule(cohort, (Rule*)rules->data, rules->len, sorter_window->num_classes, NULL);
+    if (before == -1 && after != -1) {
+        g_array_set_size(rules, rules->len - 1);
+        free(rule.student_a);
+        free(rule.student_b);
+        show_error_dialog(GTK_WINDOW(dialog), "Diese Regel widerspricht den bestehenden Regeln: "
+                          "Schüler, die in verschiedene Klassen sollen, kämen in dieselbe Klasse.");
+        return;
+    }
+    
+    // Restore the rules next session
+    char *rules_path = saved_rules_path(cohort->source_path);
+    if (!save_rules(rules_path, (Rule*)rules->data, rules->len)) {
+        show_error_dialog(GTK_WINDOW(dialog), "Die Regeln konnten nicht gespeichert werden.");
+    }
+    g_free(rules_path);
+    update_rule_textview(GTK_TEXT_VIEW(sorter_window->rule_textview), rules);
+    if (!sorter_window->has_assignment || !apply_rule_to_tabs(sorter_window)) {
+        update_tabs(sorter_window);
+    }
+    gtk_window_destroy(GTK_WINDOW(dialog));
+}
+
+static void open_add_rule_dialog(SorterWindow *sorter_window) {
+    const Cohort *cohort = sorter_window->cohort;
+    GtkWidget *dialog = gtk_window_new();
+    gtk_window_set_title(GTK_WINDOW(dialog), "Regel hinzufügen");
+    gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
+    gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(sorter_window->window));
+    
+    GtkWidget *header = gtk_header_bar_new();
+    gtk_header_bar_set_show_title_buttons(GTK_HEADER_BAR(header), TRUE);
+    gtk_window_set_titlebar(GTK_WINDOW(dialog), header);
+    
+    GtkWidget *cancel_button = gtk_button_new_with_label("Abbrechen");
+    gtk_header_bar_pack_start(GTK_HEADER_BAR(header), cancel_button);
+    g_signal_connect_swapped(cancel_button, "clicked", G_CALLBACK(gtk_window_destroy), dialog);
+    
+    GtkWidget *add_button = gtk_button_new_with_label("Hinzufügen");
+    gtk_header_bar_pack_end(GTK_HEADER_BAR(header), add_button);
+    g_signal_connect(add_button, "clicked", G_CALLBACK(add_rule_confirm_clicked), dialog);
+    
+    GtkWidget *content_area = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_widget_set_margin_start(content_area, 5);
+    gtk_widget_set_margin_end(content_area, 5);
+    gtk_widget_set_margin_top(content_area, 5);
+    gtk_widget_set_margin_bottom(content_area, 5);
+    
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 5);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 5);
+    
+    // One entry per student in file order; IDs tell apart students with the same name
+    GtkStringList *names_a = gtk_string_list_new(NULL);
+    GtkStringList *names_b = gtk_string_list_new(NULL);
+    for (int i = 0; i < cohort->num_students; i++) {
+        Student *student = &cohort->students[i];
+        char *label = cohort->has_ids && !str_is_empty(student->id)
+            ? g_strdup_printf("%s %s (%s)", student->first_name, student->last_name, student->id)
+            : g_strdup_printf("%s %s", student->first_name, student->last_name);
+        gtk_string_list_append(names_a, label);
+        gtk_string_list_append(names_b, label);
+        g_free(label);
+    }
+    
+    // The drop-downs take over the lists and expressions
+    GtkWidget *label_a = gtk_label_new("Schüler A:");
+    GtkWidget *label_b = gtk_label_new("Schüler B:");
+    GtkWidget *combo_a = gtk_drop_down_new(G_LIST_MODEL(names_a),
+                                           gtk_property_expression_new(GTK_TYPE_STRING_OBJECT, NULL, "string"));
+    GtkWidget *combo_b = gtk_drop_down_new(G_LIST_MODEL(names_b),
+                                           gtk_property_expression_new(GTK_TYPE_STRING_OBJECT, NULL, "string"));
+    gtk_drop_down_set_enable_search(GTK_DROP_DOWN(combo_a), TRUE);
+    gtk_drop_down_set_enable_search(GTK_DROP_DOWN(combo_b), TRUE);
+    
+    const char *kinds[] = {"sollen in dieselbe Klasse", "sollen in verschiedene Klassen", NULL};
+    GtkWidget *kind_dropdown = gtk_drop_down_new_from_strings(kinds);
+    
+    gtk_grid_attach(GTK_GRID(grid), label_a, 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), combo_a, 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), label_b, 0, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), combo_b, 1, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), kind_dropdown, 1, 2, 1, 1);
+    
+    gtk_box_append(GTK_BOX(content_area), grid);
+    gtk_window_set_child(GTK_WINDOW(dialog), content_area);
+    
+    g_object_set_data(G_OBJECT(dialog), "combo_a", combo_a);
+    g_object_set_data(G_OBJECT(dialog), "combo_b", combo_b);
+    g_object_set_data(G_OBJECT(dialog), "kind_dropdown", kind_dropdown);
+    g_object_set_data(G_OBJECT(dialog), "sorter_window", sorter_window);
+    
+    gtk_widget_set_visible(dialog, TRUE);
+}
+
+// Brings a class's tab label and statistics entry up to date
+static void refresh_class_view(SorterWindow *sorter_window, int class_index) {
+    ClassView *view = &sorter_window->class_views[class_index];
+    
+    char *label = g_strdup_printf("Klasse %d (%d)", class_index + 1,
+                                  sorter_window->assignment.class_sizes[class_index]);
+    gtk_label_set_text(GTK_LABEL(view->tab_label), label);
+    g_free(label);
+    
+    char *stats = format_class_stats(sorter_window->cohort, &sorter_window->assignment, class_index);
+    char *text = g_strdup_printf("Klasse %d:\n%s", class_index + 1, stats);
+    gtk_label_set_text(GTK_LABEL(view->stats_label), text);
+    g_free(text);
+    free(stats);
+}
+
+static void refresh_cost_label(SorterWindow *sorter_window) {
+    char *text = sorter_window->total_cost <= sorter_window->cost_bound
+               ? g_strdup_printf("Gesamtkosten: %.0f (optimal)", sorter_window->total_cost)
+               : g_strdup_printf("Gesamtkosten: %.0f (untere Schranke %.0f)", sorter_window->total_cost,
+                                 sorter_window->cost_bound);
+    gtk_label_set_text(GTK_LABEL(sorter_window->cost_label), text);
+    g_free(text);
+}
+
+// Moves the selected student of a class tab to the class chosen next to the
+// button, along with everyone a same-class rule ties them to. Only the
+// affected lists, tab labels and statistics change.
+static void move_button_clicked(GtkButton *button, gpointer user_data) {
+    SorterWindow *sorter_window = user_data;
+    Assignment *assignment = &sorter_window->assignment;
+    GArray *rules = sorter_window->rules;
+    int from = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(button), "class_index"));
+    ClassView *source = &sorter_window->class_views[from];
+    
+    guint position = gtk_single_selection_get_selected(source->selection);
+    if (position == GTK_INVALID_LIST_POSITION) {
+        show_error_dialog(GTK_WINDOW(sorter_window->window), "Bitte wählen Sie einen Schüler aus.");
+        return;
+    }
+    
+    guint to = gtk_drop_down_get_selected(GTK_DROP_DOWN(source->target_dropdown));
+    if (to >= (guint)sorter_window->num_classes || (int)to == from) return;
+    
+    int student = sorter_class_list_student(source->students, position);
+    int *previous = (int*)malloc(assignment->num_students * sizeof(int));
+    memcpy(previous, assignment->class_of, assignment->num_students * sizeof(int));
+    double delta = 0.0;
+    if (!assignment_move_with_rules(sorter_window->cohort, (Rule*)rules->data, rules->len, assignment,
+                                    student, to, &delta)) {
+        char *message = g_strdup_printf("Verschieben nicht möglich: Laut den Regeln soll ein Schüler aus "
+                                        "Klasse %d in eine andere Klasse.", to + 1);
+        show_error_dialog(GTK_WINDOW(sorter_window->window), message);
+        g_free(message);
+        free(previous);
+        return;
+    }
+    sorter_window->total_cost += delta;
+    
+    // A student without same-class rules moves alone; a group reloads its classes
+    int moved = 0;
+    for (int i = 0; i < assignment->num_students; i++) {
+        if (previous[i] != assignment->class_of[i]) moved++;
+    }
+    if (moved == 1) {
+        sorter_class_list_remove(source->students, position);
+        sorter_class_list_append(sorter_window->class_views[to].students, student);
+        refresh_class_view(sorter_window, from);
+        refresh_class_view(sorter_window, to);
+    } else {
+        refresh_changed_classes(sorter_window, previous);
+    }
+    refresh_cost_label(sorter_window);
+    free(previous);
+}
+
+// Replaces all tabs with the window's current assignment
+static void rebuild_tabs(SorterWindow *sorter_window) {
+    GtkNotebook *notebook = GTK_NOTEBOOK(sorter_window->notebook);
+    Cohort *cohort = sorter_window->cohort;
+    Assignment *assignment = &sorter_window->assignment;
+    int num_classes = sorter_window->num_classes;
+    gint64 start = profile_start(cohort->profile);
+    
+    // Clear existing tabs
+    while (gtk_notebook_get_n_pages(notebook) > 0) {
+        gtk_notebook_remove_page(notebook, 0);
+    }
+    free(sorter_window->class_views);
+    
+    sorter_window->total_cost = compute_total_cost(cohort, assignment);
+    sorter_window->class_views = (ClassView*)calloc(num_classes, sizeof(ClassView));
+    
+    int *offsets = NULL;
+    int *members = NULL;
+    assignment_rosters(assignment, &offsets, &members);
+    
+    // Move targets, the same for every tab
+    char **class_names = (char**)calloc(num_classes + 1, sizeof(char*));
+    for (int i = 0; i < num_classes; i++) {
+        class_names[i] = g_strdup_printf("Klasse %d", i + 1);
+    }
+    
+    // Add tabs for each class, including empty ones so students can be moved there
+    for (int i = 0; i < num_classes; i++) {
+        ClassView *view = &sorter_window->class_views[i];
+        
+        GtkWidget *page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+        GtkWidget *scrolled_window = gtk_scrolled_window_new();
+        gtk_widget_set_vexpand(scrolled_window, TRUE);
+        view->students = sorter_class_list_new(cohort, members + offsets[i], offsets[i + 1] - offsets[i]);
+        view->selection = gtk_single_selection_new(G_LIST_MODEL(view->students));
+        gtk_single_selection_set_autoselect(view->selection, FALSE);
+        gtk_single_selection_set_can_unselect(view->selection, TRUE);
+        gtk_single_selection_set_selected(view->selection, GTK_INVALID_LIST_POSITION);
+        gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled_window),
+                                      create_class_column_view(cohort, view->selection));
+        gtk_box_append(GTK_BOX(page), scrolled_window);
+        
+        GtkWidget *move_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+        view->target_dropdown = gtk_drop_down_new_from_strings((const char * const *)class_names);
+        gtk_drop_down_set_selected(GTK_DROP_DOWN(view->target_dropdown), (i + 1) % num_classes);
+        GtkWidget *move_button = gtk_button_new_with_label("Verschieben");
+        g_object_set_data(G_OBJECT(move_button), "class_index", GINT_TO_POINTER(i));
+        g_signal_connect(move_button, "clicked", G_CALLBACK(move_button_clicked), sorter_window);
+        gtk_box_append(GTK_BOX(move_box), gtk_label_new("Ausgewählten Schüler verschieben nach:"));
+        gtk_box_append(GTK_BOX(move_box), view->target_dropdown);
+        gtk_box_append(GTK_BOX(move_box), move_button);
+        gtk_box_append(GTK_BOX(page), move_box);
+        
+        view->tab_label = gtk_label_new(NULL);
+        gtk_notebook_append_page(notebook, page, view->tab_label);
+    }
+    
+    for (int i = 0; i < num_classes; i++) {
+        g_free(class_names[i]);
+    }
+    free(class_names);
+    profile_stop(cohort->profile, PHASE_WIDGETS, start);
+        
+    // Add statistics tab, one label per class so a move only touches two
+    GtkWidget *stats_frame = gtk_frame_new("Klassenstatistiken");
+    GtkWidget *stats_scrolled = gtk_scrolled_window_new();
+    GtkWidget *stats_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
+    
+    sorter_window->cost_label = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(sorter_window->cost_label), 0.0);
+    gtk_box_append(GTK_BOX(stats_box), sorter_window->cost_label);
+    
+    start = profile_start(cohort->profile);
+    for (int i = 0; i < num_classes; i++) {
+        ClassView *view = &sorter_window->class_views[i];
+        view->stats_label = gtk_label_new(NULL);
+        gtk_label_set_xalign(GTK_LABEL(view->stats_label), 0.0);
+        gtk_label_set_selectable(GTK_LABEL(view->stats_label), TRUE);
+        gtk_box_append(GTK_BOX(stats_box), view->stats_label);
+        refresh_class_view(sorter_window, i);
+    }
+    refresh_cost_label(sorter_window);
+    profile_stop(cohort->profile, PHASE_STATS, start);
+    
+    // With SORTER_PROFILE set, the session's timings so far
+    if (cohort->profile != NULL) {
+        char *profile_text = profile_format(cohort->profile);
+        char *text = g_strdup_printf("Laufzeitprofil:\n%s", profile_text);
+        GtkWidget *profile_label = gtk_label_new(text);
+        gtk_label_set_xalign(GTK_LABEL(profile_label), 0.0);
+        gtk_label_set_selectable(GTK_LABEL(profile_label), TRUE);
+        gtk_box_append(GTK_BOX(stats_box), profile_label);
+        g_free(text);
+        free(profile_text);
+    }
+    
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(stats_scrolled), stats_box);
+    gtk_frame_set_child(GTK_FRAME(stats_frame), stats_scrolled);
+    gtk_widget_set_margin_top(stats_frame, 5);
+    gtk_widget_set_margin_bottom(stats_frame, 5);
+    gtk_notebook_append_page(notebook, stats_frame, gtk_label_new("Statistiken"));
+    
+    // Clean up
+    free(offsets);
+    free(members);
+    
+    gtk_widget_set_visible(GTK_WIDGET(notebook), TRUE);
+}
+
+// ===========================
+// Distribution Jobs
+// ===========================
+
+// One distribution running on a GTask worker thread. The worker only reads
+// the cohort and its own copy of the rule list; the window's rules cannot
+// change meanwhile because adding rules is disabled.
+struct DistributionJob {
+    const Cohort *cohort;
+    Rule *rules;                // Shallow copy, the names belong to the window
+    int num_rules;
+    int num_classes;
+    SolveOptions options;
+    Assignment assignment;      // The result
+    
+    GMutex lock;                // Guards the latest progress report
+    SolveProgress progress;
+    bool has_progress;
+};
+
+static void distribution_job_free(gpointer data) {
+    DistributionJob *job = data;
+    
+    if (job->assignment.class_of) assignment_free(&job->assignment);
+    free(job->rules);
+    g_object_unref(job->options.cancellable);
+    g_mutex_clear(&job->lock);
+    g_free(job);
+}
+
+// Called on the worker thread; the main loop picks the report up in
+// distribution_job_poll
+static void distribution_job_progress(const SolveProgress *progress, void *user_data) {
+    DistributionJob *job = user_data;
+    
+    g_mutex_lock(&job->lock);
+    job->progress = *progress;
+    job->has_progress = true;
+    g_mutex_unlock(&job->lock);
+}
+
+static void distribution_job_run(GTask *task, gpointer source_object, gpointer task_data,
+                                 GCancellable *cancellable) {
+    DistributionJob *job = task_data;
+    distribute_students(job->cohort, job->rules, job->num_rules, job->num_classes,
+                        &job->options, &job->assignment);
+    g_task_return_boolean(task, TRUE);
+}
+
+static gboolean distribution_job_poll(gpointer user_data) {
+    SorterWindow *sorter_window = user_data;
+    DistributionJob *job = sorter_window->job;
+    GtkProgressBar *bar = GTK_PROGRESS_BAR(sorter_window->progress_bar);
+    
+    g_mutex_lock(&job->lock);
+    SolveProgress progress = job->progress;
+    bool has_progress = job->has_progress;
+    g_mutex_unlock(&job->lock);
+    
+    if (g_cancellable_is_cancelled(job->options.cancellable)) {
+        gtk_progress_bar_set_text(bar, "Wird abgebrochen...");
+    } else if (has_progress && job->options.time_limit > 0) {
+        gtk_progress_bar_set_fraction(bar, fmin(progress.elapsed / job->options.time_limit, 1.0));
+        char *text = g_strdup_printf("Beste Kosten bisher: %.0f", progress.best_cost);
+        gtk_progress_bar_set_text(bar, text);
+        g_free(text);
+    } else {
+        gtk_progress_bar_pulse(bar);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// While a job runs the old tabs stay visible but cannot be edited
+static void set_distribution_running(SorterWindow *sorter_window, bool running) {
+    gtk_widget_set_visible(sorter_window->progress_box, running);
+    gtk_widget_set_sensitive(sorter_window->notebook, !running);
+    gtk_widget_set_sensitive(sorter_window->add_rule_button, !running);
+    gtk_widget_set_sensitive(sorter_window->redistribute_button, !running);
+    
+    if (running) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(sorter_window->progress_bar), 0.0);
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(sorter_window->progress_bar), "Verteile Schüler...");
+        sorter_window->progress_timer = g_timeout_add(100, distribution_job_poll, sorter_window);
+    } else if (sorter_window->progress_timer != 0) {
+        g_source_remove(sorter_window->progress_timer);
+        sorter_window->progress_timer = 0;
+    }
+}
+
+static void sorter_window_free(SorterWindow *sorter_window);
+
+// Swaps the finished assignment in and rebuilds all tabs at once
+static void distribution_job_done(GObject *source_object, GAsyncResult *result, gpointer user_data) {
+    SorterWindow *sorter_window = user_data;
+    DistributionJob *job = g_task_get_task_data(G_TASK(result));
+    g_task_propagate_boolean(G_TASK(result), NULL);
+    sorter_window->job = NULL;
+    
+    if (sorter_window->closed) {
+        sorter_window_free(sorter_window);
+        return;
+    }
+    set_distribution_running(sorter_window, false);
+    
+    if (!job->assignment.class_of || !job->assignment.class_sizes) {
+        show_error_dialog(GTK_WINDOW(sorter_window->window), "Fehler bei der Klasseneinteilung.");
+        return;
+    }
+    
+    if (sorter_window->has_assignment) assignment_free(&sorter_window->assignment);
+    sorter_window->assignment = job->assignment;
+    sorter_window->has_assignment = true;
+    memset(&job->assignment, 0, sizeof(job->assignment)); // Now owned by the window
+    
+    rebuild_tabs(sorter_window);
+}
+
+// Redistributes the students with the current rules on a worker thread;
+// the tabs are replaced once the result is ready
+static void update_tabs(SorterWindow *sorter_window) {
+    Cohort *cohort = sorter_window->cohort;
+    GArray *rules = sorter_window->rules;
+    
+    if (sorter_window->job != NULL) return;
+    if (cohort == NULL || cohort->num_students == 0) {
+        show_error_dialog(NULL, "Keine Schülerdaten verfügbar.");
+        return;
+    }
+    
+    DistributionJob *job = g_new0(DistributionJob, 1);
+    job->cohort = cohort;
+    job->num_rules = rules->len;
+    job->rules = (Rule*)malloc((rules->len + 1) * sizeof(Rule));
+    memcpy(job->rules, rules->data, rules->len * sizeof(Rule));
+    job->num_classes = sorter_window->num_classes;
+    solve_options_init(&job->options);
+    job->options.progress = distribution_job_progress;
+    job->options.progress_data = job;
+    job->options.cancellable = g_cancellable_new();
+    g_mutex_init(&job->lock);
+    
+    sorter_window->job = job;
+    set_distribution_running(sorter_window, true);
+    
+    // Cancelling only cuts the search short, so the task itself is never cancelled
+    GTask *task = g_task_new(NULL, NULL, distribution_job_done, sorter_window);
+    g_task_set_task_data(task, job, distribution_job_free);
+    g_task_run_in_thread(task, distribution_job_run);
+    g_object_unref(task);
+}
+
+static void cancel_button_clicked(GtkButton *button, gpointer user_data) {
+    SorterWindow *sorter_window = user_data;
+    if (sorter_window->job != NULL) g_cancellable_cancel(sorter_window->job->options.cancellable);
+}
+
+// ===========================
+// Main Sorter Window
+// ===========================
+
+static void add_rule_button_clicked(GtkButton *button, gpointer user_data) {
+    open_add_rule_dialog(user_data);
+}
+
+static void redistribute_button_clicked(GtkButton *button, gpointer user_data) {
+    update_tabs(user_data);
+}
+
+static void sorter_window_free(SorterWindow *sorter_window) {
+    if (sorter_window->has_assignment) assignment_free(&sorter_window->assignment);
+    free(sorter_window->class_views);
+    
+    for (guint i = 0; i < sorter_window->rules->len; i++) {
+        Rule *rule = &g_array_index(sorter_window->rules, Rule, i);
+        free(rule->student_a);
+        free(rule->student_b);
+    }
+    g_array_free(sorter_window->rules, TRUE);
+    
+    // The window owns the profile started when its cohort was loaded
+    Profile *profile = sorter_window->cohort->profile;
+    if (profile != NULL) {
+        profile_write(profile, g_getenv("SORTER_PROFILE"));
+        profile_free(profile);
+    }
+    
+    free_cohort(sorter_window->cohort);
+    g_free(sorter_window->cohort);
+    g_free(sorter_window);
+}
+
+// A running job still reads the cohort, so it frees the window state when it ends
+static void sorter_window_destroy(GtkWidget *widget, gpointer user_data) {
+    SorterWindow *sorter_window = user_data;
+    
+    if (sorter_window->job != NULL) {
+        set_distribution_running(sorter_window, false);
+        g_cancellable_cancel(sorter_window->job->options.cancellable);
+        sorter_window->closed = true;
+        return;
+    }
+    sorter_window_free(sorter_window);
+}
+
+// Takes ownership of the initial rules (saved by an earlier session)
+static GtkWidget *create_sorter_window(GtkApplication *app, Cohort *cohort, Rule *initial_rules, int num_initial_rules,
+                                       int num_classes) {
+    GtkWidget *window = gtk_application_window_new(app);
+    gtk_window_set_title(GTK_WINDOW(window), "Klasseneinteilung");
+    gtk_window_set_default_size(GTK_WINDOW(window), 800, 600);
+    
+    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_widget_set_margin_start(vbox, 5);
+    gtk_widget_set_margin_end(vbox, 5);
+    gtk_widget_set_margin_top(vbox, 5);
+    gtk_widget_set_margin_bottom(vbox, 5);
+    
+    // Create rules array
+    GArray *rules = g_array_new(FALSE, FALSE, sizeof(Rule));
+    if (num_initial_rules > 0) g_array_append_vals(rules, initial_rules, num_initial_rules);
+    free(initial_rules);
+    
+    // Create rule textview
+    GtkWidget *rule_textview = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(rule_textview), FALSE);
+    update_rule_textview(GTK_TEXT_VIEW(rule_textview), rules);
+    
+    // Create notebook for class tabs
+    GtkWidget *notebook = gtk_notebook_new();
+    gtk_widget_set_vexpand(notebook, TRUE);
+    
+    // Set data for callbacks
+    SorterWindow *sorter_window = g_new0(SorterWindow, 1);
+    sorter_window->window = window;
+    sorter_window->notebook = notebook;
+    sorter_window->rule_textview = rule_textview;
+    sorter_window->rules = rules;
+    sorter_window->cohort = cohort;
+    sorter_window->num_classes = num_classes;
+    sorter_window->cost_bound = compute_cost_lower_bound(cohort, num_classes);
+    g_signal_connect(window, "destroy", G_CALLBACK(sorter_window_destroy), sorter_window);
+    
+    // Create add rule button
+    GtkWidget *add_rule_button = gtk_button_new_with_label("Regel hinzufügen");
+    g_signal_connect(add_rule_button, "clicked", G_CALLBACK(add_rule_button_clicked), sorter_window);
+    
+    // Adding rules keeps the current classes; this starts over from scratch
+    GtkWidget *redistribute_button = gtk_button_new_with_label("Neu verteilen");
+    g_signal_connect(redistribute_button, "clicked", G_CALLBACK(redistribute_button_clicked), sorter_window);
+    
+    GtkWidget *button_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_append(GTK_BOX(button_box), add_rule_button);
+    gtk_box_append(GTK_BOX(button_box), redistribute_button);
+    gtk_box_append(GTK_BOX(vbox), button_box);
+    gtk_box_append(GTK_BOX(vbox), rule_textview);
+    
+    // Progress of a running distribution; cancelling keeps the best result so far
+    GtkWidget *progress_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget *progress_bar = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(progress_bar), TRUE);
+    gtk_widget_set_hexpand(progress_bar, TRUE);
+    GtkWidget *cancel_button = gtk_button_new_with_label("Abbrechen");
+    g_signal_connect(cancel_button, "clicked", G_CALLBACK(cancel_button_clicked), sorter_window);
+    gtk_box_append(GTK_BOX(progress_box), progress_bar);
+    gtk_box_append(GTK_BOX(progress_box), cancel_button);
+    gtk_widget_set_visible(progress_box, FALSE);
+    gtk_box_append(GTK_BOX(vbox), progress_box);
+    gtk_box_append(GTK_BOX(vbox), notebook);
+    
+    sorter_window->add_rule_button = add_rule_button;
+    sorter_window->redistribute_button = redistribute_button;
+    sorter_window->progress_box = progress_box;
+    sorter_window->progress_bar = progress_bar;
+    
+    gtk_window_set_child(GTK_WINDOW(window), vbox);
+    
+    // Update tabs with initial distribution
+    update_tabs(sorter_window);
+    
+    return window;
+}
+
+// ===========================
+// Browse Button Handler
+// ===========================
+
+static void file_chooser_response(GtkDialog *dialog, int response, gpointer user_data) {
+    if (response == GTK_RESPONSE_ACCEPT) {
+        GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
+        GtkWidget *entry = user_data;
+        
+        g_autoptr(GFile) file = gtk_file_chooser_get_file(chooser);
+        if (file) {
+            char *path = g_file_get_path(file);
+            if (path) {
+                // Convert Windows backslashes to forward slashes for consistency
+                for (char *p = path; *p; p++) {
+                    if (*p == '\\') *p = '/';
+                }
+                gtk_editable_set_text(GTK_EDITABLE(entry), path);
+                g_free(path);
+            }
+        }
+    }
+    gtk_window_destroy(GTK_WINDOW(dialog));
+}
+
+static void browse_button_clicked(GtkButton *button, gpointer user_data) {
+    GtkWidget *entry = user_data;
+    GtkWidget *window = gtk_widget_get_ancestor(GTK_WIDGET(button), GTK_TYPE_WINDOW);
+    
+    GtkWidget *dialog = gtk_file_chooser_dialog_new(
+        "Datei auswählen",
+        GTK_WINDOW(window),
+        GTK_FILE_CHOOSER_ACTION_OPEN,
+        "Abbrechen", GTK_RESPONSE_CANCEL,
+        "Öffnen", GTK_RESPONSE_ACCEPT,
+        NULL
+    );
+    
+    gtk_window_present(GTK_WINDOW(dialog));
+    g_signal_connect(dialog, "response", G_CALLBACK(file_chooser_response), entry);
+}
+
+// ===========================
+// Start Button Handler
+// ===========================
+
+static void start_button_clicked(GtkButton *button, gpointer user_data) {
+    GtkApplication *app = GTK_APPLICATION(g_object_get_data(G_OBJECT(button), "app"));
+    GtkWidget *file_path_entry = g_object_get_data(G_OBJECT(button), "file_path_entry");
+    GtkWidget *num_classes_entry = g_object_get_data(G_OBJECT(button), "num_classes_entry");
+    
+    const char *file_path = gtk_editable_get_text(GTK_EDITABLE(file_path_entry));
+    if (strlen(file_path) == 0) {
+        show_error_dialog(NULL, "Bitte wählen Sie eine Datei aus.");
+        return;
+    }
+    
+    const char *num_classes_text = gtk_editable_get_text(GTK_EDITABLE(num_classes_entry));
+    int num_classes = atoi(num_classes_text);
+    if (num_classes <= 0) {
+        show_error_dialog(NULL, "Bitte geben Sie eine gültige Anzahl von Klassen ein.");
+        return;
+    }
+    
+    // SORTER_COST_CONFIG names a file of weights and columns, as for --cost-config
+    CostModel cost;
+    cost_model_init(&cost);
+    const char *cost_config_path = g_getenv("SORTER_COST_CONFIG");
+    if (!str_is_empty(cost_config_path) && !load_cost_config(cost_config_path, &cost)) {
+        show_error_dialog(NULL, "Die Gewichtung aus SORTER_COST_CONFIG konnte nicht gelesen werden.");
+        return;
+    }
+    
+    // SORTER_PROFILE names the file the window's profile is written to when it closes
+    Profile *profile = !str_is_empty(g_getenv("SORTER_PROFILE")) ? profile_new() : NULL;
+    Cohort *cohort = g_new(Cohort, 1);
+    Rule *rules = NULL;
+    int num_rules = 0;
+    load_cohort(file_path, true, profile, &cost, cohort);
+    char *rules_path = saved_rules_path(file_path);
+    if (g_file_test(rules_path, G_FILE_TEST_EXISTS)) load_rules(rules_path, &rules, &num_rules);
+    g_free(rules_path);
+    
+    if (cohort->students && cohort->num_students > 0) {
+        GtkWidget *sorter_window = create_sorter_window(app, cohort, rules, num_rules, num_classes);
+        gtk_widget_set_visible(sorter_window, TRUE);
+    } else {
+        free_rules(rules, num_rules);
+        profile_free(profile);
+        free_cohort(cohort);
+        g_free(cohort);
+        show_error_dialog(NULL, "Fehler beim Laden der Schülerdaten.");
+    }
+}
+
+// ===========================
+// Start Screen
+// ===========================
+
+static void create_start_screen(GtkApplication *app) {
+    GtkWidget *window = gtk_application_window_new(app);
+    gtk_window_set_title(GTK_WINDOW(window), "Klasseneinteilung - Start");
+    gtk_window_set_default_size(GTK_WINDOW(window), 400, 200);
+    
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 5);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 5);
+    gtk_widget_set_margin_start(grid, 5);
+    gtk_widget_set_margin_end(grid, 5);
+    gtk_widget_set_margin_top(grid, 5);
+    gtk_widget_set_margin_bottom(grid, 5);
+    
+    GtkWidget *file_label = gtk_label_new("Schülerdatei:");
+    GtkWidget *file_path_entry = gtk_entry_new();
+    GtkWidget *browse_button = gtk_button_new_with_label("Durchsuchen...");
+    GtkWidget *num_classes_label = gtk_label_new("Anzahl Klassen:");
+    GtkWidget *num_classes_entry = gtk_entry_new();
+    GtkWidget *start_button = gtk_button_new_with_label("Start");
+    
+    gtk_grid_attach(GTK_GRID(grid), file_label, 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), file_path_entry, 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), browse_button, 2, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), num_classes_label, 0, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), num_classes_entry, 1, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), start_button, 1, 2, 1, 1);
+    
+    gtk_window_set_child(GTK_WINDOW(window), grid);
+    
+    // Set up the browse button
+    g_object_set_data(G_OBJECT(browse_button), "entry", file_path_entry);
+    g_signal_connect(browse_button, "clicked", G_CALLBACK(browse_button_clicked), file_path_entry);
+    
+    // Set up the start button
+    g_object_set_data(G_OBJECT(start_button), "app", app);
+    g_object_set_data(G_OBJECT(start_button), "file_path_entry", file_path_entry);
+    g_object_set_data(G_OBJECT(start_button), "num_classes_entry", num_classes_entry);
+    g_signal_connect(start_button, "clicked", G_CALLBACK(start_button_clicked), NULL);
+    
+    gtk_widget_set_visible(window, TRUE);
+}
+
+static void app_activate(GtkApplication *app, gpointer user_data) {
+    create_start_screen(app);
+}
+
+// ===========================
+// Command-Line Batch Mode
+// ===========================
+
+typedef struct {
+    const char *input_path;
+    const char *rules_path;
+    const char *output_path;
+    const char *trajectory_path;
+    const char *profile_path;
+    const char *cost_config_path;
+    const char *balance;    // "Column=W,...", applied after the configuration file
+    const char *weights;    // "W1,W2,W3", applied last
+    bool use_snapshot;
+    int num_classes;
+    int num_starts;         // Portfolio restarts; 0 runs a single distribution
+    int top_k;
+    double min_distance;
+    SolveOptions solve;
+} BatchOptions;
+
+static void free_rules(Rule *rules, int num_rules) {
+    for (int i = 0; i < num_rules; i++) {
+        free(rules[i].student_a);
+        free(rules[i].student_b);
+    }
+    free(rules);
+}
+
+static void append_rule(Rule **rules, int *num_rules, int *capacity, const char *a, const char *b, RuleKind kind) {
+    if (*num_rules >= *capacity) {
+        *capacity *= 2;
+        *rules = (Rule*)realloc(*rules, *capacity * sizeof(Rule));
+    }
+    (*rules)[*num_rules].student_a = str_dup(a);
+    (*rules)[*num_rules].student_b = str_dup(b);
+    (*rules)[*num_rules].kind = kind;
+    (*num_rules)++;
+}
+
+// "!A,B,C": every listed student in a different class, stored as one
+// separation rule per pair. Returns false if fewer than two are listed.
+static bool parse_separation_line(char *list, Rule **rules, int *num_rules, int *capacity) {
+    int max_names = 1;
+    for (const char *p = list; *p != '\0'; p++) {
+        if (*p == ',') max_names++;
+    }
+    char **names = (char**)malloc(max_names * sizeof(char*));
+    int num_names = 0;
+    for (char *name = list; name != NULL; ) {
+        char *comma = strchr(name, ',');
+        if (comma != NULL) *comma = '\0';
+        name = str_trim(name);
+        if (!str_is_empty(name)) names[num_names++] = name;
+        name = comma != NULL ? comma + 1 : NULL;
+    }
+    if (num_names < 2) {
+        free(names);
+        return false;
     }
     
-    // Distribute groups to classes
-    for (int g = 0; g < num_groups; g++) {
-        StudentGroup *group = &groups[g];
-        
-        // Find classes with minimum size
-        int min_size = INT_MAX;
-        int *candidate_indices = (int*)malloc(num_classes * sizeof(int));
-        int num_candidates = 0;
-        
-        for (int i = 0; i < num_classes; i++) {
-            if ((*class_sizes)[i] < min_size) {
-                min_size = (*class_sizes)[i];
-                num_candidates = 0;
-                candidate_indices[num_candidates++] = i;
-            } else if ((*class_sizes)[i] == min_size) {
-                candidate_indices[num_candidates++] = i;
+    for (int i = 0; i < num_names; i++) {
+        for (int j = i + 1; j < num_names; j++) {
+            if (!str_equal_case(names[i], names[j])) {
+                append_rule(rules, num_rules, capacity, names[i], names[j], RULE_SEPARATE);
             }
         }
+    }
+    free(names);
+    return true;
+}
+
+// Rules file: one rule per line, "Vorname Nachname,Vorname Nachname" (or
+// the students' IDs if the student file has an ID column) for students who
+// must share a class, or "!A,B[,C...]" for students who must all be in
+// different classes. Empty lines and lines starting with '#' are ignored.
+static void load_rules(const char *file_path, Rule **rules, int *num_rules) {
+    *rules = NULL;
+    *num_rules = 0;
+    
+    // Read whole, since a "!" line may list any number of students
+    char *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(file_path, &contents, &length, NULL)) {
+        fprintf(stderr, "Could not open rules file: %s\n", file_path);
+        return;
+    }
+    
+    int capacity = 16;
+    *rules = (Rule*)malloc(capacity * sizeof(Rule));
+    
+    int line_number = 0;
+    for (char *line = contents, *next; line != NULL; line = next) {
+        char *newline = strchr(line, '\n');
+        if (newline != NULL) *newline = '\0';
+        next = newline != NULL ? newline + 1 : NULL;
+        line_number++;
+        str_trim(line);
+        if (str_is_empty(line) || line[0] == '#') continue;
         
-        // Find best class based on cost
-        int best_index = candidate_indices[0];
-        double best_cost = compute_group_cost((*classes)[best_index], (*class_sizes)[best_index], 
-                                            group->students, group->size);
-        
-        for (int i = 1; i < num_candidates; i++) {
-            int idx = candidate_indices[i];
-            double cost = compute_group_cost((*classes)[idx], (*class_sizes)[idx], 
-                                          group->students, group->size);
-            
-            if (cost < best_cost) {
-                best_cost = cost;
-                best_index = idx;
+        if (line[0] == '!') {
+            if (!parse_separation_line(line + 1, rules, num_rules, &capacity)) {
+                fprintf(stderr, "Warning: Rule line %d names fewer than two students\n", line_number);
             }
+            continue;
         }
         
-        // Add group to best class
-        for (int i = 0; i < group->size; i++) {
-            (*classes)[best_index][(*class_sizes)[best_index]++] = group->students[i];
+        char *comma = strchr(line, ',');
+        if (comma == NULL) {
+            fprintf(stderr, "Warning: Rule line %d has no second student\n", line_number);
+            continue;
         }
-        
-        free(candidate_indices);
+        *comma = '\0';
+        char *name_a = str_trim(line);
+        char *name_b = str_trim(comma + 1);
+        if (str_is_empty(name_a) || str_is_empty(name_b) || str_equal_case(name_a, name_b)) {
+            fprintf(stderr, "Warning: Rule line %d is not a valid pair of students\n", line_number);
+            continue;
+        }
+        append_rule(rules, num_rules, &capacity, name_a, name_b, RULE_SAME_CLASS);
     }
     
-    // Free memory
-    union_find_free(&uf);
-    
-    for (int i = 0; i < name_to_index_size; i++) {
-        free(name_to_index_keys[i]);
+    g_free(contents);
+}
+
+// Writes rules in the format load_rules reads, one pair per line, through a
+// temporary file so that a crash never leaves half the rules behind
+static bool save_rules(const char *file_path, const Rule *rules, int num_rules) {
+    char *temp_path = g_strdup_printf("%s.tmp", file_path);
+    FILE *fp = fopen(temp_path, "w");
+    bool ok = fp != NULL;
+    if (ok) {
+        fprintf(fp, "# Regeln der Klasseneinteilung\n");
+        for (int i = 0; i < num_rules; i++) {
+            fprintf(fp, "%s%s,%s\n", rules[i].kind == RULE_SEPARATE ? "!" : "", rules[i].student_a,
+                    rules[i].student_b);
+        }
+        ok = !ferror(fp);
+        ok = fclose(fp) == 0 && ok;
+        
+        // rename() does not replace existing files on Windows
+        remove(file_path);
+        ok = ok && rename(temp_path, file_path) == 0;
+        if (!ok) remove(temp_path);
     }
-    free(name_to_index_keys);
-    free(name_to_index_values);
-    
-    for (int i = 0; i < num_groups; i++) {
-        free(groups[i].students);
+    if (!ok) fprintf(stderr, "Warning: Could not write rules file %s\n", file_path);
+    g_free(temp_path);
+    return ok;
+}
+
+// Quotes a field if it holds a comma, quote or line break
+static void write_csv_field(FILE *fp, const char *text) {
+    if (strpbrk(text, ",\"\r\n") == NULL) {
+        fputs(text, fp);
+        return;
     }
-    free(groups);
+    fputc('"', fp);
+    for (const char *p = text; *p != '\0'; p++) {
+        if (*p == '"') fputc('"', fp);
+        fputc(*p, fp);
+    }
+    fputc('"', fp);
 }
 
-static char *compute_stats(Student *class_students, int num_students) {
-    int count_m = 0;
-    int count_w = 0;
+static bool write_classes_csv(FILE *fp, const Cohort *cohort, const Assignment *assignment) {
+    int *offsets = NULL;
+    int *members = NULL;
+    assignment_rosters(assignment, &offsets, &members);
     
-    // Count elementary schools
-    char **grundschule_keys = (char**)malloc(num_students * sizeof(char*));
-    int *grundschule_counts = (int*)calloc(num_students, sizeof(int));
-    int grundschule_size = 0;
-    
-    // Count BG Gutachten
-    char **bg_keys = (char**)malloc(num_students * sizeof(char*));
-    int *bg_counts = (int*)calloc(num_students, sizeof(int));
-    int bg_size = 0;
+    // Declared columns follow the built-in ones
+    fprintf(fp, "Klasse,%sVorname,Nachname,m/w,Grundschule,BG Gutachten", cohort->has_ids ? "ID," : "");
+    for (int a = NUM_BUILTIN_ATTRIBUTES; a < cohort->num_attributes; a++) {
+        fputc(',', fp);
+        write_csv_field(fp, cohort->cost.names[a]);
+    }
+    fprintf(fp, "\n");
     
-    for (int i = 0; i < num_students; i++) {
-        // Gender count
-        if (class_students[i].gender != NULL) {
-            if (str_equal_ignore_case(class_students[i].gender, "m")) {
-                count_m++;
-            } else if (str_equal_ignore_case(class_students[i].gender, "w")) {
-                count_w++;
+    for (int i = 0; i < assignment->num_classes; i++) {
+        for (int j = offsets[i]; j < offsets[i + 1]; j++) {
+            int student = members[j];
+            Student *s = &cohort->students[student];
+            const char *fields[] = {
+                s->first_name, s->last_name,
+                cohort_student_value(cohort, ATTR_GENDER, student),
+                cohort_student_value(cohort, ATTR_GRUNDSCHULE, student),
+                cohort_student_value(cohort, ATTR_BG_GUTACHTEN, student)
+            };
+            
+            fprintf(fp, "%d,", i + 1);
+            if (cohort->has_ids) {
+                write_csv_field(fp, s->id != NULL ? s->id : "");
+                fputc(',', fp);
             }
-        }
-        
-        // Elementary school count
-        if (class_students[i].elementary_school != NULL) {
-        int gs_idx = -1;
-        for (int j = 0; j < grundschule_size; j++) {
-                if (str_equal_ignore_case(grundschule_keys[j], class_students[i].elementary_school)) {
-                gs_idx = j;
-                break;
+            for (int k = 0; k < 5; k++) {
+                if (k > 0) fputc(',', fp);
+                write_csv_field(fp, fields[k]);
+            }
+            for (int a = NUM_BUILTIN_ATTRIBUTES; a < cohort->num_attributes; a++) {
+                fputc(',', fp);
+                write_csv_field(fp, cohort_student_value(cohort, a, student));
             }
+            fprintf(fp, "\n");
         }
+    }
+    
+    free(offsets);
+    free(members);
+    return !ferror(fp);
+}
+
+static void print_batch_usage(FILE *fp, const char *program) {
+    fprintf(fp,
+            "Usage: %s --input STUDENTS.csv --classes N [--rules RULES.csv] [--out RESULT.csv]\n"
+            "          [--solver local|annealing|flow] [--iterations N] [--time-limit SECONDS]\n"
+            "          [--threads N] [--seed N] [--trajectory FILE.csv]\n"
+            "          [--portfolio N [--top K] [--min-distance FRACTION]] [--no-snapshot]\n"
+            "          [--profile FILE.json] [--weights W,W,W] [--cost-config FILE]\n"
+            "          [--balance COLUMN[=W],...]\n"
+            "\n"
+            "Distributes the students without starting the GUI. Each line of RULES.csv\n"
+            "names two students who must share a class, or, starting with '!', students\n"
+            "who must all be in different classes (\"!A,B,C\"). The class list is written\n"
+            "as CSV to --out (or stdout if omitted); with --out, the class statistics are\n"
+            "printed to stdout. If a separation cannot be kept, nothing is written and the\n"
+            "exit status is 1.\n"
+            "\n"
+            "--iterations and --time-limit bound the improvement phase after the initial\n"
+            "distribution (default: no iteration limit, 2 seconds; 0 means no limit).\n"
+            "Local search first sweeps all students, scoring each against every class at\n"
+            "once (with AVX2 or SSE2 where the CPU has them; SORTER_NO_SIMD=1 forces the\n"
+            "portable code) and moving or swapping it towards the best one. --iterations\n"
+            "counts the random moves and swaps tried after that.\n"
+            "--solver annealing runs simulated annealing on --threads chains (default: one\n"
+            "per core) and writes elapsed,iterations,temperature,mean_cost,best_cost rows\n"
+            "to --trajectory after every epoch (local search: every 20000 moves, with\n"
+            "temperature 0). --seed makes runs repeatable.\n"
+            "\n"
+            "--solver flow is for cohorts without rules: it starts from a balanced flow\n"
+            "that spreads every Grundschule and every combination of Grundschule, gender\n"
+            "and BG Gutachten as evenly as possible, then runs local search on it. With\n"
+            "rules it falls back to local search. Whatever the solver, the printed lower\n"
+            "bound limits how much better any distribution could be; a result that\n"
+            "reaches it is optimal.\n"
+            "\n"
+            "Every pair of classmates sharing a Grundschule, gender or BG Gutachten adds\n"
+            "that column's weight to the cost: by default 3, 2 and 1. --weights sets all\n"
+            "three in that order; 0 leaves a column out. --cost-config reads them from a\n"
+            "file of \"Grundschule = 3\" lines naming the columns as in STUDENTS.csv, with\n"
+            "unlisted columns keeping their default and --weights taking precedence. The\n"
+            "SORTER_COST_CONFIG environment variable names such a file for batch runs\n"
+            "and the GUI.\n"
+            "\n"
+            "Any other column of STUDENTS.csv can be balanced too, by naming it in the\n"
+            "configuration file or with --balance, e.g. --balance \"Sprache=2,Religion\"\n"
+            "(weight 1 if left out). Such columns are matched in any case, shown in the\n"
+            "statistics and copied to RESULT.csv; students without a value in them are\n"
+            "not counted.\n"
+            "\n"
+            "--portfolio runs N seeded restarts in parallel and keeps the K best (default 3)\n"
+            "that place at least FRACTION (default 0.1) of the students differently from\n"
+            "each other. They are written to RESULT-1.csv .. RESULT-K.csv. Each restart\n"
+            "runs one chain for exactly --iterations moves, which portfolio runs require,\n"
+            "without a time limit. The seed of each is printed with the options that\n"
+            "repeat it in a single run. --trajectory is not available with --portfolio.\n"
+            "\n"
+            "After parsing STUDENTS.csv, a binary snapshot is kept in STUDENTS.csv.snap and\n"
+            "used instead of the CSV while the CSV is unchanged. --no-snapshot neither\n"
+            "reads nor writes it. Rules added in the window are saved in STUDENTS.csv.rules,\n"
+            "which can be passed to --rules.\n"
+            "\n"
+            "--profile writes the time spent in each phase (loading, name index, rule\n"
+            "resolution, grouping, placement, improvement, statistics) and counters such\n"
+            "as cost evaluations as JSON to FILE.json, or to stderr for \"-\". The\n"
+            "SORTER_PROFILE environment variable does the same for batch runs and, when\n"
+            "the window closes, for the GUI, which also shows the profile in its\n"
+            "statistics tab.\n"
+            "\n"
+            "To distribute several schools at once, see %s --manifest --help.\n",
+            program, program);
+}
+
+static const char *solver_name(SolverMode mode) {
+    switch (mode) {
+        case SOLVER_ANNEALING: return "annealing";
+        case SOLVER_FLOW: return "flow";
+        default: return "local";
+    }
+}
+
+static bool parse_solver_name(const char *value, SolverMode *mode) {
+    if (str_equal_case(value, "local")) *mode = SOLVER_LOCAL_SEARCH;
+    else if (str_equal_case(value, "annealing")) *mode = SOLVER_ANNEALING;
+    else if (str_equal_case(value, "flow")) *mode = SOLVER_FLOW;
+    else {
+        fprintf(stderr, "Unknown solver: %s\n", value);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_batch_options(int argc, char *argv[], BatchOptions *options) {
+    memset(options, 0, sizeof(*options));
+    solve_options_init(&options->solve);
+    options->top_k = 3;
+    options->min_distance = 0.1;
+    options->use_snapshot = true;
+    options->profile_path = g_getenv("SORTER_PROFILE");
+    if (str_is_empty(options->profile_path)) options->profile_path = NULL;
+    options->cost_config_path = g_getenv("SORTER_COST_CONFIG");
+    if (str_is_empty(options->cost_config_path)) options->cost_config_path = NULL;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
         
-        if (gs_idx == -1) {
-                grundschule_keys[grundschule_size] = str_dup(class_students[i].elementary_school);
-            gs_idx = grundschule_size;
-            grundschule_size++;
+        if (str_equal_case(arg, "--help") || str_equal_case(arg, "-h")) {
+            return false;
         }
-        
-        grundschule_counts[gs_idx]++;
+        if (str_equal_case(arg, "--no-snapshot")) {
+            options->use_snapshot = false;
+            continue;
         }
-        
-        // BG Gutachten count
-        if (class_students[i].bg_gutachten != NULL) {
-        int bg_idx = -1;
-        for (int j = 0; j < bg_size; j++) {
-                if (str_equal_ignore_case(bg_keys[j], class_students[i].bg_gutachten)) {
-                bg_idx = j;
-                break;
-            }
+        if (value == NULL) {
+            fprintf(stderr, "Missing value for option %s\n", arg);
+            return false;
         }
         
-        if (bg_idx == -1) {
-                bg_keys[bg_size] = str_dup(class_students[i].bg_gutachten);
-            bg_idx = bg_size;
-            bg_size++;
+        if (str_equal_case(arg, "--input")) options->input_path = value;
+        else if (str_equal_case(arg, "--rules")) options->rules_path = value;
+        else if (str_equal_case(arg, "--out")) options->output_path = value;
+        else if (str_equal_case(arg, "--classes")) options->num_classes = atoi(value);
+        else if (str_equal_case(arg, "--iterations")) options->solve.max_iterations = atol(value);
+        else if (str_equal_case(arg, "--time-limit")) options->solve.time_limit = atof(value);
+        else if (str_equal_case(arg, "--threads")) options->solve.num_threads = atoi(value);
+        else if (str_equal_case(arg, "--seed")) options->solve.seed = strtoull(value, NULL, 10);
+        else if (str_equal_case(arg, "--trajectory")) options->trajectory_path = value;
+        else if (str_equal_case(arg, "--profile")) options->profile_path = value;
+        else if (str_equal_case(arg, "--cost-config")) options->cost_config_path = value;
+        else if (str_equal_case(arg, "--weights")) options->weights = value;
+        else if (str_equal_case(arg, "--balance")) options->balance = value;
+        else if (str_equal_case(arg, "--portfolio")) options->num_starts = atoi(value);
+        else if (str_equal_case(arg, "--top")) options->top_k = atoi(value);
+        else if (str_equal_case(arg, "--min-distance")) options->min_distance = atof(value);
+        else if (str_equal_case(arg, "--solver")) {
+            if (!parse_solver_name(value, &options->solve.mode)) return false;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return false;
+        }
+        i++;
+    }
+    
+    if (options->input_path == NULL) {
+        fprintf(stderr, "Missing --input\n");
+        return false;
+    }
+    if (options->num_classes <= 0) {
+        fprintf(stderr, "Missing or invalid --classes\n");
+        return false;
+    }
+    if (options->num_starts > 0 && options->top_k <= 0) {
+        fprintf(stderr, "Invalid --top\n");
+        return false;
+    }
+    if (options->num_starts > 0 && options->solve.max_iterations <= 0) {
+        fprintf(stderr, "--portfolio needs --iterations, so that each variant can be repeated from its seed\n");
+        return false;
+    }
+    if (options->num_starts > 0 && options->trajectory_path != NULL) {
+        fprintf(stderr, "--trajectory cannot be combined with --portfolio\n");
+        return false;
+    }
+    return true;
+}
+
+static void write_trajectory_row(const SolveProgress *progress, void *user_data) {
+    FILE *fp = user_data;
+    fprintf(fp, "%.3f,%ld,%.6g,%.1f,%.0f\n", progress->elapsed, progress->iterations,
+            progress->temperature, progress->current_cost, progress->best_cost);
+}
+
+// Writes the class list to path (stdout for NULL or "-"), and if it went to
+// a file, the total cost and class statistics to stdout
+static int write_batch_result(const char *path, const Cohort *cohort, const Assignment *assignment) {
+    bool to_stdout = path == NULL || str_equal_case(path, "-");
+    FILE *out = to_stdout ? stdout : fopen(path, "w");
+    int status = 0;
+    if (out == NULL) {
+        fprintf(stderr, "Could not open output file: %s\n", path);
+        status = 1;
+    } else {
+        if (!write_classes_csv(out, cohort, assignment)) {
+            fprintf(stderr, "Error writing class list\n");
+            status = 1;
         }
+        if (!to_stdout) fclose(out);
+    }
+    
+    // Statistics go to stdout unless it already carries the class list
+    if (!to_stdout) {
+        double cost = compute_total_cost(cohort, assignment);
+        double bound = compute_cost_lower_bound(cohort, assignment->num_classes);
+        printf("Gesamtkosten: %.0f\n", cost);
+        printf("Untere Schranke: %.0f%s\n\n", bound, cost <= bound ? " (optimal)" : "");
         
-        bg_counts[bg_idx]++;
+        char **stats = compute_class_stats(cohort, assignment);
+        for (int i = 0; i < assignment->num_classes; i++) {
+            if (stats[i] == NULL) continue;
+            printf("Klasse %d (%d Schüler):\n%s\n", i + 1, assignment->class_sizes[i], stats[i]);
         }
+        free_class_stats(stats, assignment->num_classes);
     }
     
-    // Build stats string
-    int buffer_size = 4096; // Initial size
-    char *stats = (char*)malloc(buffer_size);
-    int pos = 0;
+    return status;
+}
+
+// "result.csv" -> "result-2.csv"
+static char *numbered_output_path(const char *path, int number) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if (dot == NULL || (slash != NULL && dot < slash)) dot = path + strlen(path);
+    
+    size_t length = strlen(path) + 16;
+    char *result = malloc(length);
+    snprintf(result, length, "%.*s-%d%s", (int)(dot - path), path, number, dot);
+    return result;
+}
+
+static int run_batch_portfolio(const BatchOptions *options, const Cohort *cohort, Rule *rules, int num_rules) {
+    PortfolioEntry *entries = NULL;
+    int num_entries = 0;
+    run_portfolio(cohort, rules, num_rules, options->num_classes, &options->solve,
+                  options->num_starts, options->top_k, options->min_distance, &entries, &num_entries);
     
-    pos += snprintf(stats + pos, buffer_size - pos, 
-                   "Gender distribution: m = %d, w = %d\n\n", count_m, count_w);
+    bool to_stdout = options->output_path == NULL || str_equal_case(options->output_path, "-");
+    FILE *summary = to_stdout ? stderr : stdout;
+    int status = 0;
     
-    pos += snprintf(stats + pos, buffer_size - pos, "Grundschule distribution:\n");
-    for (int i = 0; i < grundschule_size; i++) {
-        pos += snprintf(stats + pos, buffer_size - pos, 
-                       "  %s: %d\n", grundschule_keys[i], grundschule_counts[i]);
+    // Each variant ran as one chain on its iteration budget alone
+    fprintf(summary, "Rang,Seed,Gesamtkosten,Abstand zur besten,Wiederholen mit\n");
+    for (int i = 0; i < num_entries; i++) {
+        fprintf(summary, "%d,%llu,%.0f,%.3f,--solver %s --seed %llu --threads 1 --iterations %ld --time-limit 0\n",
+                i + 1, (unsigned long long)entries[i].seed, entries[i].cost, entries[i].distance,
+                solver_name(options->solve.mode), (unsigned long long)entries[i].seed,
+                options->solve.max_iterations);
     }
+    fprintf(summary, "\n");
     
-    pos += snprintf(stats + pos, buffer_size - pos, "\nBG Gutachten distribution:\n");
-    for (int i = 0; i < bg_size; i++) {
-        pos += snprintf(stats + pos, buffer_size - pos, 
-                       "  %s: %d\n", bg_keys[i], bg_counts[i]);
+    // Only the best variant fits on stdout. A variant that breaks a separation
+    // rule is reported instead of written.
+    int num_written = to_stdout ? 1 : num_entries;
+    for (int i = 0; i < num_written; i++) {
+        int broken = count_broken_separations(cohort, rules, num_rules, &entries[i].assignment);
+        if (broken > 0) {
+            fprintf(stderr, "Error: Variant %d breaks %d separation rules\n", i + 1, broken);
+            status = 1;
+        } else if (to_stdout) {
+            status = write_batch_result(NULL, cohort, &entries[i].assignment);
+        } else {
+            char *path = numbered_output_path(options->output_path, i + 1);
+            printf("Variante %d (%s):\n", i + 1, path);
+            if (write_batch_result(path, cohort, &entries[i].assignment) != 0) status = 1;
+            free(path);
+        }
     }
     
-    // Free memory
-    for (int i = 0; i < grundschule_size; i++) {
-        free(grundschule_keys[i]);
+    free_portfolio(entries, num_entries);
+    return status;
+}
+
+static bool has_option(int argc, char *argv[], const char *name) {
+    for (int i = 1; i < argc; i++) {
+        if (str_equal_case(argv[i], name)) return true;
     }
-    free(grundschule_keys);
-    free(grundschule_counts);
+    return false;
+}
+
+static bool is_batch_invocation(int argc, char *argv[]) {
+    return has_option(argc, argv, "--input") || has_option(argc, argv, "--generate") ||
+           has_option(argc, argv, "--benchmark") || has_option(argc, argv, "--manifest");
+}
+
+static int run_batch_mode(int argc, char *argv[]) {
+    if (has_option(argc, argv, "--manifest")) return run_manifest_mode(argc, argv);
+    if (has_option(argc, argv, "--benchmark")) return run_benchmark_mode(argc, argv);
+    if (has_option(argc, argv, "--generate")) return run_generate_mode(argc, argv);
     
-    for (int i = 0; i < bg_size; i++) {
-        free(bg_keys[i]);
+    BatchOptions options;
+    if (!parse_batch_options(argc, argv, &options)) {
+        print_batch_usage(stderr, argv[0]);
+        return 2;
     }
-    free(bg_keys);
-    free(bg_counts);
     
-    return stats;
+    CostModel cost;
+    cost_model_init(&cost);
+    if (options.cost_config_path != NULL && !load_cost_config(options.cost_config_path, &cost)) return 1;
+    if (options.balance != NULL && !parse_balanced_columns(options.balance, &cost)) return 2;
+    if (options.weights != NULL && !parse_cost_weights(options.weights, &cost)) return 2;
+    
+    Profile *profile = options.profile_path != NULL ? profile_new() : NULL;
+    Cohort cohort;
+    Rule *rules = NULL;
+    int num_rules = 0;
+    load_cohort(options.input_path, options.use_snapshot, profile, &cost, &cohort);
+    if (options.cost_config_path != NULL || options.balance != NULL || options.weights != NULL) {
+        fprintf(stderr, "Cost weights:");
+        for (int a = 0; a < cohort.cost.num_attributes; a++) {
+            fprintf(stderr, "%s %s %g", a > 0 ? "," : "", cohort.cost.names[a], cohort.cost.weights[a]);
+        }
+        fprintf(stderr, " (%s kernel, %s)\n", cohort.cost.kernel, cohort.cost.instruction_set);
+    }
+    if (cohort.students == NULL || cohort.num_students == 0) {
+        fprintf(stderr, "Error: No students loaded from %s\n", options.input_path);
+        free_cohort(&cohort);
+        profile_free(profile);
+        return 1;
+    }
+    
+    if (options.rules_path != NULL) {
+        load_rules(options.rules_path, &rules, &num_rules);
+        if (rules == NULL) {
+            free_cohort(&cohort);
+            profile_free(profile);
+            return 1;
+        }
+        
+        int num_apart = 0;
+        int contradicting = find_contradicting_rule(&cohort, rules, num_rules, options.num_classes, &num_apart);
+        if (contradicting != -1) {
+            fprintf(stderr, "Error: %s and %s cannot be separated: ", rules[contradicting].student_a,
+                    rules[contradicting].student_b);
+            if (options.num_classes < 2) {
+                fprintf(stderr, "there is only one class\n");
+            } else if (num_apart > 0) {
+                fprintf(stderr, "they are among %d groups that must all be in different classes, "
+                                "but there are only %d classes\n", num_apart, options.num_classes);
+            } else {
+                fprintf(stderr, "same-class rules join them\n");
+            }
+            free_rules(rules, num_rules);
+            free_cohort(&cohort);
+            profile_free(profile);
+            return 1;
+        }
+        if (num_rules > 0 && options.solve.mode == SOLVER_FLOW) {
+            fprintf(stderr, "Note: --solver flow only handles cohorts without rules; using local search\n");
+        }
+    }
+    
+    FILE *trajectory = NULL;
+    if (options.trajectory_path != NULL) {
+        trajectory = fopen(options.trajectory_path, "w");
+        if (trajectory == NULL) {
+            fprintf(stderr, "Could not open trajectory file: %s\n", options.trajectory_path);
+        } else {
+            fprintf(trajectory, "elapsed,iterations,temperature,mean_cost,best_cost\n");
+            options.solve.progress = write_trajectory_row;
+            options.solve.progress_data = trajectory;
+        }
+    }
+    
+    int status;
+    if (options.num_starts > 0) {
+        status = run_batch_portfolio(&options, &cohort, rules, num_rules);
+    } else {
+        Assignment assignment;
+        distribute_students(&cohort, rules, num_rules, options.num_classes, &options.solve, &assignment);
+        int broken = count_broken_separations(&cohort, rules, num_rules, &assignment);
+        if (broken > 0) {
+            fprintf(stderr, "Error: %d separation rules could not be satisfied\n", broken);
+            status = 1;
+        } else {
+            status = write_batch_result(options.output_path, &cohort, &assignment);
+        }
+        assignment_free(&assignment);
+    }
+    if (trajectory != NULL) fclose(trajectory);
+    if (profile != NULL && !profile_write(profile, options.profile_path)) status = 1;
+    
+    free_rules(rules, num_rules);
+    free_cohort(&cohort);
+    profile_free(profile);
+    
+    return status;
 }
 
 // ===========================
-// GUI Components
+// Synthetic Cohorts
 // ===========================
 
-static void show_error_dialog(GtkWindow *parent, const char *message) {
-    GtkAlertDialog *dialog = gtk_alert_dialog_new("%s", message);
-    gtk_alert_dialog_set_modal(dialog, TRUE);
-    gtk_alert_dialog_show(dialog, parent);
-    g_object_unref(dialog);
+// Shape of a generated student file. School sizes follow a Zipf
+// distribution: the k-th school gets a share proportional to 1 / k^skew.
+typedef struct {
+    int num_students;
+    int num_schools;            // 0 picks one school per 25 students
+    double school_skew;
+    double male_share;
+    int num_bg_values;          // BG Gutachten categories (besides none)
+    double rule_density;        // Share of students in a same-class group
+    int max_group_size;
+    uint64_t seed;
+} GeneratorOptions;
+
+static const char *const generator_first_names_m[] = {
+    "Ben", "Paul", "Leon", "Finn", "Elias", "Jonas", "Luis", "Noah", "Felix", "Lukas",
+    "Emil", "Henry", "Anton", "Theo", "Jakob", "Moritz", "Karl", "Oskar", "Mats", "Jan"
+};
+static const char *const generator_first_names_w[] = {
+    "Emma", "Mia", "Hannah", "Emilia", "Sofia", "Lina", "Anna", "Marie", "Lea", "Clara",
+    "Ida", "Lena", "Greta", "Frieda", "Mila", "Ella", "Luisa", "Johanna", "Paula", "Nele"
+};
+static const char *const generator_last_names[] = {
+    "Müller", "Schmidt", "Schneider", "Fischer", "Weber", "Meyer", "Wagner", "Becker",
+    "Schulz", "Hoffmann", "Schäfer", "Koch", "Bauer", "Richter", "Klein", "Wolf",
+    "Schröder", "Neumann", "Schwarz", "Zimmermann", "Braun", "Krüger", "Hofmann", "Hartmann",
+    "Lange", "Schmitt", "Werner", "Krause", "Meier", "Lehmann", "Özdemir", "Nowak"
+};
+static const char *const generator_school_names[] = {
+    "Am Park", "Lindenschule", "Nord", "Süd", "Am Markt", "Waldschule", "Sonnenschule",
+    "Brüder Grimm", "Astrid Lindgren", "Am Rosenhügel", "Erich Kästner", "Ährenfeld",
+    "Regenbogen", "An der Mühle", "Pestalozzi", "Kastanienhof"
+};
+static const char *const generator_bg_values[] = {
+    "nein", "ja", "Förderbedarf Lernen", "Förderbedarf Sprache", "Förderbedarf emotional-sozial"
+};
+
+#define GENERATOR_NAME_COUNT(names) ((int)(sizeof(names) / sizeof((names)[0])))
+
+static void generator_options_init(GeneratorOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->num_students = 1000;
+    options->school_skew = 1.0;
+    options->male_share = 0.5;
+    options->num_bg_values = 2;
+    options->rule_density = 0.1;
+    options->max_group_size = 3;
+    options->seed = 1;
+}
+
+// Cumulative Zipf weights of n categories, normalised to end at 1
+static double *zipf_cumulative(int n, double skew) {
+    double *cumulative = (double*)malloc(n * sizeof(double));
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, skew);
+        cumulative[i] = sum;
+    }
+    for (int i = 0; i < n; i++) {
+        cumulative[i] /= sum;
+    }
+    return cumulative;
 }
 
-static GtkWidget *create_student_treeview(Student *students, int num_students) {
-    if (!students || num_students <= 0) {
-        return NULL;
+static int zipf_pick(const double *cumulative, int n, Rng *rng) {
+    double u = rng_uniform(rng);
+    int low = 0;
+    int high = n - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (cumulative[mid] < u) low = mid + 1;
+        else high = mid;
     }
+    return low;
+}
+
+// Writes a student file with an ID column and, if rules_path is not NULL,
+// rules that join random students into groups of 2..max_group_size by ID.
+// Names repeat like real ones do, which is why the rules use the IDs.
+static bool generate_cohort_files(const GeneratorOptions *options, const char *students_path,
+                                  const char *rules_path) {
+    int num_students = options->num_students;
+    int num_schools = options->num_schools > 0 ? options->num_schools : num_students / 25 + 1;
+    int num_bg_values = options->num_bg_values > 0 ? options->num_bg_values : 1;
     
-    GtkWidget *scrolled_window = gtk_scrolled_window_new();
-    gtk_widget_set_vexpand(scrolled_window, TRUE);
+    FILE *fp = fopen(students_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not create student file: %s\n", students_path);
+        return false;
+    }
     
-    GtkListStore *store = gtk_list_store_new(5, 
-        G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, 
-        G_TYPE_STRING, G_TYPE_STRING);
+    Rng rng;
+    rng_seed(&rng, options->seed);
+    double *school_weights = zipf_cumulative(num_schools, options->school_skew);
+    double *bg_weights = zipf_cumulative(num_bg_values, 1.0);
+    int num_school_names = GENERATOR_NAME_COUNT(generator_school_names);
     
-        GtkTreeIter iter;
+    fprintf(fp, "ID,Vorname,Nachname,m/w,Grundschule,BG Gutachten\n");
     for (int i = 0; i < num_students; i++) {
-        Student *student = &students[i];
-        if (!student) continue;
+        bool male = rng_uniform(&rng) < options->male_share;
+        const char *first_name = male
+            ? generator_first_names_m[rng_index(&rng, GENERATOR_NAME_COUNT(generator_first_names_m))]
+            : generator_first_names_w[rng_index(&rng, GENERATOR_NAME_COUNT(generator_first_names_w))];
+        const char *last_name = generator_last_names[rng_index(&rng, GENERATOR_NAME_COUNT(generator_last_names))];
+        
+        // Spelling varies between sources: some entries are upper case
+        const char *gender = male ? "m" : "w";
+        if (rng_index(&rng, 20) == 0) gender = male ? "M" : "W";
+        
+        fprintf(fp, "S%d,%s,%s,%s,", i + 1, first_name, last_name, gender);
+        
+        // A few students come from elsewhere and have no Grundschule entry
+        if (rng_index(&rng, 50) != 0) {
+            int school = zipf_pick(school_weights, num_schools, &rng);
+            fprintf(fp, "Grundschule %s", generator_school_names[school % num_school_names]);
+            if (school >= num_school_names) fprintf(fp, " %d", school / num_school_names + 1);
+        }
+        fputc(',', fp);
         
-        gtk_list_store_append(store, &iter);
-        gtk_list_store_set(store, &iter,
-            0, student->first_name ? student->first_name : "",
-            1, student->last_name ? student->last_name : "",
-            2, student->gender ? student->gender : "",
-            3, student->elementary_school ? student->elementary_school : "",
-            4, student->bg_gutachten ? student->bg_gutachten : "",
-                         -1);
+        if (rng_index(&rng, 5) != 0) {
+            int value = zipf_pick(bg_weights, num_bg_values, &rng);
+            if (value < GENERATOR_NAME_COUNT(generator_bg_values)) fputs(generator_bg_values[value], fp);
+            else fprintf(fp, "Kategorie %d", value + 1);
+        }
+        fputc('\n', fp);
     }
     
-    GtkWidget *treeview = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
-    g_object_unref(store);
+    free(school_weights);
+    free(bg_weights);
+    bool ok = fclose(fp) == 0;
+    if (!ok || rules_path == NULL) return ok;
     
-    const char *columns[] = {"Vorname", "Nachname", "Geschlecht", "Grundschule", "BG-Gutachten"};
-    for (int i = 0; i < 5; i++) {
-        GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
-        GtkTreeViewColumn *column = gtk_tree_view_column_new();
-        gtk_tree_view_column_set_title(column, columns[i]);
-        gtk_tree_view_column_pack_start(column, renderer, TRUE);
-        gtk_tree_view_column_add_attribute(column, renderer, "text", i);
-        gtk_tree_view_append_column(GTK_TREE_VIEW(treeview), column);
+    fp = fopen(rules_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not create rules file: %s\n", rules_path);
+        return false;
     }
     
-    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled_window), treeview);
-    return scrolled_window;
-}
-
-static void update_rule_textview(GtkTextView *textview, GArray *rules) {
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(textview);
-    gtk_text_buffer_set_text(buffer, "", -1);
-    
-    GtkTextIter iter;
-    gtk_text_buffer_get_start_iter(buffer, &iter);
+    int *order = (int*)malloc(num_students * sizeof(int));
+    for (int i = 0; i < num_students; i++) {
+        order[i] = i;
+    }
+    shuffle_students(order, num_students, &rng);
     
-    for (guint i = 0; i < rules->len; i++) {
-        Rule *rule = &g_array_index(rules, Rule, i);
-        char *text = g_strdup_printf("%s und %s sollen in dieselbe Klasse\n", rule->student_a, rule->student_b);
-        gtk_text_buffer_insert(buffer, &iter, text, -1);
-        g_free(text);
+    // Chain each group's members with one rule per neighbouring pair
+    int max_group_size = options->max_group_size >= 2 ? options->max_group_size : 2;
+    int target = (int)(options->rule_density * num_students);
+    for (int start = 0; start + 1 < num_students && start < target; ) {
+        int size = 2 + rng_index(&rng, max_group_size - 1);
+        if (start + size > num_students) size = num_students - start;
+        for (int k = 1; k < size; k++) {
+            fprintf(fp, "S%d,S%d\n", order[start + k - 1] + 1, order[start + k] + 1);
+        }
+        start += size;
     }
+    
+    free(order);
+    return fclose(fp) == 0;
 }
 
-static void add_rule_dialog_response(GtkDialog *dialog, int response, gpointer user_data) {
-    if (response == GTK_RESPONSE_OK) {
-        GtkWidget *combo_a = g_object_get_data(G_OBJECT(dialog), "combo_a");
-        GtkWidget *combo_b = g_object_get_data(G_OBJECT(dialog), "combo_b");
-        GArray *rules = g_object_get_data(G_OBJECT(dialog), "rules");
-        GtkWidget *rule_textview = g_object_get_data(G_OBJECT(dialog), "rule_textview");
-        GtkNotebook *notebook = g_object_get_data(G_OBJECT(dialog), "notebook");
-        Student *students = g_object_get_data(G_OBJECT(dialog), "students");
-        int num_students = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(dialog), "num_students"));
-        void (*update_tabs_callback)(GtkNotebook*, Student*, int, GArray*, int) = 
-            g_object_get_data(G_OBJECT(dialog), "update_tabs_callback");
-        
-        char *name_a = gtk_drop_down_get_selected_item(GTK_DROP_DOWN(combo_a));
-        char *name_b = gtk_drop_down_get_selected_item(GTK_DROP_DOWN(combo_b));
+// Handles one generator option; false if arg is not one
+static bool parse_generator_option(const char *arg, const char *value, GeneratorOptions *options) {
+    if (str_equal_case(arg, "--students")) options->num_students = atoi(value);
+    else if (str_equal_case(arg, "--schools")) options->num_schools = atoi(value);
+    else if (str_equal_case(arg, "--school-skew")) options->school_skew = atof(value);
+    else if (str_equal_case(arg, "--male-share")) options->male_share = atof(value);
+    else if (str_equal_case(arg, "--bg-values")) options->num_bg_values = atoi(value);
+    else if (str_equal_case(arg, "--rule-density")) options->rule_density = atof(value);
+    else if (str_equal_case(arg, "--max-group-size")) options->max_group_size = atoi(value);
+    else if (str_equal_case(arg, "--seed")) options->seed = strtoull(value, NULL, 10);
+    else return false;
+    return true;
+}
+
+static void print_generator_usage(FILE *fp, const char *program) {
+    fprintf(fp,
+            "Usage: %s --generate STUDENTS.csv [--rules-out RULES.csv] [--students N]\n"
+            "          [--schools N] [--school-skew S] [--male-share F] [--bg-values N]\n"
+            "          [--rule-density F] [--max-group-size N] [--seed N]\n"
+            "\n"
+            "Writes a synthetic student file (default 1000 students) for testing and\n"
+            "benchmarking. School sizes are Zipf-distributed with exponent S (default 1,\n"
+            "one school per 25 students unless --schools is given). --rule-density F\n"
+            "(default 0.1) of the students are joined into groups of 2..N (default 3)\n"
+            "by rules written to --rules-out, which refer to the students' IDs.\n",
+            program);
+}
+
+static int run_generate_mode(int argc, char *argv[]) {
+    GeneratorOptions options;
+    generator_options_init(&options);
+    const char *students_path = NULL;
+    const char *rules_path = NULL;
+    
+    for (int i = 1; i < argc; i += 2) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
         
-        if (name_a && name_b && strcmp(name_a, name_b) != 0) {
-            Rule rule = {str_dup(name_a), str_dup(name_b)};
-            g_array_append_val(rules, rule);
-            update_rule_textview(GTK_TEXT_VIEW(rule_textview), rules);
-            update_tabs_callback(notebook, students, num_students, rules, 0);
+        if (value == NULL) {
+            fprintf(stderr, "Missing value for option %s\n", arg);
+            print_generator_usage(stderr, argv[0]);
+            return 2;
         }
-            
-            g_free(name_a);
-            g_free(name_b);
+        if (str_equal_case(arg, "--generate")) students_path = value;
+        else if (str_equal_case(arg, "--rules-out")) rules_path = value;
+        else if (!parse_generator_option(arg, value, &options)) {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_generator_usage(stderr, argv[0]);
+            return 2;
         }
-    gtk_window_destroy(GTK_WINDOW(dialog));
+    }
+    
+    if (options.num_students <= 0) {
+        fprintf(stderr, "Invalid --students\n");
+        return 2;
+    }
+    return generate_cohort_files(&options, students_path, rules_path) ? 0 : 1;
 }
 
-static void open_add_rule_dialog(GtkWindow *parent, Student *students, int num_students, 
-                              GArray *rules, GtkWidget *rule_textview, GtkNotebook *notebook,
-                              void (*update_tabs_callback)(GtkNotebook*, Student*, int, GArray*, int)) {
-    GtkWidget *dialog = gtk_window_new();
-    gtk_window_set_title(GTK_WINDOW(dialog), "Regel hinzufügen");
-    gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
-    gtk_window_set_transient_for(GTK_WINDOW(dialog), parent);
-    
-    GtkWidget *header = gtk_header_bar_new();
-    gtk_header_bar_set_show_title_buttons(GTK_HEADER_BAR(header), TRUE);
-    gtk_window_set_titlebar(GTK_WINDOW(dialog), header);
-    
-    GtkWidget *cancel_button = gtk_button_new_with_label("Abbrechen");
-    gtk_header_bar_pack_start(GTK_HEADER_BAR(header), cancel_button);
-    g_signal_connect_swapped(cancel_button, "clicked", G_CALLBACK(gtk_window_destroy), dialog);
-    
-    GtkWidget *add_button = gtk_button_new_with_label("Hinzufügen");
-    gtk_header_bar_pack_end(GTK_HEADER_BAR(header), add_button);
-    g_signal_connect(add_button, "clicked", G_CALLBACK(add_rule_dialog_response), dialog);
+// ===========================
+// Benchmark
+// ===========================
+
+#define MAX_BENCHMARK_SIZES 16
+
+typedef struct {
+    GeneratorOptions cohort;    // num_students is overridden by each size
+    int sizes[MAX_BENCHMARK_SIZES];
+    int num_sizes;
+    int num_classes;
+    long iterations;            // Local search moves per size
+    CostModel cost;
+    const char *work_dir;       // Where the generated files go
+    const char *output_path;    // JSON lines; stdout if NULL
+} BenchmarkOptions;
+
+static double benchmark_seconds_since(gint64 start) {
+    return (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+}
+
+// One JSON object per line; cost is left out when it is NAN
+static void benchmark_report(FILE *fp, int num_students, int num_classes, const char *phase,
+                             double seconds, double cost) {
+    fprintf(fp, "{\"students\": %d, \"classes\": %d, \"phase\": \"%s\", \"seconds\": %.6f",
+            num_students, num_classes, phase, seconds);
+    if (!isnan(cost)) fprintf(fp, ", \"cost\": %.0f", cost);
+    fprintf(fp, "}\n");
+    fflush(fp);
+}
+
+// Times each stage of the pipeline on a generated cohort
+static bool benchmark_pipeline(const BenchmarkOptions *options, int num_students, const char *students_path,
+                               const char *rules_path, FILE *out) {
+    int num_classes = options->num_classes;
     
-    GtkWidget *content_area = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
-    gtk_widget_set_margin_start(content_area, 5);
-    gtk_widget_set_margin_end(content_area, 5);
-    gtk_widget_set_margin_top(content_area, 5);
-    gtk_widget_set_margin_bottom(content_area, 5);
+    Cohort cohort;
+    Rule *rules = NULL;
+    int num_rules = 0;
+    gint64 start = g_get_monotonic_time();
+    load_cohort(students_path, false, NULL, &options->cost, &cohort);
+    benchmark_report(out, num_students, num_classes, "load_csv", benchmark_seconds_since(start), NAN);
+    if (cohort.num_students != num_students) {
+        fprintf(stderr, "Benchmark: loaded %d of %d students\n", cohort.num_students, num_students);
+        free_cohort(&cohort);
+        return false;
+    }
     
-    GtkWidget *grid = gtk_grid_new();
-    gtk_grid_set_row_spacing(GTK_GRID(grid), 5);
-    gtk_grid_set_column_spacing(GTK_GRID(grid), 5);
+    start = g_get_monotonic_time();
+    snapshot_write(&cohort);
+    benchmark_report(out, num_students, num_classes, "snapshot_write", benchmark_seconds_since(start), NAN);
     
-    GtkWidget *label_a = gtk_label_new("Schüler A:");
-    GtkWidget *label_b = gtk_label_new("Schüler B:");
-    GtkWidget *combo_a = gtk_drop_down_new(NULL, NULL);
-    GtkWidget *combo_b = gtk_drop_down_new(NULL, NULL);
+    Cohort reloaded;
+    start = g_get_monotonic_time();
+    load_cohort(students_path, true, NULL, &options->cost, &reloaded);
+    benchmark_report(out, num_students, num_classes, "snapshot_load", benchmark_seconds_since(start), NAN);
+    free_cohort(&reloaded);
     
-    gtk_grid_attach(GTK_GRID(grid), label_a, 0, 0, 1, 1);
-    gtk_grid_attach(GTK_GRID(grid), combo_a, 1, 0, 1, 1);
-    gtk_grid_attach(GTK_GRID(grid), label_b, 0, 1, 1, 1);
-    gtk_grid_attach(GTK_GRID(grid), combo_b, 1, 1, 1, 1);
+    start = g_get_monotonic_time();
+    load_rules(rules_path, &rules, &num_rules);
+    StudentGroup *groups = NULL;
+    int num_groups = 0;
+    build_groups(&cohort, rules, num_rules, &groups, &num_groups);
+    benchmark_report(out, num_students, num_classes, "rules", benchmark_seconds_since(start), NAN);
     
-    GListStore *store_a = g_list_store_new(G_TYPE_STRING);
-    GListStore *store_b = g_list_store_new(G_TYPE_STRING);
+    Assignment assignment;
+    start = g_get_monotonic_time();
+    distribute_students_with_rules(&cohort, groups, num_groups, num_classes, &assignment);
+    benchmark_report(out, num_students, num_classes, "construct", benchmark_seconds_since(start),
+                     compute_total_cost(&cohort, &assignment));
     
+    // Every student against every class, the inner loop of construction
+    volatile double cost_sink = 0.0;
+    start = g_get_monotonic_time();
     for (int i = 0; i < num_students; i++) {
-        char *full_name = g_strdup_printf("%s %s", students[i].first_name, students[i].last_name);
-        g_list_store_append(store_a, full_name);
-        g_list_store_append(store_b, full_name);
-        g_free(full_name);
+        for (int c = 0; c < num_classes; c++) {
+            cost_sink += compute_cost(&assignment, c, i);
+        }
     }
+    benchmark_report(out, num_students, num_classes, "compute_cost", benchmark_seconds_since(start), NAN);
     
-    GtkSingleSelection *selection_a = gtk_single_selection_new(G_LIST_MODEL(store_a));
-    GtkSingleSelection *selection_b = gtk_single_selection_new(G_LIST_MODEL(store_b));
+    SolveOptions solve;
+    solve_options_init(&solve);
+    solve.max_iterations = options->iterations;
+    solve.time_limit = 0;
+    Rng rng;
+    rng_seed(&rng, options->cohort.seed);
+    start = g_get_monotonic_time();
+    improve_assignment(&cohort, groups, num_groups, &solve, &rng, &assignment);
+    benchmark_report(out, num_students, num_classes, "improve", benchmark_seconds_since(start),
+                     compute_total_cost(&cohort, &assignment));
     
-    gtk_drop_down_set_model(GTK_DROP_DOWN(combo_a), G_LIST_MODEL(store_a));
-    gtk_drop_down_set_model(GTK_DROP_DOWN(combo_b), G_LIST_MODEL(store_b));
+    // The same cohort without its rules, through the flow solver
+    Assignment flow;
+    start = g_get_monotonic_time();
+    bool flowed = distribute_students_flow(&cohort, num_classes, &flow);
+    benchmark_report(out, num_students, num_classes, "flow", benchmark_seconds_since(start),
+                     flowed ? compute_total_cost(&cohort, &flow) : NAN);
+    if (flowed) assignment_free(&flow);
     
-    g_object_unref(store_a);
-    g_object_unref(store_b);
-    g_object_unref(selection_a);
-    g_object_unref(selection_b);
+    start = g_get_monotonic_time();
+    double bound = compute_cost_lower_bound(&cohort, num_classes);
+    benchmark_report(out, num_students, num_classes, "lower_bound", benchmark_seconds_since(start), bound);
     
-    gtk_box_append(GTK_BOX(content_area), grid);
-    gtk_window_set_child(GTK_WINDOW(dialog), content_area);
-    
-    g_object_set_data(G_OBJECT(dialog), "combo_a", combo_a);
-    g_object_set_data(G_OBJECT(dialog), "combo_b", combo_b);
-    g_object_set_data(G_OBJECT(dialog), "rules", rules);
-    g_object_set_data(G_OBJECT(dialog), "rule_textview", rule_textview);
-    g_object_set_data(G_OBJECT(dialog), "notebook", notebook);
-    g_object_set_data(G_OBJECT(dialog), "students", students);
-    g_object_set_data(G_OBJECT(dialog), "num_students", GINT_TO_POINTER(num_students));
-    g_object_set_data(G_OBJECT(dialog), "update_tabs_callback", update_tabs_callback);
+    start = g_get_monotonic_time();
+    char **stats = compute_class_stats(&cohort, &assignment);
+    free_class_stats(stats, num_classes);
+    benchmark_report(out, num_students, num_classes, "stats", benchmark_seconds_since(start), NAN);
     
-    gtk_widget_set_visible(dialog, TRUE);
+    assignment_free(&assignment);
+    free_student_groups(groups);
+    free_rules(rules, num_rules);
+    free_cohort(&cohort);
+    return true;
 }
 
-static void update_tabs(GtkNotebook *notebook, Student *students, int num_students, GArray *rules, int num_classes) {
-    // Clear existing tabs
-    while (gtk_notebook_get_n_pages(notebook) > 0) {
-        gtk_notebook_remove_page(notebook, 0);
-    }
-    
-    if (students == NULL || num_students == 0) {
-        show_error_dialog(NULL, "Keine Schülerdaten verfügbar.");
-        return;
-    }
+// Generates a cohort of the given size in the work directory, benchmarks
+// it and removes the files again
+static bool benchmark_size(const BenchmarkOptions *options, int num_students, FILE *out) {
+    GeneratorOptions generator = options->cohort;
+    generator.num_students = num_students;
     
-    // Distribute students into classes
-    Student **classes = NULL;
-    int *class_sizes = NULL;
+    char *students_path = g_strdup_printf("%s/sorter-bench-%d.csv", options->work_dir, num_students);
+    char *rules_path = g_strdup_printf("%s/sorter-bench-%d-rules.csv", options->work_dir, num_students);
+    char *snap_path = snapshot_path(students_path);
     
-    if (rules && rules->len > 0) {
-        distribute_students_with_rules(students, num_students, 
-            (Rule*)rules->data, rules->len, num_classes, &classes, &class_sizes);
-    } else {
-        distribute_students_optimized(students, num_students, num_classes, &classes, &class_sizes);
+    gint64 start = g_get_monotonic_time();
+    bool ok = generate_cohort_files(&generator, students_path, rules_path);
+    if (ok) {
+        benchmark_report(out, num_students, options->num_classes, "generate", benchmark_seconds_since(start), NAN);
+        ok = benchmark_pipeline(options, num_students, students_path, rules_path, out);
     }
     
-    if (!classes || !class_sizes) {
-        show_error_dialog(NULL, "Fehler bei der Klasseneinteilung.");
-        return;
+    remove(students_path);
+    remove(rules_path);
+    remove(snap_path);
+    g_free(students_path);
+    g_free(rules_path);
+    free(snap_path);
+    return ok;
+}
+
+static void print_benchmark_usage(FILE *fp, const char *program) {
+    fprintf(fp,
+            "Usage: %s --benchmark [--sizes N,N,...] [--classes N] [--iterations N]\n"
+            "          [--weights W,W,W] [--dir DIR] [--out RESULTS.jsonl] [generator options]\n"
+            "\n"
+            "Generates synthetic cohorts (default sizes 100,1000,10000,100000,1000000)\n"
+            "in DIR (default: the temporary directory) and times CSV parsing, snapshot\n"
+            "writing and loading, rule grouping, the greedy construction, compute_cost,\n"
+            "--iterations local search moves (default 200000), the flow solver on the\n"
+            "cohort without its rules, the cost lower bound and the class statistics.\n"
+            "Each phase is written as one JSON object per line with the students,\n"
+            "classes, phase and seconds, and the total cost after construct, improve\n"
+            "and flow. --weights sets the cost weights as in batch mode. The generator\n"
+            "options are those of --generate except --students.\n",
+            program);
+}
+
+static int run_benchmark_mode(int argc, char *argv[]) {
+    BenchmarkOptions options;
+    memset(&options, 0, sizeof(options));
+    generator_options_init(&options.cohort);
+    options.num_classes = 10;
+    options.iterations = 200000;
+    options.work_dir = g_get_tmp_dir();
+    cost_model_init(&options.cost);
+    
+    const int default_sizes[] = { 100, 1000, 10000, 100000, 1000000 };
+    for (int i = 0; i < 5; i++) {
+        options.sizes[options.num_sizes++] = default_sizes[i];
     }
     
-    // Add tabs for each class
-    for (int i = 0; i < num_classes; i++) {
-        if (!classes[i] || class_sizes[i] <= 0) continue;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
         
-        char *label = g_strdup_printf("Klasse %d", i + 1);
-        GtkWidget *scrolled_window = gtk_scrolled_window_new();
-        GtkWidget *treeview = create_student_treeview(classes[i], class_sizes[i]);
-        gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled_window), treeview);
-        gtk_notebook_append_page(notebook, scrolled_window, gtk_label_new(label));
-        g_free(label);
-    }
+        if (str_equal_case(arg, "--benchmark")) continue;
+        if (value == NULL) {
+            fprintf(stderr, "Missing value for option %s\n", arg);
+            print_benchmark_usage(stderr, argv[0]);
+            return 2;
+        }
         
-    // Add statistics tab
-    GtkWidget *stats_frame = gtk_frame_new("Klassenstatistiken");
-        GtkWidget *stats_textview = gtk_text_view_new();
-    gtk_text_view_set_editable(GTK_TEXT_VIEW(stats_textview), FALSE);
+        if (str_equal_case(arg, "--sizes")) {
+            options.num_sizes = 0;
+            for (const char *p = value; *p != '\0' && options.num_sizes < MAX_BENCHMARK_SIZES; ) {
+                char *end;
+                long size = strtol(p, &end, 10);
+                if (end == p || size <= 0) {
+                    fprintf(stderr, "Invalid --sizes: %s\n", value);
+                    return 2;
+                }
+                options.sizes[options.num_sizes++] = (int)size;
+                p = *end == ',' ? end + 1 : end;
+            }
+        }
+        else if (str_equal_case(arg, "--classes")) options.num_classes = atoi(value);
+        else if (str_equal_case(arg, "--iterations")) options.iterations = atol(value);
+        else if (str_equal_case(arg, "--dir")) options.work_dir = value;
+        else if (str_equal_case(arg, "--out")) options.output_path = value;
+        else if (str_equal_case(arg, "--weights")) {
+            if (!parse_cost_weights(value, &options.cost)) return 2;
+        }
+        else if (!parse_generator_option(arg, value, &options.cohort)) {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_benchmark_usage(stderr, argv[0]);
+            return 2;
+        }
+        i++;
+    }
     
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(stats_textview));
-    GtkTextIter iter;
-    gtk_text_buffer_get_start_iter(buffer, &iter);
+    if (options.num_classes <= 0) {
+        fprintf(stderr, "Invalid --classes\n");
+        return 2;
+    }
     
-    // Add statistics for each class
-    for (int i = 0; i < num_classes; i++) {
-        if (!classes[i] || class_sizes[i] <= 0) continue;
-        
-        char *stats = compute_stats(classes[i], class_sizes[i]);
-        if (stats) {
-            char *header = g_strdup_printf("\nKlasse %d:\n", i + 1);
-            gtk_text_buffer_insert(buffer, &iter, header, -1);
-            gtk_text_buffer_insert(buffer, &iter, stats, -1);
-            g_free(header);
-            g_free(stats);
+    FILE *out = stdout;
+    if (options.output_path != NULL) {
+        out = fopen(options.output_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Could not open benchmark output: %s\n", options.output_path);
+            return 1;
         }
     }
     
-        gtk_frame_set_child(GTK_FRAME(stats_frame), stats_textview);
-        gtk_widget_set_margin_top(stats_frame, 5);
-        gtk_widget_set_margin_bottom(stats_frame, 5);
-    gtk_notebook_append_page(notebook, stats_frame, gtk_label_new("Statistiken"));
-    
-    // Clean up
-    for (int i = 0; i < num_classes; i++) {
-        if (classes[i]) free(classes[i]);
+    int status = 0;
+    for (int i = 0; i < options.num_sizes; i++) {
+        if (!benchmark_size(&options, options.sizes[i], out)) {
+            status = 1;
+            break;
+        }
     }
-    free(classes);
-    free(class_sizes);
     
-    gtk_widget_set_visible(GTK_WIDGET(notebook), TRUE);
+    if (out != stdout) fclose(out);
+    return status;
 }
 
 // ===========================
-// Main Sorter Window
+// Manifest Batch Mode
 // ===========================
 
+// One school of a manifest. The worker that runs it is the only one to
+// touch it until the pool has finished.
 typedef struct {
-    GtkWidget *window;
-    GtkWidget *notebook;
-    GtkWidget *rule_textview;
-    GArray *rules;
-    Student *students;
+    char *name;
+    char *input_path;
+    char *rules_path;       // NULL if the school has no rules
+    char *output_path;
+    int num_classes;
+    bool use_snapshot;      // Off for all but the first job reading a student file
+    
+    // Results
     int num_students;
-} SorterWindow;
+    int num_rules;
+    double cost;
+    double bound;
+    double load_seconds;
+    double solve_seconds;
+    double total_seconds;
+    bool distributed;
+    char *error;            // Status for the summary, NULL on success
+} ManifestJob;
 
-static void add_rule_button_clicked(GtkButton *button, gpointer user_data) {
-    SorterWindow *sorter_window = user_data;
-    open_add_rule_dialog(
-        GTK_WINDOW(sorter_window->window),
-        sorter_window->students,
-        sorter_window->num_students,
-        sorter_window->rules,
-        sorter_window->rule_textview,
-        GTK_NOTEBOOK(sorter_window->notebook),
-        update_tabs
-    );
+// Read-only for the workers
+typedef struct {
+    CostModel cost;
+    SolveOptions solve;
+} ManifestSettings;
+
+static void print_manifest_usage(FILE *fp, const char *program) {
+    fprintf(fp,
+            "Usage: %s --manifest SCHOOLS.csv [--jobs N] [--summary SUMMARY.csv]\n"
+            "          [--solver local|annealing|flow] [--iterations N] [--time-limit SECONDS]\n"
+            "          [--threads N] [--seed N] [--no-snapshot] [--weights W,W,W]\n"
+            "          [--cost-config FILE] [--balance COLUMN[=W],...]\n"
+            "\n"
+            "Distributes the students of many schools in one run. SCHOOLS.csv has a\n"
+            "header and one line per school with the columns Schule (optional),\n"
+            "Schülerdatei, Klassen, Regeln (optional) and Ausgabe, or in English name,\n"
+            "input, classes, rules and output. Relative paths are taken from the\n"
+            "directory of SCHOOLS.csv, and no two schools may share an output file.\n"
+            "Empty lines and lines starting with '#' are ignored.\n"
+            "\n"
+            "--jobs schools are loaded and distributed at the same time (default: one\n"
+            "per core), each with --threads solver threads (default 1). The remaining\n"
+            "options apply to every school as in single-school batch mode.\n"
+            "\n"
+            "SUMMARY.csv (default stdout) lists every school in manifest order with its\n"
+            "students, classes and rules, the total cost, the lower bound and the gap\n"
+            "between them, the seconds spent loading, distributing and in total, and\n"
+            "its status. The exit status is 1 if any school failed.\n",
+            program);
 }
 
-static GtkWidget *create_sorter_window(GtkApplication *app, Student *students, int num_students, int num_classes) {
-    GtkWidget *window = gtk_application_window_new(app);
-    gtk_window_set_title(GTK_WINDOW(window), "Klasseneinteilung");
-    gtk_window_set_default_size(GTK_WINDOW(window), 800, 600);
-    
-    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
-    gtk_widget_set_margin_start(vbox, 5);
-    gtk_widget_set_margin_end(vbox, 5);
-    gtk_widget_set_margin_top(vbox, 5);
-    gtk_widget_set_margin_bottom(vbox, 5);
-    
-    // Create rules array
-    GArray *rules = g_array_new(FALSE, FALSE, sizeof(Rule));
-    
-    // Create rule textview
-    GtkWidget *rule_textview = gtk_text_view_new();
-    gtk_text_view_set_editable(GTK_TEXT_VIEW(rule_textview), FALSE);
-    
-    // Create add rule button
-    GtkWidget *add_rule_button = gtk_button_new_with_label("Regel hinzufügen");
-    g_signal_connect(add_rule_button, "clicked", G_CALLBACK(add_rule_button_clicked), NULL);
-    gtk_box_append(GTK_BOX(vbox), add_rule_button);
-    
-    // Create notebook for class tabs
-    GtkWidget *notebook = gtk_notebook_new();
-    gtk_box_append(GTK_BOX(vbox), notebook);
+// Paths in the manifest are relative to the manifest itself. They are made
+// absolute without "." and ".." parts, so that equal paths compare equal.
+static char *manifest_path(const char *directory, const FieldSpan *field) {
+    char *path = g_strndup(field->start, field->length);
+    char *resolved = g_canonicalize_filename(path, directory);
+    g_free(path);
+    return resolved;
+}
+
+static void free_manifest_jobs(ManifestJob *jobs, int num_jobs) {
+    for (int i = 0; i < num_jobs; i++) {
+        g_free(jobs[i].name);
+        g_free(jobs[i].input_path);
+        g_free(jobs[i].rules_path);
+        g_free(jobs[i].output_path);
+        g_free(jobs[i].error);
+    }
+    free(jobs);
+}
+
+static bool load_manifest(const char *path, ManifestJob **jobs, int *num_jobs) {
+    *jobs = NULL;
+    *num_jobs = 0;
     
-    gtk_window_set_child(GTK_WINDOW(window), vbox);
+    char *contents = NULL;
+    gsize length = 0;
+    GError *error = NULL;
+    if (!g_file_get_contents(path, &contents, &length, &error)) {
+        fprintf(stderr, "Could not open manifest: %s\n", error->message);
+        g_error_free(error);
+        return false;
+    }
     
-    // Set data for callbacks
-    SorterWindow *sorter_window = g_new(SorterWindow, 1);
-    sorter_window->window = window;
-    sorter_window->notebook = notebook;
-    sorter_window->rule_textview = rule_textview;
-    sorter_window->rules = rules;
-    sorter_window->students = students;
-    sorter_window->num_students = num_students;
-    g_object_set_data(G_OBJECT(add_rule_button), "sorter_window", sorter_window);
+    const char *cursor = contents;
+    const char *end = contents + length;
+    if (length >= 3 && memcmp(cursor, "\xEF\xBB\xBF", 3) == 0) {
+        cursor += 3; // UTF-8 byte order mark
+    }
     
-    // Update tabs with initial distribution
-    update_tabs(GTK_NOTEBOOK(notebook), students, num_students, rules, num_classes);
+    FieldSpan *fields = NULL;
+    int fields_capacity = 0;
+    const char *line, *line_end;
+    int column_name = -1, column_input = -1, column_classes = -1, column_rules = -1, column_output = -1;
+    if (next_csv_line(&cursor, end, &line, &line_end)) {
+        int count = split_csv_record(line, line_end, &fields, &fields_capacity);
+        for (int i = 0; i < count; i++) {
+            char *header = g_strndup(fields[i].start, fields[i].length);
+            if (str_equal_ignore_case(header, "Schule") || str_equal_ignore_case(header, "name")) column_name = i;
+            else if (str_equal_ignore_case(header, "Schülerdatei") || str_equal_ignore_case(header, "input")) column_input = i;
+            else if (str_equal_ignore_case(header, "Klassen") || str_equal_ignore_case(header, "classes")) column_classes = i;
+            else if (str_equal_ignore_case(header, "Regeln") || str_equal_ignore_case(header, "rules")) column_rules = i;
+            else if (str_equal_ignore_case(header, "Ausgabe") || str_equal_ignore_case(header, "output")) column_output = i;
+            g_free(header);
+        }
+    }
+    if (column_input == -1 || column_classes == -1 || column_output == -1) {
+        fprintf(stderr, "Error: Manifest %s needs the columns Schülerdatei, Klassen and Ausgabe\n", path);
+        free(fields);
+        g_free(contents);
+        return false;
+    }
     
-    return window;
-}
-
-// ===========================
-// Browse Button Handler
-// ===========================
-
-static void file_chooser_response(GtkDialog *dialog, int response, gpointer user_data) {
-    if (response == GTK_RESPONSE_ACCEPT) {
-        GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
-        GtkWidget *entry = user_data;
+    char *directory = g_path_get_dirname(path);
+    int capacity = 16;
+    *jobs = (ManifestJob*)calloc(capacity, sizeof(ManifestJob));
+    bool ok = true;
+    int line_number = 1;
+    while (ok && next_csv_line(&cursor, end, &line, &line_end)) {
+        line_number++;
+        while (line < line_end && isspace((unsigned char)*line)) line++;
+        if (line == line_end || *line == '#') continue;
         
-        g_autoptr(GFile) file = gtk_file_chooser_get_file(chooser);
-        if (file) {
-            char *path = g_file_get_path(file);
-            if (path) {
-                // Convert Windows backslashes to forward slashes for consistency
-                for (char *p = path; *p; p++) {
-                    if (*p == '\\') *p = '/';
-                }
-                gtk_editable_set_text(GTK_EDITABLE(entry), path);
-                g_free(path);
+        int count = split_csv_record(line, line_end, &fields, &fields_capacity);
+        if (column_input >= count || column_classes >= count || column_output >= count ||
+            fields[column_input].length == 0 || fields[column_output].length == 0) {
+            fprintf(stderr, "Error: Manifest line %d lacks the student file, class count or output\n", line_number);
+            ok = false;
+            continue;
+        }
+        char *classes = g_strndup(fields[column_classes].start, fields[column_classes].length);
+        char *classes_end;
+        long num_classes = strtol(classes, &classes_end, 10);
+        bool valid_classes = classes_end != classes && *classes_end == '\0' && num_classes > 0;
+        g_free(classes);
+        if (!valid_classes) {
+            fprintf(stderr, "Error: Manifest line %d has an invalid class count\n", line_number);
+            ok = false;
+            continue;
+        }
+        
+        if (*num_jobs >= capacity) {
+            capacity *= 2;
+            *jobs = (ManifestJob*)realloc(*jobs, capacity * sizeof(ManifestJob));
+        }
+        ManifestJob *job = &(*jobs)[(*num_jobs)++];
+        memset(job, 0, sizeof(*job));
+        job->input_path = manifest_path(directory, &fields[column_input]);
+        job->output_path = manifest_path(directory, &fields[column_output]);
+        job->num_classes = (int)num_classes;
+        if (column_rules != -1 && column_rules < count && fields[column_rules].length > 0) {
+            job->rules_path = manifest_path(directory, &fields[column_rules]);
+        }
+        if (column_name != -1 && column_name < count && fields[column_name].length > 0) {
+            job->name = g_strndup(fields[column_name].start, fields[column_name].length);
+        } else {
+            job->name = g_path_get_basename(job->input_path);
+        }
+        
+        // Two jobs writing the same snapshot would clash over its temporary file,
+        // and two writing the same result would overwrite each other
+        job->use_snapshot = true;
+        for (int i = 0; i < *num_jobs - 1; i++) {
+            if (strcmp((*jobs)[i].input_path, job->input_path) == 0) job->use_snapshot = false;
+            if (strcmp((*jobs)[i].output_path, job->output_path) == 0) {
+                fprintf(stderr, "Error: Manifest line %d writes to %s like an earlier line\n", line_number,
+                        job->output_path);
+                ok = false;
+                break;
             }
         }
     }
-    gtk_window_destroy(GTK_WINDOW(dialog));
-}
-
-static void browse_button_clicked(GtkButton *button, gpointer user_data) {
-    GtkWidget *entry = user_data;
-    GtkWidget *window = gtk_widget_get_ancestor(GTK_WIDGET(button), GTK_TYPE_WINDOW);
-    
-    GtkWidget *dialog = gtk_file_chooser_dialog_new(
-        "Datei auswählen",
-        GTK_WINDOW(window),
-        GTK_FILE_CHOOSER_ACTION_OPEN,
-        "Abbrechen", GTK_RESPONSE_CANCEL,
-        "Öffnen", GTK_RESPONSE_ACCEPT,
-        NULL
-    );
     
-    gtk_window_present(GTK_WINDOW(dialog));
-    g_signal_connect(dialog, "response", G_CALLBACK(file_chooser_response), entry);
+    if (ok && *num_jobs == 0) {
+        fprintf(stderr, "Error: Manifest %s lists no schools\n", path);
+        ok = false;
+    }
+    if (!ok) {
+        free_manifest_jobs(*jobs, *num_jobs);
+        *jobs = NULL;
+        *num_jobs = 0;
+    }
+    g_free(directory);
+    free(fields);
+    g_free(contents);
+    return ok;
 }
 
-// ===========================
-// Start Button Handler
-// ===========================
+static double seconds_since(gint64 start) {
+    return (g_get_monotonic_time() - start) / 1e6;
+}
 
-static void start_button_clicked(GtkButton *button, gpointer user_data) {
-    GtkApplication *app = GTK_APPLICATION(g_object_get_data(G_OBJECT(button), "app"));
-    GtkWidget *file_path_entry = g_object_get_data(G_OBJECT(button), "file_path_entry");
-    GtkWidget *num_classes_entry = g_object_get_data(G_OBJECT(button), "num_classes_entry");
+// GThreadPool worker: loads, distributes and writes one school
+static void run_manifest_job(gpointer data, gpointer user_data) {
+    ManifestJob *job = data;
+    const ManifestSettings *settings = user_data;
+    gint64 start = g_get_monotonic_time();
     
-    const char *file_path = gtk_editable_get_text(GTK_EDITABLE(file_path_entry));
-    if (strlen(file_path) == 0) {
-        show_error_dialog(NULL, "Bitte wählen Sie eine Datei aus.");
-        return;
-    }
+    Cohort cohort;
+    Rule *rules = NULL;
+    int num_rules = 0;
+    load_cohort(job->input_path, job->use_snapshot, NULL, &settings->cost, &cohort);
     
-    const char *num_classes_text = gtk_editable_get_text(GTK_EDITABLE(num_classes_entry));
-    int num_classes = atoi(num_classes_text);
-    if (num_classes <= 0) {
-        show_error_dialog(NULL, "Bitte geben Sie eine gültige Anzahl von Klassen ein.");
-        return;
+    if (cohort.students == NULL || cohort.num_students == 0) {
+        job->error = g_strdup("Keine Schüler geladen");
+    } else if (job->rules_path != NULL) {
+        load_rules(job->rules_path, &rules, &num_rules);
+        int num_apart = 0;
+        int contradicting = rules != NULL
+                          ? find_contradicting_rule(&cohort, rules, num_rules, job->num_classes, &num_apart) : -1;
+        if (rules == NULL) {
+            job->error = g_strdup("Regeldatei nicht lesbar");
+        } else if (contradicting != -1 && num_apart > 0) {
+            job->error = g_strdup_printf("%d Gruppen sollen in verschiedene Klassen, es gibt aber nur %d Klassen",
+                                         num_apart, job->num_classes);
+        } else if (contradicting != -1) {
+            job->error = g_strdup_printf("%s und %s lassen sich nicht trennen", rules[contradicting].student_a,
+                                         rules[contradicting].student_b);
+        }
     }
+    job->num_students = cohort.num_students;
+    job->num_rules = num_rules;
+    job->load_seconds = seconds_since(start);
     
-    Student *students = NULL;
-    int num_students = 0;
-    load_students(file_path, &students, &num_students);
-    
-    if (students && num_students > 0) {
-        GtkWidget *sorter_window = create_sorter_window(app, students, num_students, num_classes);
-        gtk_widget_set_visible(sorter_window, TRUE);
-    } else {
-        show_error_dialog(NULL, "Fehler beim Laden der Schülerdaten.");
+    if (job->error == NULL) {
+        gint64 solve_start = g_get_monotonic_time();
+        Assignment assignment;
+        distribute_students(&cohort, rules, num_rules, job->num_classes, &settings->solve, &assignment);
+        job->cost = compute_total_cost(&cohort, &assignment);
+        job->bound = compute_cost_lower_bound(&cohort, job->num_classes);
+        job->solve_seconds = seconds_since(solve_start);
+        job->distributed = true;
+        
+        int broken = count_broken_separations(&cohort, rules, num_rules, &assignment);
+        FILE *out = broken > 0 ? NULL : fopen(job->output_path, "w");
+        if (broken > 0) {
+            job->error = g_strdup_printf("%d Trennungsregeln nicht erfüllbar", broken);
+        } else if (out == NULL) {
+            job->error = g_strdup("Ausgabedatei nicht beschreibbar");
+        } else {
+            if (!write_classes_csv(out, &cohort, &assignment)) job->error = g_strdup("Fehler beim Schreiben");
+            fclose(out);
+        }
+        assignment_free(&assignment);
     }
+    
+    free_rules(rules, num_rules);
+    free_cohort(&cohort);
+    job->total_seconds = seconds_since(start);
+    if (job->error == NULL) fprintf(stderr, "%s: done in %.2f s\n", job->name, job->total_seconds);
+    else fprintf(stderr, "%s: failed (%s)\n", job->name, job->error);
 }
 
-// ===========================
-// Start Screen
-// ===========================
+static void write_manifest_summary(FILE *fp, const ManifestJob *jobs, int num_jobs) {
+    fprintf(fp, "Schule,Schülerdatei,Schüler,Klassen,Regeln,Gesamtkosten,Untere Schranke,"
+                "Abstand zur Schranke (%%),Laden (s),Verteilen (s),Gesamt (s),Status\n");
+    for (int i = 0; i < num_jobs; i++) {
+        const ManifestJob *job = &jobs[i];
+        write_csv_field(fp, job->name);
+        fputc(',', fp);
+        write_csv_field(fp, job->input_path);
+        fprintf(fp, ",%d,%d,%d,", job->num_students, job->num_classes, job->num_rules);
+        if (job->distributed) {
+            double gap = job->bound > 0 ? 100.0 * (job->cost - job->bound) / job->bound : 0.0;
+            fprintf(fp, "%.0f,%.0f,%.2f,", job->cost, job->bound, gap);
+        } else {
+            fprintf(fp, ",,,");
+        }
+        fprintf(fp, "%.3f,%.3f,%.3f,", job->load_seconds, job->solve_seconds, job->total_seconds);
+        write_csv_field(fp, job->error == NULL ? "OK" : job->error);
+        fputc('\n', fp);
+    }
+}
 
-static void create_start_screen(GtkApplication *app) {
-    GtkWidget *window = gtk_application_window_new(app);
-    gtk_window_set_title(GTK_WINDOW(window), "Klasseneinteilung - Start");
-    gtk_window_set_default_size(GTK_WINDOW(window), 400, 200);
+static int run_manifest_mode(int argc, char *argv[]) {
+    const char *manifest_file = NULL;
+    const char *summary_path = NULL;
+    const char *cost_config_path = g_getenv("SORTER_COST_CONFIG");
+    const char *balance = NULL;
+    const char *weights = NULL;
+    int num_workers = (int)g_get_num_processors();
+    bool use_snapshot = true;
     
-    GtkWidget *grid = gtk_grid_new();
-    gtk_grid_set_row_spacing(GTK_GRID(grid), 5);
-    gtk_grid_set_column_spacing(GTK_GRID(grid), 5);
-    gtk_widget_set_margin_start(grid, 5);
-    gtk_widget_set_margin_end(grid, 5);
-    gtk_widget_set_margin_top(grid, 5);
-    gtk_widget_set_margin_bottom(grid, 5);
+    ManifestSettings settings;
+    solve_options_init(&settings.solve);
+    settings.solve.num_threads = 1;
     
-    GtkWidget *file_label = gtk_label_new("Schülerdatei:");
-    GtkWidget *file_path_entry = gtk_entry_new();
-    GtkWidget *browse_button = gtk_button_new_with_label("Durchsuchen...");
-    GtkWidget *num_classes_label = gtk_label_new("Anzahl Klassen:");
-    GtkWidget *num_classes_entry = gtk_entry_new();
-    GtkWidget *start_button = gtk_button_new_with_label("Start");
+    // Checked first so that "--manifest --help" is not taken for a file name
+    if (has_option(argc, argv, "--help") || has_option(argc, argv, "-h")) {
+        print_manifest_usage(stderr, argv[0]);
+        return 2;
+    }
     
-    gtk_grid_attach(GTK_GRID(grid), file_label, 0, 0, 1, 1);
-    gtk_grid_attach(GTK_GRID(grid), file_path_entry, 1, 0, 1, 1);
-    gtk_grid_attach(GTK_GRID(grid), browse_button, 2, 0, 1, 1);
-    gtk_grid_attach(GTK_GRID(grid), num_classes_label, 0, 1, 1, 1);
-    gtk_grid_attach(GTK_GRID(grid), num_classes_entry, 1, 1, 1, 1);
-    gtk_grid_attach(GTK_GRID(grid), start_button, 1, 2, 1, 1);
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        
+        if (str_equal_case(arg, "--no-snapshot")) {
+            use_snapshot = false;
+            continue;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "Missing value for option %s\n", arg);
+            print_manifest_usage(stderr, argv[0]);
+            return 2;
+        }
+        
+        if (str_equal_case(arg, "--manifest")) manifest_file = value;
+        else if (str_equal_case(arg, "--summary")) summary_path = value;
+        else if (str_equal_case(arg, "--jobs")) num_workers = atoi(value);
+        else if (str_equal_case(arg, "--iterations")) settings.solve.max_iterations = atol(value);
+        else if (str_equal_case(arg, "--time-limit")) settings.solve.time_limit = atof(value);
+        else if (str_equal_case(arg, "--threads")) settings.solve.num_threads = atoi(value);
+        else if (str_equal_case(arg, "--seed")) settings.solve.seed = strtoull(value, NULL, 10);
+        else if (str_equal_case(arg, "--cost-config")) cost_config_path = value;
+        else if (str_equal_case(arg, "--weights")) weights = value;
+        else if (str_equal_case(arg, "--balance")) balance = value;
+        else if (str_equal_case(arg, "--solver")) {
+            if (!parse_solver_name(value, &settings.solve.mode)) return 2;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_manifest_usage(stderr, argv[0]);
+            return 2;
+        }
+        i++;
+    }
     
-    gtk_window_set_child(GTK_WINDOW(window), grid);
+    if (num_workers <= 0) {
+        fprintf(stderr, "Invalid --jobs\n");
+        return 2;
+    }
     
-    // Set up the browse button
-    g_object_set_data(G_OBJECT(browse_button), "entry", file_path_entry);
-    g_signal_connect(browse_button, "clicked", G_CALLBACK(browse_button_clicked), file_path_entry);
+    cost_model_init(&settings.cost);
+    if (!str_is_empty(cost_config_path) && !load_cost_config(cost_config_path, &settings.cost)) return 1;
+    if (balance != NULL && !parse_balanced_columns(balance, &settings.cost)) return 2;
+    if (weights != NULL && !parse_cost_weights(weights, &settings.cost)) return 2;
     
-    // Set up the start button
-    g_object_set_data(G_OBJECT(start_button), "app", app);
-    g_object_set_data(G_OBJECT(start_button), "file_path_entry", file_path_entry);
-    g_object_set_data(G_OBJECT(start_button), "num_classes_entry", num_classes_entry);
-    g_signal_connect(start_button, "clicked", G_CALLBACK(start_button_clicked), NULL);
+    ManifestJob *jobs = NULL;
+    int num_jobs = 0;
+    if (!load_manifest(manifest_file, &jobs, &num_jobs)) return 2;
+    for (int i = 0; i < num_jobs; i++) {
+        jobs[i].use_snapshot = jobs[i].use_snapshot && use_snapshot;
+    }
     
-    gtk_widget_set_visible(window, TRUE);
-}
-
-static void app_activate(GtkApplication *app, gpointer user_data) {
-    // Initialize rules
-    g_rules = g_array_new(FALSE, FALSE, sizeof(Rule));
+    FILE *summary = stdout;
+    if (summary_path != NULL && !str_equal_case(summary_path, "-")) {
+        summary = fopen(summary_path, "w");
+        if (summary == NULL) {
+            fprintf(stderr, "Could not open summary file: %s\n", summary_path);
+            free_manifest_jobs(jobs, num_jobs);
+            return 1;
+        }
+    }
     
-    // Create start screen
-    create_start_screen(app);
-}
-
-static void app_shutdown(GtkApplication *app, gpointer user_data) {
-    // Free memory before exiting
-    if (g_students != NULL) {
-        free_students(g_students, g_num_students);
-        g_students = NULL;
-        g_num_students = 0;
+    if (num_workers > num_jobs) num_workers = num_jobs;
+    gint64 start = g_get_monotonic_time();
+    GThreadPool *pool = g_thread_pool_new(run_manifest_job, &settings, num_workers, TRUE, NULL);
+    for (int i = 0; i < num_jobs; i++) {
+        g_thread_pool_push(pool, &jobs[i], NULL);
     }
+    g_thread_pool_free(pool, FALSE, TRUE); // Waits for every job
+    double elapsed = seconds_since(start);
     
-    if (g_rules != NULL) {
-        for (int i = 0; i < g_rules->len; i++) {
-            Rule *r = &g_array_index(g_rules, Rule, i);
-            free(r->student_a);
-            free(r->student_b);
-        }
-        g_array_free(g_rules, TRUE);
-        g_rules = NULL;
+    write_manifest_summary(summary, jobs, num_jobs);
+    int status = ferror(summary) ? 1 : 0;
+    if (summary != stdout) fclose(summary);
+    
+    int failed = 0;
+    double work = 0.0;
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].error != NULL) failed++;
+        work += jobs[i].total_seconds;
     }
+    fprintf(stderr, "%d of %d schools distributed in %.2f s (%.2f s of work on %d workers)\n",
+            num_jobs - failed, num_jobs, elapsed, work, num_workers);
+    if (failed > 0) status = 1;
+    
+    free_manifest_jobs(jobs, num_jobs);
+    return status;
 }
 
 int main(int argc, char *argv[]) {
+    if (is_batch_invocation(argc, argv)) {
+#ifdef GDK_WINDOWING_WIN32
+        // GUI-subsystem executables have no console; reuse the caller's
+        if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+            freopen("CONOUT$", "w", stdout);
+            freopen("CONOUT$", "w", stderr);
+        }
+#endif
+        return run_batch_mode(argc, argv);
+    }
+    
 #ifdef GDK_WINDOWING_WIN32
     // initialize COM for the native file-chooser
     CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
@@ -1175,7 +6641,6 @@ int main(int argc, char *argv[]) {
 
     GtkApplication *app = gtk_application_new("com.example.schoolsort", G_APPLICATION_DEFAULT_FLAGS);
     g_signal_connect(app, "activate", G_CALLBACK(app_activate), NULL);
-    g_signal_connect(app, "shutdown", G_CALLBACK(app_shutdown), NULL);
     
     int status = g_application_run(G_APPLICATION(app), argc, argv);
     g_object_unref(app);